@@ -0,0 +1,454 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Native microbenchmarks for the core data structures and the gc.
+ *
+ * Every benchmark is executed once to warm up, then MB_REPS times, and for
+ * each of them the median time per operation and the number of heap
+ * allocations (malloc/calloc/realloc calls) per operation are reported.
+ *
+ * Usage: microbench [-j] [filter]
+ *
+ * 	-j     : Print results as JSON instead of a table.
+ * 	filter : Run only the benchmarks whose name contains this string.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include "vm.h"
+#include "darray.h"
+
+using std::vector;
+
+#define MB_REPS 	11
+/*
+ * Sizes of the workloads, identifiers tables are usually small while
+ * the gc heap and its lists hold hundreds of thousands of items.
+ */
+#define MB_KEYS		1000
+#define MB_ITEMS	100000
+#define MB_OBJECTS	100000
+
+/*
+ * Count allocations interposing the libc allocator entry points,
+ * operator new ends up in malloc too.
+ */
+static size_t __mb_allocs = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+	void *__libc_malloc( size_t size );
+	void *__libc_calloc( size_t n, size_t size );
+	void *__libc_realloc( void *ptr, size_t size );
+
+	void *malloc( size_t size ){
+		__mb_allocs++;
+		return __libc_malloc(size);
+	}
+
+	void *calloc( size_t n, size_t size ){
+		__mb_allocs++;
+		return __libc_calloc( n, size );
+	}
+
+	void *realloc( void *ptr, size_t size ){
+		__mb_allocs++;
+		return __libc_realloc( ptr, size );
+	}
+}
+#endif
+
+typedef struct {
+	const char *name;
+	/*
+	 * Number of operations performed by a single call of 'run'.
+	 */
+	size_t		ops;
+	void	  (*run)( void );
+}
+mb_bench_t;
+
+typedef struct {
+	double ns_per_op;
+	double allocs_per_op;
+}
+mb_result_t;
+
+static vm_t *__mb_vm = NULL;
+static char  __mb_keys[MB_KEYS][32];
+static int   __mb_values[MB_ITEMS];
+
+static INLINE unsigned long long mb_now(){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** ascii_tree_t **/
+static void bench_at_insert_free(){
+	ascii_tree_t tree;
+	size_t i;
+
+	at_init_tree(tree);
+	for( i = 0; i < MB_KEYS; ++i ){
+		at_insert( &tree, __mb_keys[i], strlen(__mb_keys[i]), &__mb_values[i] );
+	}
+	at_free( &tree );
+}
+
+static void bench_at_find(){
+	static ascii_tree_t tree;
+	static bool 		filled = false;
+	size_t i;
+
+	if( !filled ){
+		at_init_tree(tree);
+		for( i = 0; i < MB_KEYS; ++i ){
+			at_insert( &tree, __mb_keys[i], strlen(__mb_keys[i]), &__mb_values[i] );
+		}
+		filled = true;
+	}
+	for( i = 0; i < MB_KEYS; ++i ){
+		at_find( &tree, __mb_keys[i], strlen(__mb_keys[i]) );
+	}
+}
+
+static void bench_at_insert_remove(){
+	ascii_tree_t tree;
+	size_t i;
+
+	at_init_tree(tree);
+	for( i = 0; i < MB_KEYS; ++i ){
+		at_insert( &tree, __mb_keys[i], strlen(__mb_keys[i]), &__mb_values[i] );
+	}
+	for( i = 0; i < MB_KEYS; ++i ){
+		at_remove( &tree, __mb_keys[i], strlen(__mb_keys[i]) );
+	}
+	at_free( &tree );
+}
+
+/** ITree<T> **/
+static void bench_itree_insert_clear(){
+	ITree<int> tree;
+	size_t i;
+
+	for( i = 0; i < MB_KEYS; ++i ){
+		tree.insert( __mb_keys[i], &__mb_values[i] );
+	}
+	tree.clear();
+}
+
+static void bench_itree_find(){
+	static ITree<int> tree;
+	size_t i;
+
+	if( tree.size() == 0 ){
+		for( i = 0; i < MB_KEYS; ++i ){
+			tree.insert( __mb_keys[i], &__mb_values[i] );
+		}
+	}
+	for( i = 0; i < MB_KEYS; ++i ){
+		tree.find( __mb_keys[i] );
+	}
+}
+
+static void bench_itree_iterate(){
+	static ITree<int> tree;
+	ITree<int>::iterator it;
+	volatile long sum = 0;
+	size_t i;
+
+	if( tree.size() == 0 ){
+		for( i = 0; i < MB_KEYS; ++i ){
+			tree.insert( __mb_keys[i], &__mb_values[i] );
+		}
+	}
+	for( it = tree.begin(); it != tree.end(); ++it ){
+		sum += *(*it)->value;
+	}
+}
+
+static void bench_itree_remove(){
+	ITree<int> tree;
+	size_t i;
+
+	for( i = 0; i < MB_KEYS; ++i ){
+		tree.insert( __mb_keys[i], &__mb_values[i] );
+	}
+	for( i = 0; i < MB_KEYS; ++i ){
+		tree.remove( __mb_keys[i] );
+	}
+}
+
+/** llist_t **/
+static void bench_ll_append_clear(){
+	llist_t list;
+	size_t i;
+
+	ll_init( &list );
+	for( i = 0; i < MB_ITEMS; ++i ){
+		ll_append( &list, &__mb_values[i] );
+	}
+	ll_clear( &list );
+}
+
+static void bench_ll_iterate(){
+	static llist_t list = { NULL, NULL, 0 };
+	volatile long sum = 0;
+	size_t i;
+
+	if( list.items == 0 ){
+		for( i = 0; i < MB_ITEMS; ++i ){
+			ll_append( &list, &__mb_values[i] );
+		}
+	}
+	ll_foreach( &list, item ){
+		sum += *ll_data( int *, item );
+	}
+}
+
+static void bench_ll_pop(){
+	llist_t list;
+	size_t i;
+
+	ll_init( &list );
+	for( i = 0; i < MB_ITEMS; ++i ){
+		ll_append( &list, &__mb_values[i] );
+	}
+	while( list.items ){
+		ll_pop( &list );
+	}
+}
+
+/** darray_t **/
+/*
+ * da_next and da_at index the buffer by byte, so single byte items are the
+ * only ones handled consistently, and da_remove moves 'usage' bytes past the
+ * removed item, therefore it's left out.
+ */
+static void bench_da_next_free(){
+	darray_t da;
+	size_t i;
+
+	da_init( &da, sizeof(byte) );
+	for( i = 0; i < MB_ITEMS; ++i ){
+		*(byte *)da_next( &da ) = (byte)i;
+	}
+	da_free( &da );
+}
+
+static void bench_da_iterate(){
+	static darray_t da = { 0, 0, 0, 0, NULL };
+	volatile long sum = 0;
+	size_t i;
+
+	if( da.data == NULL ){
+		da_init( &da, sizeof(byte) );
+		for( i = 0; i < MB_ITEMS; ++i ){
+			*(byte *)da_next( &da ) = (byte)i;
+		}
+	}
+	for( i = 0; i < da_size(&da); ++i ){
+		sum += *da_at( &da, i );
+	}
+}
+
+/** MemorySegment **/
+static void bench_vmem_add_release(){
+	MemorySegment frame;
+	Object *value = (Object *)gc_new_integer(1);
+	size_t i;
+
+	for( i = 0; i < MB_KEYS; ++i ){
+		frame.add( __mb_keys[i], value );
+	}
+	frame.release();
+	/*
+	 * Every add clones the value, get rid of the garbage.
+	 */
+	gc_collect( __mb_vm );
+}
+
+static void bench_vmem_get(){
+	static MemorySegment *frame = NULL;
+	size_t i;
+
+	if( frame == NULL ){
+		frame = new MemorySegment();
+		for( i = 0; i < MB_KEYS; ++i ){
+			frame->insert( __mb_keys[i], (Object *)gc_new_integer(i) );
+		}
+		gc_add_root( frame );
+	}
+	for( i = 0; i < MB_KEYS; ++i ){
+		frame->get( __mb_keys[i] );
+	}
+}
+
+/** gc **/
+static void bench_gc_track_integer(){
+	size_t i;
+
+	for( i = 0; i < MB_OBJECTS; ++i ){
+		gc_new_integer(i);
+	}
+	gc_collect( __mb_vm );
+}
+
+static void bench_gc_track_string(){
+	size_t i;
+
+	for( i = 0; i < MB_OBJECTS; ++i ){
+		gc_new_string( __mb_keys[ i % MB_KEYS ] );
+	}
+	gc_collect( __mb_vm );
+}
+
+static void bench_gc_collect_vectors(){
+	Vector *v;
+	size_t i;
+
+	for( i = 0; i < MB_OBJECTS / 10; ++i ){
+		v = gc_new_vector();
+		ob_cl_push_reference( (Object *)v, (Object *)gc_new_integer(i) );
+		ob_cl_push_reference( (Object *)v, (Object *)gc_new_float(i) );
+		ob_cl_push_reference( (Object *)v, (Object *)gc_new_string( __mb_keys[ i % MB_KEYS ] ) );
+	}
+	gc_collect( __mb_vm );
+}
+
+static mb_bench_t __mb_benchmarks[] = {
+	{ "asciitree.insert+free",   MB_KEYS,  	   bench_at_insert_free },
+	{ "asciitree.find",          MB_KEYS,  	   bench_at_find },
+	{ "asciitree.insert+remove", MB_KEYS,  	   bench_at_insert_remove },
+	{ "itree.insert+clear",      MB_KEYS,  	   bench_itree_insert_clear },
+	{ "itree.find",              MB_KEYS,  	   bench_itree_find },
+	{ "itree.iterate",           MB_KEYS,  	   bench_itree_iterate },
+	{ "itree.insert+remove",     MB_KEYS,  	   bench_itree_remove },
+	{ "llist.append+clear",      MB_ITEMS, 	   bench_ll_append_clear },
+	{ "llist.iterate",           MB_ITEMS, 	   bench_ll_iterate },
+	{ "llist.append+pop",        MB_ITEMS, 	   bench_ll_pop },
+	{ "darray.next+free",        MB_ITEMS, 	   bench_da_next_free },
+	{ "darray.iterate",          MB_ITEMS, 	   bench_da_iterate },
+	{ "vmem.add+release",        MB_KEYS,  	   bench_vmem_add_release },
+	{ "vmem.get",                MB_KEYS,  	   bench_vmem_get },
+	{ "gc.integer+collect",      MB_OBJECTS,    bench_gc_track_integer },
+	{ "gc.string+collect",       MB_OBJECTS,    bench_gc_track_string },
+	{ "gc.vector+collect",       MB_OBJECTS / 10, bench_gc_collect_vectors },
+	{ NULL, 0, NULL }
+};
+
+static mb_result_t mb_run( mb_bench_t *bench ){
+	vector<double> ns;
+	vector<double> allocs;
+	unsigned long long start;
+	size_t before, i;
+	mb_result_t result;
+
+	/* warm up */
+	bench->run();
+
+	for( i = 0; i < MB_REPS; ++i ){
+		before = __mb_allocs;
+		start  = mb_now();
+
+		bench->run();
+
+		ns.push_back( (double)(mb_now() - start) / bench->ops );
+		allocs.push_back( (double)(__mb_allocs - before) / bench->ops );
+	}
+
+	std::sort( ns.begin(), ns.end() );
+	std::sort( allocs.begin(), allocs.end() );
+
+	result.ns_per_op 	 = ns[ MB_REPS / 2 ];
+	result.allocs_per_op = allocs[ MB_REPS / 2 ];
+
+	return result;
+}
+
+int main( int argc, char **argv ){
+	const char *filter = NULL;
+	bool 		json   = false,
+				first  = true;
+	mb_result_t result;
+	size_t 		i;
+
+	for( i = 1; i < (size_t)argc; ++i ){
+		if( strcmp( argv[i], "-j" ) == 0 ){
+			json = true;
+		}
+		else{
+			filter = argv[i];
+		}
+	}
+
+	for( i = 0; i < MB_KEYS; ++i ){
+		sprintf( __mb_keys[i], "identifier_%lu", i );
+	}
+	for( i = 0; i < MB_ITEMS; ++i ){
+		__mb_values[i] = i;
+	}
+	/*
+	 * An empty virtual machine, the benchmarks register their own
+	 * roots, and every gc_collect call performs a full collection.
+	 */
+	__mb_vm = vm_create();
+	gc_set_collect_threshold(0);
+
+	if( json ){
+		printf( "[" );
+	}
+	else{
+		printf( "%-26s %12s %12s\n", "benchmark", "ns/op", "allocs/op" );
+	}
+
+	for( i = 0; __mb_benchmarks[i].name != NULL; ++i ){
+		if( filter && strstr( __mb_benchmarks[i].name, filter ) == NULL ){
+			continue;
+		}
+
+		result = mb_run( &__mb_benchmarks[i] );
+
+		if( json ){
+			printf( "%s\n  { \"name\": \"%s\", \"ops\": %lu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f }",
+					first ? "" : ",",
+					__mb_benchmarks[i].name,
+					__mb_benchmarks[i].ops,
+					result.ns_per_op,
+					result.allocs_per_op );
+			first = false;
+		}
+		else{
+			printf( "%-26s %12.2f %12.3f\n", __mb_benchmarks[i].name, result.ns_per_op, result.allocs_per_op );
+		}
+		fflush(stdout);
+	}
+
+	if( json ){
+		printf( "\n]\n" );
+	}
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# This file is part of the Hybris programming language.
+#
+# Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+#
+# Hybris is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Hybris is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Script benchmarks runner.
+#
+# Every bench/*.hy script with an '@ops N' tag in its header is executed
+# BENCH_WARMUP times to warm up caches, then BENCH_REPS times measuring the
+# wall clock time of each run. The results (median, p95, min, max and
+# operations per second computed on the median) are printed as JSON on
+# stdout, or written to BENCH_OUTPUT if it's set.
+#
+# Usage : bench/run.sh [hybris binary] [script.hy ...]
+#
+HYBRIS=${1:-hybris}
+[ $# -gt 0 ] && shift
+
+WARMUP=${BENCH_WARMUP:-2}
+REPS=${BENCH_REPS:-10}
+BENCH_DIR=$(dirname "$0")
+
+if [ $# -eq 0 ]; then
+	set -- "$BENCH_DIR"/*.hy
+fi
+
+now_ns(){
+	date +%s%N
+}
+
+run_script(){
+	"$HYBRIS" "$1" > /dev/null 2>&1
+}
+
+{
+	printf '{\n'
+	printf '  "hybris": "%s",\n' "$HYBRIS"
+	printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+	printf '  "warmup": %d,\n' "$WARMUP"
+	printf '  "repetitions": %d,\n' "$REPS"
+	printf '  "benchmarks": ['
+
+	sep=""
+	for script in "$@"; do
+		ops=$(sed -n 's/^.*@ops[ \t]*\([0-9][0-9]*\).*$/\1/p' "$script" | head -n 1)
+		# not a suite benchmark
+		[ -z "$ops" ] && continue
+
+		name=$(basename "$script" .hy)
+		printf '%s\n    { "name": "%s", "ops": %s, ' "$sep" "$name" "$ops"
+		sep=","
+
+		i=0
+		while [ $i -lt "$WARMUP" ]; do
+			run_script "$script"
+			i=$((i + 1))
+		done
+
+		samples=""
+		failed=0
+		i=0
+		while [ $i -lt "$REPS" ]; do
+			start=$(now_ns)
+			if ! run_script "$script"; then
+				failed=1
+				break
+			fi
+			end=$(now_ns)
+			samples="$samples $((end - start))"
+			i=$((i + 1))
+		done
+
+		if [ $failed -ne 0 ]; then
+			printf '"error": "script exited with a non zero status" }'
+			echo "$name : FAILED" >&2
+			continue
+		fi
+
+		# nearest rank percentiles over the sorted samples, in milliseconds
+		echo $samples | tr ' ' '\n' | sort -n | awk -v ops="$ops" '
+			{ t[NR] = $1 }
+			END {
+				n      = NR;
+				median = (n % 2) ? t[(n + 1) / 2] : (t[n / 2] + t[n / 2 + 1]) / 2;
+				r95    = int(0.95 * n); if( r95 < 0.95 * n ){ r95++ }
+				printf "\"median_ms\": %.3f, \"p95_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, \"ops_per_sec\": %.1f }",
+					   median / 1e6, t[r95] / 1e6, t[1] / 1e6, t[n] / 1e6, ops / (median / 1e9);
+			}'
+		echo "$name : done" >&2
+	done
+
+	printf '\n  ]\n}\n'
+} > "${BENCH_OUTPUT:-/dev/stdout}"
@@ -80,6 +80,16 @@ typedef struct {
 
     ulong gc_threshold;
     ulong mm_threshold;
+
+    char  profile[0xFF];
+
+    bool  trace_calls;
+
+    char  heatmap[0xFF];
+
+    bool  perf_map;
+
+    bool  gc_log;
 }
 vm_args_t;
 /*
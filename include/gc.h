@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <pthread.h>
+#include <string.h>
+#include <time.h>
 #include "llist.h"
 #include "config.h"
 
@@ -35,6 +37,52 @@
 
 typedef unsigned long ulong;
 
+/*
+ * Global flag set right before the first worker thread is spawned.
+ * Until then the process is single threaded, so every vm, gc and
+ * memory segment mutex operation is skipped to save the lock/unlock
+ * overhead on each executed node.
+ * Once set it's never reset.
+ */
+extern volatile bool __hyb_threaded;
+/*
+ * Lock and unlock a mutex only if the process is multi threaded.
+ */
+INLINE void hyb_mutex_lock( pthread_mutex_t *mutex ){
+	if( __hyb_threaded ){
+		pthread_mutex_lock( mutex );
+	}
+}
+
+INLINE void hyb_mutex_unlock( pthread_mutex_t *mutex ){
+	if( __hyb_threaded ){
+		pthread_mutex_unlock( mutex );
+	}
+}
+/*
+ * Switch the process to multi threaded mode, must be called
+ * before any thread is created and while the caller is not
+ * holding any of the vm/gc mutexes, otherwise a lock taken as
+ * a no-op would be released for real.
+ */
+INLINE void hyb_set_threaded(){
+	if( __hyb_threaded == false ){
+		__sync_synchronize();
+		__hyb_threaded = true;
+		__sync_synchronize();
+	}
+}
+/*
+ * Monotonic timestamp in nanoseconds, used for gc timings.
+ */
+INLINE ulong gc_now(){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
 /*
  * This is a mark-and-sweep garbage collector implementation.
  *
@@ -62,6 +110,7 @@ typedef unsigned long ulong;
 
 typedef struct _Object Object;
 typedef struct _vm_t   vm_t;
+class MemorySegment;
 /*
  * Threshold upon which an object is moved from the heap
  * space to the lag space, where 0.7 is 70% object collections
@@ -72,6 +121,52 @@ typedef struct _vm_t   vm_t;
  * Determine if an object has to be moved to the lag space.
  */
 #define GC_IS_LAGGING(v)     		  v / (double)__gc.collections >= GC_LAGGING_THRESHOLD
+/*
+ * Number of buckets of the pause time histogram, bucket 0 counts pauses
+ * shorter than 2us, bucket i pauses in [2^i, 2^(i+1)) us and the last one
+ * everything longer.
+ */
+#define GC_PAUSE_BUCKETS			  24
+/*
+ * Collection statistics.
+ *
+ * heap_collections   : Number of heap generation sweeps.
+ * lag_collections    : Number of lag space sweeps.
+ * allocated_objects  : Objects tracked since the start.
+ * allocated_bytes    : Bytes tracked since the start.
+ * freed_objects      : Objects released by collections.
+ * freed_bytes        : Bytes released by collections.
+ * promoted           : Objects moved from the heap to the lag space.
+ * last_*             : Same counters, for the last collection only.
+ * mark_time          : Total time spent marking, in nanoseconds.
+ * sweep_time         : Total time spent sweeping, in nanoseconds.
+ * last_mark_time     : Mark time of the last collection.
+ * last_sweep_time    : Sweep time of the last collection.
+ * max_pause          : Longest collection pause.
+ * pauses             : Pause time histogram (see GC_PAUSE_BUCKETS).
+ * started            : Timestamp of the gc initialization, used to
+ * 						compute the allocation rate.
+ */
+typedef struct {
+	size_t heap_collections;
+	size_t lag_collections;
+	size_t allocated_objects;
+	size_t allocated_bytes;
+	size_t freed_objects;
+	size_t freed_bytes;
+	size_t promoted;
+	size_t last_freed_objects;
+	size_t last_freed_bytes;
+	size_t last_promoted;
+	ulong  mark_time;
+	ulong  sweep_time;
+	ulong  last_mark_time;
+	ulong  last_sweep_time;
+	ulong  max_pause;
+	size_t pauses[GC_PAUSE_BUCKETS];
+	ulong  started;
+}
+gc_stats_t;
 /*
  * Main gc structure, kind of the "head" of the pool.
  *
@@ -80,20 +175,28 @@ typedef struct _vm_t   vm_t;
  * 				  amount of collections, it's going to be moved to this
  * 				  lag space.
  * heap         : Heap objects list.
+ * roots        : Memory segments registered as additional root sets.
+ * walkers      : Native root set walkers (see gc_add_root_walker).
  * collections  : Collection cycles counter.
  * usage	    : Global memory usage, in bytes.
  * gc_threshold : If usage >= this, the gc is triggered.
  * mm_threshold : If usage >= this, a memory exhausted error is triggered.
+ * stats		: Collection statistics.
+ * log			: If true, print a line for each collection to stderr.
  * mutex        : Mutex to lock the pool while collecting.
  */
 typedef struct _gc {
 	llist_t		constants;
 	llist_t		lag;
 	llist_t		heap;
+	llist_t		roots;
+	llist_t		walkers;
 	size_t		collections;
     size_t     	usage;
     size_t     	gc_threshold;
     size_t		mm_threshold;
+    gc_stats_t	stats;
+    bool		log;
 	pthread_mutex_t mutex;
 
 	_gc(){
@@ -101,11 +204,17 @@ typedef struct _gc {
 		usage        = 0;
 		gc_threshold = GC_DEFAULT_MEMORY_THRESHOLD;
 		mm_threshold = GC_ALLOWED_MEMORY_THRESHOLD;
+		log			 = false;
 		mutex        = PTHREAD_MUTEX_INITIALIZER;
 
+		memset( &stats, 0x00, sizeof(gc_stats_t) );
+		stats.started = gc_now();
+
 		ll_init( &constants );
 		ll_init( &lag );
 		ll_init( &heap );
+		ll_init( &roots );
+		ll_init( &walkers );
 	}
 }
 gc_t;
@@ -120,6 +229,14 @@ size_t			gc_set_collect_threshold( size_t threshold );
  * Return the old threshold value.
  */
 size_t			gc_set_mm_threshold( size_t threshold );
+/*
+ * Enable or disable the per collection log line.
+ */
+void			gc_set_log( bool enabled );
+/*
+ * Copy current collection statistics into 'stats'.
+ */
+void			gc_get_stats( gc_stats_t *stats );
 /* 
  * Add an object to the gc pool and start to track
  * it for reference changes.
@@ -127,6 +244,12 @@ size_t			gc_set_mm_threshold( size_t threshold );
  * possibility.
  */
 Object 		   *gc_track( Object *o, size_t size );
+/*
+ * Update the memory footprint of an already tracked object
+ * whose inner buffers grew or shrunk, adjusting the global
+ * usage counter by the difference.
+ */
+void			gc_resize( Object *o, size_t size );
 /*
  * Return the number of objects tracked by the gc.
  */
@@ -158,6 +281,53 @@ void 			gc_mark( Object *o, bool mark = true );
  * as collectable.
  */
 #define 		gc_set_dead(o)  gc_mark( o, false )
+/*
+ * Register a memory segment that is not part of any thread scope
+ * (for instance the arguments of a queued task) as a root set, so
+ * its objects will be considered alive until gc_remove_root is called.
+ */
+void			gc_add_root( MemorySegment *root );
+/*
+ * Unregister a root set previously added with gc_add_root.
+ */
+void			gc_remove_root( MemorySegment *root );
+/*
+ * Heap walking callback, 'o' is the visited object and 'data' the
+ * pointer given to the walking routine.
+ */
+typedef void (*gc_visitor_t)( Object *o, void *data );
+/*
+ * Native root set walker, called with the 'data' pointer it was
+ * registered with, it has to call 'visitor' (passing 'vdata') on every
+ * object the native structure holds (for instance the objects queued
+ * inside a channel).
+ * During the mark phase the visitor marks objects as alive, while
+ * gc_walk_roots passes its own visitor.
+ */
+typedef void (*gc_root_walker_t)( void *data, gc_visitor_t visitor, void *vdata );
+
+typedef struct {
+	gc_root_walker_t walker;
+	void 		    *data;
+}
+gc_walker_t;
+/*
+ * Register and unregister a native root set walker.
+ */
+void			gc_add_root_walker( gc_root_walker_t walker, void *data );
+void			gc_remove_root_walker( gc_root_walker_t walker, void *data );
+/*
+ * Call 'visitor' for each object tracked by the gc (heap, lag space
+ * and constants), with the gc pool locked.
+ */
+void			gc_walk_objects( gc_visitor_t visitor, void *data );
+/*
+ * Call 'visitor' for each object directly referenced by a root set
+ * (thread scopes frames, registered roots and native root walkers)
+ * and for each constant.
+ * The caller must hold the vm memory lock.
+ */
+void			gc_walk_roots( vm_t *vm, gc_visitor_t visitor, void *data );
 /*
  * Fire the collection routines if the memory usage is
  * above the threshold.
@@ -0,0 +1,85 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _HHEATMAP_H_
+#	define _HHEATMAP_H_
+
+#include "common.h"
+
+typedef struct _vm_t vm_t;
+class Node;
+
+/*
+ * Line level execution heatmap.
+ *
+ * Each node knows the source file (as an index of the heatmap sources
+ * table) and the line it was parsed from, when the heatmap is enabled
+ * vm_exec accounts every node evaluation on per thread arrays indexed
+ * by source and line :
+ *
+ * 	- hits : number of statements executed on that line.
+ * 	- time : time elapsed from the evaluation of a node of that line
+ * 			 to the evaluation of the next node, so nested calls are
+ * 			 accounted on the lines of the called function.
+ *
+ * At exit the arrays of each thread are merged and written either as
+ * an annotated source listing or, if the output file name ends with
+ * ".json", as a json document.
+ */
+extern volatile bool __hm_enabled;
+/*
+ * Index of the source file being parsed by the current thread, stored
+ * on each new node.
+ */
+extern __thread unsigned int __hm_source;
+/*
+ * Maximum number of distinct source files.
+ */
+#define HM_MAX_SOURCES 4096
+
+/*
+ * Intern 'path' in the sources table and make it the current
+ * parsing source, return the previous one.
+ */
+unsigned int hm_set_source( const char *path );
+/*
+ * Restore a previous parsing source.
+ */
+void		 hm_restore_source( unsigned int source );
+/*
+ * Return the name of a source index, safe to be called without locks.
+ */
+const char  *hm_source_name( unsigned int source );
+/*
+ * Enable the heatmap, the output will be written to 'filename'.
+ */
+void 		 hm_start( vm_t *vm, const char *filename );
+/*
+ * Disable the heatmap, merge and write the collected data.
+ */
+void 		 hm_stop( vm_t *vm );
+/*
+ * Account the evaluation of 'node'.
+ */
+void 		 hm_hit( Node *node );
+
+#define hm_exec_hook(node) if( __hm_enabled ){ \
+							   hm_hit(node); \
+						   }
+
+#endif
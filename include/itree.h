@@ -123,6 +123,14 @@ public  :
     INLINE unsigned int size(){
 		return m_elements;
 	}
+    /*
+     * Estimate the memory used by the table itself (not by the values), counting
+     * the index vector, one pair and one tree node for each element.
+     */
+    INLINE size_t footprint(){
+		return m_map.capacity() * sizeof(pair_t *) +
+			   m_elements * (sizeof(pair_t) + sizeof(ascii_tree_t));
+	}
     /* Get the value of the item at 'index' position */
     INLINE value_t *at( unsigned int index ){
         return m_map[index]->value;
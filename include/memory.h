@@ -103,6 +103,10 @@ class MemorySegment : public ITree<Object> {
 		 * Name of the function/method that owns this stack.
 		 */
 		string			owner;
+		/*
+		 * Last line executed inside this frame.
+		 */
+		size_t			lineno;
 		/*
 		 * Virtual memory frame state.
 		 */
@@ -102,6 +102,10 @@ class Node {
 public  :
 
 	size_t		 lineno;
+	/*
+	 * Index of the source file in the heatmap sources table.
+	 */
+	unsigned int source;
 	H_NODE_TYPE  type;
 	int      	 opcode;
     Node		*body;
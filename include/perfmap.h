@@ -0,0 +1,76 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _HPERFMAP_H_
+#	define _HPERFMAP_H_
+
+#include "common.h"
+#include <string>
+
+using std::string;
+
+typedef struct _vm_t vm_t;
+class Node;
+typedef struct _Object Object;
+class MemorySegment;
+typedef MemorySegment vframe_t;
+
+/*
+ * Perf map support.
+ *
+ * Native profilers only see the recursion of vm_exec while a script
+ * runs, to let them tell script functions apart, when enabled each user
+ * function or method body is executed through its own small trampoline
+ * (a copy of the same few instructions calling vm_exec at a distinct
+ * address), and the address range of each trampoline is written with the
+ * script function name to /tmp/perf-<pid>.map, the file 'perf report'
+ * uses to symbolize jitted code.
+ *
+ * Supported on x86_64 and aarch64 only, on other architectures the
+ * option is ignored.
+ * Frame pointer based call graphs also need the interpreter to be built
+ * with -DWITH_FRAME_POINTERS=ON.
+ */
+extern volatile bool __pm_enabled;
+
+/*
+ * Number of trampolines allocated at once and size of each one.
+ */
+#define PM_CHUNK_SLOTS 2048
+#define PM_SLOT_SIZE   32
+
+/*
+ * Create the map file and enable trampolines.
+ */
+void    pm_start( vm_t *vm );
+/*
+ * Disable trampolines and close the map file.
+ */
+void    pm_stop( vm_t *vm );
+/*
+ * Execute 'body' of 'function' (named 'name') with the given frame
+ * through the function trampoline.
+ */
+Object *pm_exec( vm_t *vm, vframe_t *frame, Node *function, const string& name, Node *body );
+
+/*
+ * Execute a function body, eventually through its trampoline.
+ */
+#define pm_exec_body( vm, frame, function, name, body ) ( __pm_enabled ? pm_exec( vm, frame, function, name, body ) : vm_exec( vm, frame, body ) )
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _HPROBES_H_
+#	define _HPROBES_H_
+
+#include "config.h"
+
+/*
+ * Static tracepoints (USDT) of the "hybris" provider, they can be listed
+ * with 'perf list sdt_hybris:*' or 'bpftrace -l usdt:/path/to/libhybris.so:*'
+ * and cost a single nop when not attached :
+ *
+ * 	function__entry( name, file, line )
+ * 	function__return( name, file, line )
+ * 	gc__start( usage )
+ * 	gc__done( usage, collections )
+ * 	object__alloc( type, size )
+ * 	exception__throw( file, line )
+ * 	module__load( name, path )
+ *
+ * If sys/sdt.h is not available at compile time, probes are compiled out.
+ */
+#ifdef HAVE_SYS_SDT_H
+#	include <sys/sdt.h>
+#	define hyb_probe_function_entry( name, file, line ) DTRACE_PROBE3( hybris, function__entry, name, file, line )
+#	define hyb_probe_function_return( name, file, line ) DTRACE_PROBE3( hybris, function__return, name, file, line )
+#	define hyb_probe_gc_start( usage ) DTRACE_PROBE1( hybris, gc__start, usage )
+#	define hyb_probe_gc_done( usage, collections ) DTRACE_PROBE2( hybris, gc__done, usage, collections )
+#	define hyb_probe_object_alloc( type, size ) DTRACE_PROBE2( hybris, object__alloc, type, size )
+#	define hyb_probe_exception_throw( file, line ) DTRACE_PROBE2( hybris, exception__throw, file, line )
+#	define hyb_probe_module_load( name, path ) DTRACE_PROBE2( hybris, module__load, name, path )
+#else
+#	define hyb_probe_function_entry( name, file, line )
+#	define hyb_probe_function_return( name, file, line )
+#	define hyb_probe_gc_start( usage )
+#	define hyb_probe_gc_done( usage, collections )
+#	define hyb_probe_object_alloc( type, size )
+#	define hyb_probe_exception_throw( file, line )
+#	define hyb_probe_module_load( name, path )
+#endif
+
+#endif
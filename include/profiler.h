@@ -0,0 +1,70 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _HPROFILER_H_
+#	define _HPROFILER_H_
+
+#include "common.h"
+
+typedef struct _vm_t vm_t;
+
+/*
+ * Sampling profiler.
+ *
+ * Once started, the process receives a SIGPROF every PROF_INTERVAL_US
+ * microseconds of cpu time, the signal handler walks the frames of the
+ * interrupted thread scope and records each frame owner and the line
+ * it's executing.
+ * When stopped, samples are aggregated and written to the output file
+ * in the folded stacks format used by flamegraph tools :
+ *
+ * 		<main>:10;foo:3;bar:7 42
+ *
+ * The signal handler does not allocate memory nor take any mutex, samples
+ * are aggregated by stack in a fixed size lock-free hash table, so long
+ * runs only cost one counter increment for each already seen stack, and
+ * frame names are interned in another fixed size lock-free table.
+ */
+#define PROF_INTERVAL_US 1000
+/*
+ * Maximum number of frames recorded for each sample.
+ */
+#define PROF_MAX_DEPTH   128
+/*
+ * Number of distinct stacks of the aggregation table (about 16MB of
+ * virtual memory, pages are only committed when actually used) and
+ * max number of entries probed for each sample.
+ */
+#define PROF_MAX_STACKS  16384
+#define PROF_MAX_PROBES  256
+/*
+ * Size of the frame names intern table and max length of each name.
+ */
+#define PROF_MAX_NAMES   8192
+#define PROF_NAME_SIZE   64
+
+/*
+ * Start sampling, the output will be written to 'filename'.
+ */
+void prof_start( vm_t *vm, const char *filename );
+/*
+ * Stop sampling and write the folded stacks.
+ */
+void prof_stop( vm_t *vm );
+
+#endif
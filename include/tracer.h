@@ -0,0 +1,78 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _HTRACER_H_
+#	define _HTRACER_H_
+
+#include "common.h"
+#include <string>
+
+using std::string;
+
+typedef struct _vm_t vm_t;
+
+/*
+ * Deterministic call tracer.
+ *
+ * When enabled, every function, method, operator and descriptor call
+ * is timed with CLOCK_MONOTONIC_RAW timestamps and accounted on a per
+ * thread table, so threads never contend for a lock while tracing.
+ * At exit all the tables are merged and a report with calls count,
+ * inclusive time, exclusive (self) time and object allocations for
+ * each function is printed.
+ */
+extern volatile bool __trc_enabled;
+/*
+ * Number of objects allocated by the current thread, updated
+ * by gc_track.
+ */
+extern __thread ulong __trc_allocs;
+
+/*
+ * Enable the tracer.
+ */
+void trc_start( vm_t *vm );
+/*
+ * Disable the tracer and print the report.
+ */
+void trc_stop( vm_t *vm );
+/*
+ * Record the entering and the leaving of a call.
+ */
+void trc_enter( const string& name );
+void trc_leave();
+/*
+ * Record the entering of a method call, the "type::method" name is
+ * built and interned only once per thread for each pair.
+ */
+void trc_enter_method( const char *type, const char *method );
+
+/*
+ * Cheap hooks to be used around calls.
+ */
+#define trc_enter_call(name) if( __trc_enabled ){ \
+								 trc_enter(name); \
+							 }
+#define trc_leave_call()     if( __trc_enabled ){ \
+								 trc_leave(); \
+							 }
+#define trc_count_alloc()    if( __trc_enabled ){ \
+								 ++__trc_allocs; \
+							 }
+
+#endif
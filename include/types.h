@@ -22,6 +22,7 @@
 #include "common.h"
 #include "gc.h"
 #include "itree.h"
+#include "tracer.h"
 #include <stdarg.h>
 #include <string>
 #include <vector>
@@ -379,6 +380,12 @@ typedef struct _object_type_t {
     ob_unary_function_t         clone;
     ob_free_function_t          free;
     ob_size_function_t			get_size;
+    /*
+     * Real memory footprint of the object, inner buffers included, used
+     * by the gc to keep its usage counter accurate, 0 if the basic type
+     * size is enough.
+     */
+    ob_size_function_t			get_footprint;
     ob_serialize_function_t     serialize;
     ob_deserialize_function_t   deserialize;
     ob_to_fd_t					to_fd;
@@ -493,6 +500,10 @@ bool    ob_free( Object *o );
  * Return the size of the object or, in case it's a collection, the number of its elements.
  */
 size_t  ob_get_size( Object *o );
+/*
+ * Return the real memory footprint of the object, in bytes.
+ */
+size_t  ob_get_footprint( Object *o );
 /*
  * Serialize the object to a binary stream.
  */
@@ -908,6 +919,12 @@ typedef struct _Binary {
 Binary;
 
 typedef vector<Object *>::iterator BinaryIterator;
+/*
+ * Store 'size' bytes at 'offset' in the binary, which is resized to
+ * offset + size bytes, existing chars are overwritten in place so a
+ * reused buffer doesn't allocate new objects.
+ */
+void binary_set_bytes( Object *me, size_t offset, const char *data, size_t size );
 
 DECLARE_TYPE(Vector);
 
@@ -983,11 +1000,11 @@ typedef struct _class_attribute_t {
 	}
 
 	INLINE void lock(){
-		if( is_static ){ pthread_mutex_lock(&mutex); }
+		if( is_static ){ hyb_mutex_lock(&mutex); }
 	}
 
 	INLINE void unlock(){
-		if( is_static ){ pthread_mutex_unlock(&mutex); }
+		if( is_static ){ hyb_mutex_unlock(&mutex); }
 	}
 }
 class_attribute_t;
@@ -1027,6 +1044,12 @@ Class;
 typedef ITree<class_attribute_t>::iterator ClassAttributeIterator;
 typedef ITree<class_method_t>::iterator	   ClassMethodIterator;
 typedef vector<Node *>::iterator	 	   ClassPrototypesIterator;
+/*
+ * Call a descriptor method of a class instance (__size, __to_string, ...),
+ * if 'lazy' is true and the class does not define it, return H_UNDEFINED
+ * instead of raising an error.
+ */
+Object *class_call_overloaded_descriptor( Object *me, const char *ds_name, bool lazy, int argc, ... );
 
 DECLARE_TYPE(Reference);
 
@@ -1042,15 +1065,33 @@ Reference;
 
 DECLARE_TYPE(Handle);
 
+typedef void (*handle_finalizer_t)( void *value );
+
 typedef struct _Handle {
     BASE_OBJECT_HEADER;
-    void *value;
+    void 			  *value;
+    /*
+     * Optional finalizer of the value, called when the last handle
+     * sharing it is freed ('refs' is shared among clones).
+     */
+    handle_finalizer_t finalizer;
+    size_t			  *refs;
 
-    _Handle( void *v ) : BASE_OBJECT_HEADER_INIT(Handle), value(v) {
+    _Handle( void *v ) : BASE_OBJECT_HEADER_INIT(Handle), value(v), finalizer(NULL), refs(NULL) {
 
     }
 }
 Handle;
+/*
+ * Make the handle own its value, 'finalizer' will be called on it
+ * once this handle and all of its clones are collected.
+ */
+void handle_set_finalizer( Handle *h, handle_finalizer_t finalizer );
+/*
+ * Release the reference 'h' holds on its value, calling the finalizer
+ * if it was the last one, only the gc calls it upon deletion.
+ */
+void handle_release( Handle *h );
 /*
  * Inline handlers implementation
  */
@@ -1090,6 +1131,24 @@ INLINE size_t ob_get_size( Object *o ){
 	return (o->type->get_size ? o->type->get_size(o) : o->type->size);
 }
 
+INLINE size_t ob_get_footprint( Object *o ){
+	return (o->type->get_footprint ? o->type->get_footprint(o) : o->type->size);
+}
+
+/*
+ * Called after every operation that could grow or shrink the inner buffers
+ * of an object, if its footprint changed, update the gc usage counter.
+ * Objects not tracked by the gc (gc_size == 0) are ignored.
+ */
+INLINE void ob_update_footprint( Object *o ){
+	if( o->type->get_footprint != NULL && o->gc_size != 0 ){
+		size_t size = o->type->get_footprint(o);
+		if( size != o->gc_size ){
+			gc_resize( o, size );
+		}
+	}
+}
+
 INLINE byte * ob_serialize( Object *o, size_t size ){
 	if( o->type->serialize != NULL ){
 		return o->type->serialize(o,size);
@@ -1240,7 +1299,11 @@ INLINE Object *ob_assign( Object *a, Object *b ){
      *
      * 		ob_free(a)  --> a->ref--
 	 */
-	return a->type->assign(a,b);
+	Object *ret = a->type->assign(a,b);
+
+	ob_update_footprint(ret);
+
+	return ret;
 }
 
 INLINE Object *ob_factorial( Object *o ){
@@ -1326,7 +1389,11 @@ INLINE Object *ob_mod( Object *a, Object *b ){
 
 INLINE Object *ob_inplace_add( Object *a, Object *b ){
 	if( a->type->inplace_add != NULL ){
-		return a->type->inplace_add(a,b);
+		Object *ret = a->type->inplace_add(a,b);
+
+		ob_update_footprint(a);
+
+		return ret;
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "invalid '+=' operator for object type '%s'", ob_typename(a) );
@@ -1551,7 +1618,11 @@ INLINE Object *ob_l_and( Object *a, Object *b ){
 
 INLINE Object *ob_cl_push( Object *a, Object *b ){
 	if( a->type->cl_push != NULL ){
-		return a->type->cl_push(a,b);
+		Object *ret = a->type->cl_push(a,b);
+
+		ob_update_footprint(a);
+
+		return ret;
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "'%s' not iterable or not editable object type", ob_typename(a) );
@@ -1560,7 +1631,11 @@ INLINE Object *ob_cl_push( Object *a, Object *b ){
 
 INLINE Object *ob_cl_push_reference( Object *a, Object *b ){
 	if( a->type->cl_push_reference != NULL ){
-		return a->type->cl_push_reference(a,b);
+		Object *ret = a->type->cl_push_reference(a,b);
+
+		ob_update_footprint(a);
+
+		return ret;
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "'%s' not iterable or not editable object type", ob_typename(a) );
@@ -1569,7 +1644,11 @@ INLINE Object *ob_cl_push_reference( Object *a, Object *b ){
 
 INLINE Object *ob_cl_pop( Object *o ){
 	if( o->type->cl_pop != NULL ){
-		return o->type->cl_pop(o);
+		Object *ret = o->type->cl_pop(o);
+
+		ob_update_footprint(o);
+
+		return ret;
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "'%s' not iterable or not editable object type", ob_typename(o) );
@@ -1578,7 +1657,11 @@ INLINE Object *ob_cl_pop( Object *o ){
 
 INLINE Object *ob_cl_remove( Object *a, Object *b ){
 	if( a->type->cl_remove != NULL ){
-		return a->type->cl_remove(a,b);
+		Object *ret = a->type->cl_remove(a,b);
+
+		ob_update_footprint(a);
+
+		return ret;
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "'%s' not iterable or not editable object type", ob_typename(a) );
@@ -1596,7 +1679,11 @@ INLINE Object *ob_cl_at( Object *a, Object *b ){
 
 INLINE Object *ob_cl_set( Object *a, Object *b, Object *c ){
     if( a->type->cl_set != NULL ){
-		return a->type->cl_set(a,b,c);
+		Object *ret = a->type->cl_set(a,b,c);
+
+		ob_update_footprint(a);
+
+		return ret;
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "'%s' not iterable or not editable object type", ob_typename(a) );
@@ -1605,7 +1692,11 @@ INLINE Object *ob_cl_set( Object *a, Object *b, Object *c ){
 
 INLINE Object *ob_cl_set_reference( Object *a, Object *b, Object *c ){
     if( a->type->cl_set_reference != NULL ){
-		return a->type->cl_set_reference(a,b,c);
+		Object *ret = a->type->cl_set_reference(a,b,c);
+
+		ob_update_footprint(a);
+
+		return ret;
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "'%s' not iterable or not editable object type", ob_typename(a) );
@@ -1614,7 +1705,8 @@ INLINE Object *ob_cl_set_reference( Object *a, Object *b, Object *c ){
 
 INLINE void ob_define_attribute( Object *o, char *name, access_t a, bool is_static /*= false*/  ){
 	if( o->type->define_attribute != NULL ){
-		return o->type->define_attribute(o,name,a,is_static);
+		o->type->define_attribute(o,name,a,is_static);
+		ob_update_footprint(o);
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "object type '%s' does not name a structure nor a class", ob_typename(o) );
@@ -1647,7 +1739,8 @@ INLINE void ob_set_attribute_access( Object *o, char *name, access_t a ){
 
 INLINE void ob_add_attribute( Object *s, char *a ){
     if( s->type->add_attribute != NULL ){
-		return s->type->add_attribute(s,a);
+		s->type->add_attribute(s,a);
+		ob_update_footprint(s);
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "object type '%s' does not name a structure nor a class", ob_typename(s) );
@@ -1684,6 +1777,7 @@ INLINE void ob_set_attribute_reference( Object *s, char *a, Object *v ){
 INLINE void ob_define_method( Object *c, char *name, Node *code ){
 	if( c->type->define_method != NULL ){
 		c->type->define_method( c, name, code );
+		ob_update_footprint(c);
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "object type '%s' does not name a class", ob_typename(c) );
@@ -1700,8 +1794,25 @@ INLINE Node *ob_get_method( Object *c, char *name, int argc /*= -1*/ ){
 }
 
 INLINE Object *ob_call_method( vm_t *vm, vframe_t *frame, Object *owner, char *owner_id, char *method_id, Node *argv ){
+	Object *result;
+	/*
+	 * References just forward the call to the referenced object,
+	 * do not trace them twice.
+	 */
+	bool	traced = __trc_enabled && ob_is_reference(owner) == false;
+
 	if( owner->type->call_method != NULL ){
-		return owner->type->call_method( vm, frame, owner, owner_id, method_id, argv );
+		if( traced ){
+			trc_enter_method( ob_typename(owner), method_id );
+		}
+
+		result = owner->type->call_method( vm, frame, owner, owner_id, method_id, argv );
+
+		if( traced && __trc_enabled ){
+			trc_leave();
+		}
+
+		return result;
 	}
 	else{
 		hyb_error( H_ET_SYNTAX, "object type '%s' does not name a class neither has builtin methods", ob_typename(owner) );
@@ -91,6 +91,10 @@ typedef struct _vm_t vm_t;
  * Module initializer function pointer prototype.
  */
 typedef void     (*initializer_t)( vm_t * );
+/*
+ * Module finalizer function pointer prototype.
+ */
+typedef void     (*finalizer_t)( vm_t * );
 /*
  * Generic function pointer prototype.
  */
@@ -129,12 +133,14 @@ typedef struct vm_module {
     vector<string> domains;
     string         name;
     initializer_t  initializer;
+    finalizer_t    finalizer;
     llist_t		   functions;
 
-    vm_module( string& module_name, string& module_path, void *ptr, initializer_t init ) :
+    vm_module( string& module_name, string& module_path, void *ptr, initializer_t init, finalizer_t fini = NULL ) :
     	name(module_name),
     	handle(ptr),
-    	initializer(init){
+    	initializer(init),
+    	finalizer(fini){
 
     	/*
     	 * Initialize functions linked list.
@@ -261,20 +267,21 @@ typedef struct _vm_t {
 }
 vm_t;
 /*
- * Macros to lock and unlock the vm mutexes.
+ * Macros to lock and unlock the vm mutexes, they're no-ops
+ * until the first thread is spawned (see hyb_set_threaded).
  */
-#define vm_state_lock( vm )     pthread_mutex_lock( &vm->mutexes[VM_STATE_MUTEX] )
-#define vm_state_unlock( vm )   pthread_mutex_unlock( &vm->mutexes[VM_STATE_MUTEX] )
-#define vm_source_lock( vm )    pthread_mutex_lock( &vm->mutexes[VM_SOURCE_MUTEX] )
-#define vm_source_unlock( vm )  pthread_mutex_unlock( &vm->mutexes[VM_SOURCE_MUTEX] )
-#define vm_line_lock( vm )      pthread_mutex_lock( &vm->mutexes[VM_LINE_MUTEX] )
-#define vm_line_unlock( vm )    pthread_mutex_unlock( &vm->mutexes[VM_LINE_MUTEX] )
-#define vm_mm_lock( vm )  	    pthread_mutex_lock( &vm->mutexes[VM_MM_MUTEX] )
-#define vm_mm_unlock( vm )   	pthread_mutex_unlock( &vm->mutexes[VM_MM_MUTEX] )
-#define vm_mcache_lock( vm )    pthread_mutex_lock( &vm->mutexes[VM_MCACHE_MUTEX] )
-#define vm_mcache_unlock( vm )  pthread_mutex_unlock( &vm->mutexes[VM_MCACHE_MUTEX] )
-#define vm_pcre_lock( vm )      pthread_mutex_lock( &vm->mutexes[VM_PCRE_MUTEX] )
-#define vm_pcre_unlock( vm )    pthread_mutex_unlock( &vm->mutexes[VM_PCRE_MUTEX] )
+#define vm_state_lock( vm )     hyb_mutex_lock( &vm->mutexes[VM_STATE_MUTEX] )
+#define vm_state_unlock( vm )   hyb_mutex_unlock( &vm->mutexes[VM_STATE_MUTEX] )
+#define vm_source_lock( vm )    hyb_mutex_lock( &vm->mutexes[VM_SOURCE_MUTEX] )
+#define vm_source_unlock( vm )  hyb_mutex_unlock( &vm->mutexes[VM_SOURCE_MUTEX] )
+#define vm_line_lock( vm )      hyb_mutex_lock( &vm->mutexes[VM_LINE_MUTEX] )
+#define vm_line_unlock( vm )    hyb_mutex_unlock( &vm->mutexes[VM_LINE_MUTEX] )
+#define vm_mm_lock( vm )  	    hyb_mutex_lock( &vm->mutexes[VM_MM_MUTEX] )
+#define vm_mm_unlock( vm )   	hyb_mutex_unlock( &vm->mutexes[VM_MM_MUTEX] )
+#define vm_mcache_lock( vm )    hyb_mutex_lock( &vm->mutexes[VM_MCACHE_MUTEX] )
+#define vm_mcache_unlock( vm )  hyb_mutex_unlock( &vm->mutexes[VM_MCACHE_MUTEX] )
+#define vm_pcre_lock( vm )      hyb_mutex_lock( &vm->mutexes[VM_PCRE_MUTEX] )
+#define vm_pcre_unlock( vm )    hyb_mutex_unlock( &vm->mutexes[VM_PCRE_MUTEX] )
 
 /*
  * Alloc a virtual machine instance.
@@ -330,6 +337,20 @@ void   		vm_load_namespace( vm_t *vm, string path );
  * if any, to be set with an exception state.
  */
 Object 	   *vm_raise_exception( const char *fmt, ... );
+/*
+ * Cooperative I/O waiting hook, installed by the coroutines module.
+ * It has to return the ready events of 'fd', 0 on timeout, or -1 if the
+ * calling thread is not running a coroutine, in which case the caller
+ * performs its usual blocking call.
+ */
+typedef int (*vm_io_waiter_t)( int fd, int events, int timeout );
+
+void		vm_set_io_waiter( vm_io_waiter_t waiter );
+/*
+ * Suspend the running coroutine until 'fd' is ready for 'events' (poll
+ * flags), see vm_io_waiter_t for the return values.
+ */
+int 		vm_io_wait( int fd, int events, int timeout );
 /*
  * Print the calling stack trace.
  */
@@ -371,6 +392,13 @@ INLINE string vm_get_source( vm_t *vm ){
 INLINE size_t vm_get_lineno( vm_t *vm ){
 	return vm->lineno;
 }
+/*
+ * Scope of the current thread, cached on the first vm_find_scope call
+ * so that lookups (and the profiler signal handler) don't need to
+ * access the th_frames map.
+ * The initial-exec model makes its access async-signal-safe.
+ */
+extern __thread vm_scope_t *__vm_scope __attribute__((tls_model("initial-exec")));
 /*
  * Add a thread to the threads pool.
  */
@@ -391,6 +419,9 @@ INLINE void vm_depool( vm_t *vm, pthread_t tid = 0 ){
 	vm_mm_lock( vm );
 	vm_thread_scope_t::iterator i_scope = vm->th_frames.find(tid);
 	if( i_scope != vm->th_frames.end() ){
+		if( __vm_scope == i_scope->second ){
+			__vm_scope = NULL;
+		}
 
 		ll_clear( i_scope->second );
 		free( i_scope->second );
@@ -401,16 +432,19 @@ INLINE void vm_depool( vm_t *vm, pthread_t tid = 0 ){
 }
 
 INLINE vm_scope_t *vm_find_scope( vm_t *vm ){
-	pthread_t tid = pthread_self();
-	/*
-	 * Main thread id, return main scope.
-	 */
-	if( tid == vm->main_tid ){
-		return &vm->frames;
-	}
-	else{
-		return vm->th_frames.find(tid)->second;
+	if( __vm_scope == NULL ){
+		pthread_t tid = pthread_self();
+		/*
+		 * Main thread id, return main scope.
+		 */
+		if( tid == vm->main_tid ){
+			__vm_scope = &vm->frames;
+		}
+		else{
+			__vm_scope = vm->th_frames.find(tid)->second;
+		}
 	}
+	return __vm_scope;
 }
 /*
  * Push a frame to the trace stack.
@@ -614,9 +648,13 @@ Object   *vm_exec_user_function_call( vm_t *vm, vframe_t *, Node * );
 Object   *vm_exec_dll_function_call( vm_t *vm, vframe_t *, Node * );
 /*
  * Special case to handle threaded function calls by name and by alias.
+ * When 'frame' is given, an unhandled exception of the call is set on it.
+ * When 'root' is given, the result is pushed on it with push_tmp before
+ * the stack of the function is dismissed, so that it's never unreachable
+ * for the gc, the caller removes it with remove_tmp once done.
  */
-Object   *vm_exec_threaded_call( vm_t *vm, string function_name, vmem_t *argv );
-Object   *vm_exec_threaded_call( vm_t *vm, Node *function, vframe_t *frame, vmem_t *argv );
+Object   *vm_exec_threaded_call( vm_t *vm, string function_name, vmem_t *argv, vframe_t *frame = NULL, vmem_t *root = NULL );
+Object   *vm_exec_threaded_call( vm_t *vm, Node *function, vframe_t *frame, vmem_t *argv, vmem_t *root = NULL );
 /*
  * Node handler dispatcher.
  */
@@ -18,6 +18,7 @@
 */
 #include "node.h"
 #include "memory.h"
+#include "heatmap.h"
 
 NodeValue::NodeValue() :
     constant(NULL),
@@ -40,11 +41,11 @@ NodeValue::NodeValue() :
 
 }
 
-Node::Node() : type(H_NT_NONE), lineno(0), body(NULL) {
+Node::Node() : type(H_NT_NONE), lineno(0), source(__hm_source), body(NULL) {
 	ll_init( &children );
 }
 
-Node::Node( H_NODE_TYPE type, size_t lineno ) : type(type), opcode(type), lineno(lineno), body(NULL) {
+Node::Node( H_NODE_TYPE type, size_t lineno ) : type(type), opcode(type), lineno(lineno), source(__hm_source), body(NULL) {
 	ll_init( &children );
 }
 
@@ -89,20 +90,22 @@ ConstantNode::ConstantNode( size_t lineno, bool v ) : Node(H_NT_CONSTANT,lineno)
 }
 
 Node *ConstantNode::clone() {
+	Node *clone = H_UNDEFINED;
+
 	if( ob_is_int(value.constant) ){
-		return new ConstantNode( lineno, (ob_int_ucast(value.constant))->value );
+		clone = new ConstantNode( lineno, (ob_int_ucast(value.constant))->value );
 	}
 	else if( ob_is_float(value.constant) ){
-		return new ConstantNode( lineno, ob_float_ucast(value.constant)->value );
+		clone = new ConstantNode( lineno, ob_float_ucast(value.constant)->value );
 	}
 	else if( ob_is_char(value.constant) ){
-		return new ConstantNode( lineno, ob_char_ucast(value.constant)->value );
+		clone = new ConstantNode( lineno, ob_char_ucast(value.constant)->value );
 	}
 	else if( ob_is_string(value.constant) ){
-		return new ConstantNode( lineno, (char *)ob_string_ucast(value.constant)->value.c_str() );
+		clone = new ConstantNode( lineno, (char *)ob_string_ucast(value.constant)->value.c_str() );
 	}
 	else if( ob_is_boolean(value.constant) ){
-		return new ConstantNode( lineno, ob_bool_ucast(value.constant)->value );
+		clone = new ConstantNode( lineno, ob_bool_ucast(value.constant)->value );
 	}
 	else{
 		/*
@@ -110,6 +113,10 @@ Node *ConstantNode::clone() {
 		 */
 		assert(false);
 	}
+
+	clone->source = source;
+
+	return clone;
 }
 
 /* expressions */
@@ -146,6 +153,7 @@ Node *ExpressionNode::clone(){
 		clone->addChild( node ? node->clone() : node );
 	}
 
+    clone->source = source;
     return clone;
 }
 
@@ -207,6 +215,7 @@ Node *StatementNode::clone(){
 		clone->addChild( node ? node->clone() : node );
 	}
 
+    clone->source = source;
     return clone;
 }
 
@@ -248,6 +257,7 @@ Node *IdentifierNode::clone(){
    		clone->addChild( node ? node->clone() : node );
    	}
 
+    clone->source = source;
     return clone;
 }
 
@@ -258,7 +268,11 @@ AttributeRequestNode::AttributeRequestNode( size_t lineno, Node *owner, Node *me
 }
 
 Node *AttributeRequestNode::clone(){
-	return new AttributeRequestNode( lineno, value.owner, value.member );
+	Node *clone = new AttributeRequestNode( lineno, value.owner, value.member );
+
+	clone->source = source;
+
+	return clone;
 }
 
 /* class method call */
@@ -268,7 +282,11 @@ MethodCallNode::MethodCallNode( size_t lineno, Node *owner, Node *call ) : Node(
 }
 
 Node *MethodCallNode::clone(){
-	return new MethodCallNode( lineno, value.owner, value.member );
+	Node *clone = new MethodCallNode( lineno, value.owner, value.member );
+
+	clone->source = source;
+
+	return clone;
 }
 
 /* functions */
@@ -325,6 +343,7 @@ Node *FunctionNode::clone(){
 		clone->addChild( nclone );
 	}
 
+	clone->source = source;
 	return clone;
 }
 
@@ -358,6 +377,7 @@ Node *CallNode::clone(){
 		clone->addChild( node ? node->clone() : node );
 	}
 
+    clone->source = source;
     return clone;
 }
 
@@ -371,12 +391,16 @@ TryCatchNode::TryCatchNode( size_t lineno, int statement, Node *try_block, char
 }
 
 Node *TryCatchNode::clone(){
-	return new TryCatchNode( lineno,
-							 opcode,
-							 value.try_block,
-							 (char *)value.exception_id.c_str(),
-							 value.catch_block,
-							 value.finally_block );
+	Node *clone = new TryCatchNode( lineno,
+									opcode,
+									value.try_block,
+									(char *)value.exception_id.c_str(),
+									value.catch_block,
+									value.finally_block );
+
+	clone->source = source;
+
+	return clone;
 }
 
 /* structure or class creation */
@@ -396,6 +420,7 @@ Node *NewNode::clone(){
 		clone->addChild( node ? node->clone() : node );
 	}
 
+	clone->source = source;
 	return clone;
 }
 
@@ -476,6 +501,7 @@ Node *MethodDeclarationNode::clone(){
 		clone->addChild( nclone );
 	}
 
+	clone->source = source;
 	return clone;
 }
 
@@ -18,6 +18,8 @@
 */
 #include "hybris.h"
 
+DECLARE_TYPE(Char);
+
 /** generic function pointers **/
 Object *binary_traverse( Object *me, int index ){
 	return (index >= ((Binary *)me)->value.size() ? NULL : ((Binary *)me)->value.at(index));
@@ -46,6 +48,46 @@ size_t binary_get_size( Object *me ){
 	return ob_binary_ucast(me)->items;
 }
 
+size_t binary_get_footprint( Object *me ){
+	return sizeof(Binary) + ob_binary_ucast(me)->value.capacity() * sizeof(Object *);
+}
+
+void binary_set_bytes( Object *me, size_t offset, const char *data, size_t size ){
+	Binary *bme = (Binary *)me;
+	size_t  i, end = offset + size;
+	Object *item;
+
+	if( bme->value.size() > end ){
+		bme->value.resize( end );
+	}
+
+	for( i = 0; i < end; ++i ){
+		if( i < bme->value.size() ){
+			/*
+			 * Bytes before 'offset' are kept as they are.
+			 */
+			if( i < offset ){
+				continue;
+			}
+
+			item = bme->value[i];
+			if( ob_is_char(item) ){
+				ob_char_ucast(item)->value = data[i - offset];
+			}
+			else{
+				bme->value[i] = (Object *)gc_new_char( data[i - offset] );
+			}
+		}
+		else{
+			bme->value.push_back( (Object *)gc_new_char( i < offset ? 0x00 : data[i - offset] ) );
+		}
+	}
+
+	bme->items = end;
+
+	ob_update_footprint(me);
+}
+
 byte *binary_serialize( Object *o, size_t size ){
 	size_t i, s   = (size > ob_get_size(o) ? ob_get_size(o) : size != 0 ? size : ob_get_size(o) );
 	byte  *buffer = new byte[s];
@@ -221,6 +263,7 @@ IMPLEMENT_TYPE(Binary) {
 	binary_clone, // clone
 	binary_free, // free
 	binary_get_size, // get_size
+	binary_get_footprint, // get_footprint
 	binary_serialize, // serialize
 	binary_deserialize, // deserialize
 	0, // to_fd
@@ -191,6 +191,7 @@ IMPLEMENT_TYPE(Boolean) {
 	bool_clone, // clone
 	0, // free
 	0, // get_size
+	0, // get_footprint
 	bool_serialize, // serialize
 	bool_deserialize, // deserialize
 	bool_to_fd, // to_fd
@@ -413,6 +413,7 @@ IMPLEMENT_TYPE(Char) {
 	char_clone, // clone
 	0, // free
 	0, // get_size
+	0, // get_footprint
 	char_serialize, // serialize
 	char_deserialize, // deserialize
 	char_to_fd, // to_fd
@@ -17,6 +17,9 @@
  * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "hybris.h"
+#include "perfmap.h"
+#include "heatmap.h"
+#include "probes.h"
 /*
  * Special function to execute a __method class descriptor.
  */
@@ -132,8 +135,14 @@ Object *class_call_overloaded_operator( Object *me, const char *op_name, int arg
 	}
 	va_end(ap);
 
+	trc_enter_call( stack.owner );
+	hyb_probe_function_entry( stack.owner.c_str(), hm_source_name(op->source), op->lineno );
+
 	/* call the operator */
-	result = vm_exec( __hyb_vm, &stack, op->body );
+	result = pm_exec_body( __hyb_vm, &stack, op, stack.owner, op->body );
+
+	hyb_probe_function_return( stack.owner.c_str(), hm_source_name(op->source), op->lineno );
+	trc_leave_call();
 
 	vm_pop_frame( __hyb_vm );
 
@@ -209,8 +218,14 @@ Object *class_call_overloaded_descriptor( Object *me, const char *ds_name, bool
 	}
 	va_end(ap);
 
+	trc_enter_call( stack.owner );
+	hyb_probe_function_entry( stack.owner.c_str(), hm_source_name(ds->source), ds->lineno );
+
 	/* call the descriptor */
-	result = vm_exec( __hyb_vm, &stack, ds->body );
+	result = pm_exec_body( __hyb_vm, &stack, ds, stack.owner, ds->body );
+
+	hyb_probe_function_return( stack.owner.c_str(), hm_source_name(ds->source), ds->lineno );
+	trc_leave_call();
 
 	vm_pop_frame( __hyb_vm );
 
@@ -281,6 +296,10 @@ Object *class_clone( Object *me ){
     }
 
     cclone->name = cme->name;
+    /*
+     * Attributes and methods were inserted directly, account them now.
+     */
+    ob_update_footprint( (Object *)cclone );
 
     return (Object *)(cclone);
 }
@@ -290,6 +309,17 @@ size_t class_get_size( Object *me ){
 	return ob_ivalue(size);
 }
 
+size_t class_get_footprint( Object *me ){
+	Class *cme = ob_class_ucast(me);
+
+	return sizeof(Class) +
+		   cme->name.capacity() +
+		   cme->c_attributes.footprint() +
+		   cme->c_attributes.size() * sizeof(class_attribute_t) +
+		   cme->c_methods.footprint() +
+		   cme->c_methods.size() * sizeof(class_method_t);
+}
+
 void class_free( Object *me ){
     ClassAttributeIterator ai;
     ClassMethodIterator    mi;
@@ -806,7 +836,7 @@ Object *class_call_method( vm_t *vm, vframe_t *frame, Object *me, char *me_id, c
 		}
 	}
 	/* execute the method */
-	result = vm_exec( vm, &stack, method->body );
+	result = pm_exec_body( vm, &stack, method, stack.owner, method->body );
 
 	/*
 	 * Dismiss the stack.
@@ -840,6 +870,7 @@ IMPLEMENT_TYPE(Class) {
 	class_clone, // clone
 	class_free, // free
 	class_get_size, // get_size
+	class_get_footprint, // get_footprint
 	0, // serialize
 	0, // deserialize
 	0, // to_fd
@@ -378,6 +378,7 @@ IMPLEMENT_TYPE(Float) {
 	float_clone, // clone
 	0, // free
 	0, // get_size
+	0, // get_footprint
 	float_serialize, // serialize
 	float_deserialize, // deserialize
 	float_to_fd, // to_fd
@@ -18,9 +18,43 @@
 */
 #include "hybris.h"
 
+void handle_set_finalizer( Handle *h, handle_finalizer_t finalizer ){
+	h->finalizer = finalizer;
+	h->refs		 = (size_t *)malloc( sizeof(size_t) );
+	*h->refs	 = 1;
+}
+
 /** generic function pointers **/
 Object *handle_clone( Object *me ){
-    return (Object *)gc_new_handle( ob_handle_ucast(me)->value );
+	Handle *hme   = ob_handle_ucast(me),
+		   *clone = gc_new_handle( hme->value );
+
+	if( hme->finalizer ){
+		clone->finalizer = hme->finalizer;
+		clone->refs		 = hme->refs;
+
+		__sync_add_and_fetch( clone->refs, 1 );
+	}
+
+    return (Object *)clone;
+}
+/*
+ * Not a type handler, ob_free is called also when a variable is
+ * reassigned, while the old value could still belong to the caller
+ * frame (arguments are not cloned), so references are released only
+ * by the gc when it deletes the handle.
+ */
+void handle_release( Handle *h ){
+	if( h->finalizer ){
+		if( __sync_sub_and_fetch( h->refs, 1 ) == 0 ){
+			h->finalizer( h->value );
+			free( h->refs );
+		}
+
+		h->finalizer = NULL;
+		h->refs		 = NULL;
+		h->value	 = NULL;
+	}
 }
 
 int handle_cmp( Object *me, Object *cmp ){
@@ -74,7 +108,12 @@ Object * handle_to_int( Object *me ){
 }
 
 Object *handle_assign( Object *me, Object *op ){
-	((Handle *)me)->value = NULL;
+	/*
+	 * Owned values are needed by the finalizer.
+	 */
+	if( ((Handle *)me)->finalizer == NULL ){
+		((Handle *)me)->value = NULL;
+	}
 
     Object *clone = ob_clone(op);
 
@@ -149,6 +188,7 @@ IMPLEMENT_TYPE(Handle) {
 	handle_clone, // clone
 	0, // free
 	0, // get_size
+	0, // get_footprint
 	0, // serialize
 	0, // deserialize
 	0, // to_fd
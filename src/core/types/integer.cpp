@@ -434,6 +434,7 @@ IMPLEMENT_TYPE(Integer) {
 	int_clone, // clone
 	0, // free
 	0, // get_size
+	0, // get_footprint
 	int_serialize, // serialize
 	int_deserialize, // deserialize
 	int_to_fd, // to_fd
@@ -527,6 +528,7 @@ IMPLEMENT_TYPE(Alias) {
 	alias_clone, // clone
 	0, // free
 	0, // get_size
+	0, // get_footprint
 	int_serialize, // serialize
 	int_deserialize, // deserialize
 	0, // to_fd
@@ -620,6 +622,7 @@ IMPLEMENT_TYPE(Extern) {
 	extern_clone, // clone
 	0, // free
 	0, // get_size
+	0, // get_footprint
 	int_serialize, // serialize
 	int_deserialize, // deserialize
 	0, // to_fd
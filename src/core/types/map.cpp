@@ -113,6 +113,8 @@ Object *map_clone( Object *me ){
         mclone->items++;
     }
 
+    ob_update_footprint( (Object *)mclone );
+
     return (Object *)mclone;
 }
 
@@ -128,6 +130,12 @@ size_t map_get_size( Object *me ){
 	return ob_map_ucast(me)->items;
 }
 
+size_t map_get_footprint( Object *me ){
+	Map *mme = ob_map_ucast(me);
+
+	return sizeof(Map) + ( mme->keys.capacity() + mme->values.capacity() ) * sizeof(Object *);
+}
+
 int map_cmp( Object *me, Object *cmp ){
     if( !ob_is_map(cmp) ){
         return 1;
@@ -360,6 +368,7 @@ IMPLEMENT_TYPE(Map) {
 	map_clone, // clone
 	map_free, // free
 	map_get_size, // get_size
+	map_get_footprint, // get_footprint
 	0, // serialize
 	0, // deserialize
 	0, // to_fd
@@ -467,6 +467,7 @@ IMPLEMENT_TYPE(Reference) {
 	ref_clone, // clone
 	0, // free
 	ref_get_size, // get_size
+	0, // get_footprint
 	ref_serialize, // serialize
 	ref_deserialize, // deserialize
 	ref_to_fd, // to_fd
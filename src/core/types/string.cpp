@@ -156,6 +156,21 @@ size_t string_get_size( Object *me ){
 	return ob_string_ucast(me)->items;
 }
 
+size_t string_get_footprint( Object *me ){
+	String 	   *sme  = ob_string_ucast(me);
+	const char *data = sme->value.data();
+	size_t 		size = sizeof(String);
+	/*
+	 * Short strings are stored inside the std::string object itself,
+	 * count the capacity only if the buffer was allocated on the heap.
+	 */
+	if( data < (const char *)sme || data >= (const char *)sme + sizeof(String) ){
+		size += sme->value.capacity() + 1;
+	}
+
+	return size;
+}
+
 byte *string_serialize( Object *o, size_t size ){
 	size_t s = (size > ob_get_size(o) ? ob_get_size(o) : size != 0 ? size : ob_get_size(o) );
 	byte  *buffer = new byte[s];
@@ -516,6 +531,7 @@ IMPLEMENT_TYPE(String) {
 	string_clone, // clone
 	0, // free
 	string_get_size, // get_size
+	string_get_footprint, // get_footprint
 	string_serialize, // serialize
 	string_deserialize, // deserialize
 	string_to_fd, // to_fd
@@ -38,6 +38,8 @@ Object *struct_clone( Object *me ){
 
     sclone->items = sme->items;
 
+    ob_update_footprint( (Object *)sclone );
+
     return (Object *)sclone;
 }
 
@@ -45,6 +47,10 @@ size_t struct_get_size( Object *me ){
 	return ob_struct_ucast(me)->items;
 }
 
+size_t struct_get_footprint( Object *me ){
+	return sizeof(Structure) + ob_struct_ucast(me)->s_attributes.footprint();
+}
+
 void struct_free( Object *me ){
     Structure *sme = ob_struct_ucast(me);
 
@@ -143,6 +149,7 @@ IMPLEMENT_TYPE(Structure) {
 	struct_clone, // clone
 	struct_free, // free
 	struct_get_size, // get_size
+	struct_get_footprint, // get_footprint
 	0, // serialize
 	0, // deserialize
 	0, // to_fd
@@ -133,6 +133,10 @@ size_t vector_get_size( Object *me ){
 	return ob_vector_ucast(me)->items;
 }
 
+size_t vector_get_footprint( Object *me ){
+	return sizeof(Vector) + ob_vector_ucast(me)->value.capacity() * sizeof(Object *);
+}
+
 Object *vector_to_fd( Object *o, int fd, size_t size ){
 	size_t i, s = (size > ob_get_size(o) ? ob_get_size(o) : size != 0 ? size : ob_get_size(o));
 	int    written(0);
@@ -497,6 +501,7 @@ IMPLEMENT_TYPE(Vector) {
 	vector_clone, // clone
 	vector_free, // free
 	vector_get_size, // get_size
+	vector_get_footprint, // get_footprint
 	0, // serialize
 	0, // deserialize
 	vector_to_fd, // to_fd
@@ -22,6 +22,7 @@
 #include "common.h"
 #include "parser.h"
 #include "vm.h"
+#include "heatmap.h"
 #include <stdio.h>
 #include <string.h>
 #include <string>
@@ -200,6 +201,7 @@ include          BEGIN(T_INCLUSION);
 
     vm_set_source( __hyb_vm, filename );
     vm_set_lineno( __hyb_vm, 1 );
+    hm_set_source( __hyb_file_stack.back().c_str() );
 
     yypush_buffer_state( yy_create_buffer( yyin, YY_BUF_SIZE ) );
 
@@ -210,6 +212,7 @@ include          BEGIN(T_INCLUSION);
 		__hyb_file_stack.pop_back();
 		if( __hyb_file_stack.size() ){
 			vm_set_source( __hyb_vm, __hyb_file_stack.back() );
+			hm_set_source( __hyb_file_stack.back().c_str() );
 		}
 		else{
 			vm_set_source( __hyb_vm, __hyb_vm->args.source );
@@ -335,6 +338,10 @@ include          BEGIN(T_INCLUSION);
 
 "return"        return T_RETURN;
 
+"spawn"			return T_SPAWN;
+"await"			return T_AWAIT;
+"yield"			return T_YIELD;
+
 "function"[ \n\t]+{identifier}[ \n\t]*"("([ \n\t]*{identifier}[ \n\t]*,?)*([ \n\t]*\.\.\.)?[ \n\t]*")" {
 	yylval->function   = hyb_lex_function(yytext);
 	return T_FUNCTION_PROTOTYPE;
@@ -760,9 +767,10 @@ void hyb_parse_string( vm_t *vm, const char *str ){
 }
 
 void hyb_parse_file( vm_t *vm, const char *filename ){
-	FILE  *fp = fopen( filename, "rt" );
-	string source, buffer;
-	char   line[1024] = {0};
+	FILE  		*fp = fopen( filename, "rt" );
+	string 		 source, buffer;
+	char   		 line[1024] = {0};
+	unsigned int hm_source;
 
 	if( fp ){
 		source = vm_get_source(vm);
@@ -777,11 +785,14 @@ void hyb_parse_file( vm_t *vm, const char *filename ){
 		if( sep ){
 			filename = sep + 1;
 		}
+		hm_source = hm_set_source( filename );
+
 		vm_set_source( vm, filename );
 
 		hyb_parse_string( vm, buffer.c_str() );
 
 		vm_set_source( vm, source );
+		hm_restore_source( hm_source );
 	}
 }
 
@@ -44,7 +44,16 @@ int hyb_usage( char *argvz ){
     		"\t                 i.e. -g 10K or -g 1024 or --gc=100M\n"
     		"\t-c (--cgi)     : Run in CGI mode (stderr will be redirected to stdout).\n"
             "\t-t (--time)    : Compute execution time and print it to stdout.\n"
-            "\t-s (--trace)   : Enable stack trace report on errors .\n\n", argvz );
+            "\t-s (--trace)   : Enable stack trace report on errors .\n"
+            "\t-p (--profile) : Sample the running script and write its folded stacks to the given file,\n"
+            "\t                 i.e. --profile=out.folded ( flamegraph.pl out.folded > out.svg ).\n"
+            "\t-T (--trace-calls) : Time every call and print calls, total and self time and allocations\n"
+            "\t                     of each function upon exit.\n"
+            "\t-H (--heatmap) : Count executions and time of each source line and write them to the given file\n"
+            "\t                 as an annotated listing, or as json if its name ends with .json .\n"
+            "\t-P (--perf-map) : Run each script function through its own trampoline and describe them\n"
+            "\t                  in /tmp/perf-<pid>.map so 'perf report' can show script frames.\n"
+            "\t-L (--gc-log)   : Print a line with freed and promoted objects and timings of each garbage collection.\n\n", argvz );
     return 0;
 }
 
@@ -55,6 +64,11 @@ int main( int argc, char *argv[], char* envp[] ){
             { "cgi",	 0, 0, 'c' },
             { "time",    0, 0, 't' },
             { "trace",   0, 0, 's' },
+            { "profile", 1, 0, 'p' },
+            { "trace-calls", 0, 0, 'T' },
+            { "heatmap", 1, 0, 'H' },
+            { "perf-map", 0, 0, 'P' },
+            { "gc-log", 0, 0, 'L' },
             /*
              * TODO
              *
@@ -74,7 +88,7 @@ int main( int argc, char *argv[], char* envp[] ){
     long gc_threshold,
 		 mm_threshold;
 
-    while( (c = getopt_long( argc, argv, /* "m:g:ctsdh" */ "m:g:ctsh", options, &index)) != -1 ){
+    while( (c = getopt_long( argc, argv, /* "m:g:p:TH:PLctsdh" */ "m:g:p:TH:PLctsh", options, &index)) != -1 ){
         switch (c) {
 			/*
 			 * Handle garbage collection threshold argument.
@@ -224,6 +238,41 @@ int main( int argc, char *argv[], char* envp[] ){
         		 */
         		__hyb_vm->args.stacktrace = 1;
         	break;
+
+        	case 'p':
+        		/*
+        		 * Enable the sampling profiler.
+        		 */
+        		strncpy( __hyb_vm->args.profile, optarg, sizeof(__hyb_vm->args.profile) - 1 );
+        	break;
+
+        	case 'T':
+        		/*
+        		 * Enable the deterministic call tracer.
+        		 */
+        		__hyb_vm->args.trace_calls = true;
+        	break;
+
+        	case 'H':
+        		/*
+        		 * Enable the line heatmap.
+        		 */
+        		strncpy( __hyb_vm->args.heatmap, optarg, sizeof(__hyb_vm->args.heatmap) - 1 );
+        	break;
+
+        	case 'P':
+        		/*
+        		 * Enable the perf map.
+        		 */
+        		__hyb_vm->args.perf_map = true;
+        	break;
+
+        	case 'L':
+        		/*
+        		 * Log each garbage collection.
+        		 */
+        		__hyb_vm->args.gc_log = true;
+        	break;
         	/*
         	 * TODO
         	 *
@@ -220,11 +220,15 @@ vm_t *__hyb_vm;
 %token T_TRY
 %token T_CATCH
 %token T_FINALLY
+%token T_SPAWN
+%token T_AWAIT
+%token T_YIELD
 
 %nonassoc T_IF_END
 %nonassoc T_SB_END
 %nonassoc T_SWITCH_END
 %nonassoc T_CALL_END
+%nonassoc T_ASSIGN_END
 %nonassoc T_ELSE
 
 %left T_L_NOT T_L_AND T_L_OR
@@ -237,11 +241,15 @@ vm_t *__hyb_vm;
 %left T_MOD T_MODE
 %left T_SHIFTL T_SHIFTLE T_SHIFTR T_SHIFTRE T_DOLLAR
 %left T_UMINUS
+%right T_AWAIT
 %left T_MINUS
 
 %nonassoc T_FACT
 %nonassoc T_NOT
 %nonassoc T_INC T_DEC
+%left T_GET_MEMBER
+%left '(' '['
+%right T_ASSIGN
 
 %type <node>   statement arithmeticExpression bitwiseExpression logicExpression callExpression expression statements
 %type <list>   mapList
@@ -377,6 +385,14 @@ statement  : T_EOSTMT                                                   { $$ = M
            | T_NEXT T_EOSTMT											{ $$ = MK_NEXT_NODE(@1.first_line); }
            | T_RETURN expression T_EOSTMT                               { $$ = MK_RETURN_NODE( @2.first_line, $2 ); }
            | T_THROW expression T_EOSTMT								{ $$ = MK_THROW_NODE( @2.first_line, $2 ); }
+           /* yield; -> co_yield() */
+           | T_YIELD T_EOSTMT											{ $$ = MK_CALL_NODE( @1.first_line, (char *)"co_yield", NULL ); }
+           /* yield expression; -> gen_yield( expression ) */
+           | T_YIELD expression T_EOSTMT {
+        	   llist_t *argv = ll_create();
+        	   ll_append( argv, $2 );
+        	   $$ = MK_CALL_NODE( @1.first_line, (char *)"gen_yield", argv );
+           }
            /* subscript operator special cases */
 		   | expression '[' ']' T_ASSIGN expression T_EOSTMT            { $$ = MK_SB_PUSH_NODE( @1.first_line, $1, $5 ); }
            | expression '[' expression ']' T_ASSIGN expression T_EOSTMT { $$ = MK_SB_SET_NODE( @1.first_line, $1, $3, $6 ); }
@@ -429,9 +445,12 @@ statement  : T_EOSTMT                                                   { $$ = M
         	   $$ = MK_TRYCATCH_NODE( @2.first_line, $2, $5, $7, $8 );
            };
 
+/*
+ * A single left recursive rule, a leading empty list is dropped so the
+ * first statement is not wrapped into an end of statement node.
+ */
 statements : /* empty */ 		  { $$ = REDUCE_NODE(NULL); }
-		   | statement 			  { $$ = REDUCE_NODE($1); }
-		   | statements statement { $$ = MK_EOSTMT_NODE( @1.first_line, $1, $2 ); };
+		   | statements statement { $$ = ( $1 ? MK_EOSTMT_NODE( @1.first_line, $1, $2 ) : REDUCE_NODE($2) ); };
 
 arithmeticExpression : expression T_PLUS expression      { $$ = MK_PLUS_NODE( @1.first_line, $1, $3 ); }
 					 | expression T_PLUSE expression     { $$ = MK_PLUSE_NODE( @1.first_line, $1, $3 ); }
@@ -477,7 +496,14 @@ callExpression : /* expression . <identifier>( ... ) */
 			     /* <identifier>( ... ) */
 			   | T_IDENT    '(' argumentList ')' %prec T_CALL_END     { $$ = MK_CALL_NODE( @1.first_line, $1, $3 ); }
 			     /* expression ( ... ) */
-			   | expression '(' argumentList ')'                      { $$ = MK_CALL_NODE( @1.first_line, $1, $3 ); };
+			   | expression '(' argumentList ')'                      { $$ = MK_CALL_NODE( @1.first_line, $1, $3 ); }
+			     /* spawn <identifier>( ... ) -> co_spawn( "<identifier>", [ ... ] ) */
+			   | T_SPAWN T_IDENT '(' argumentList ')' {
+				   llist_t *argv = ll_create();
+				   ll_append( argv, MK_CONST_NODE( @2.first_line, $2 ) );
+				   ll_append( argv, MK_ARRAY_NODE( @2.first_line, $4 ) );
+				   $$ = MK_CALL_NODE( @1.first_line, (char *)"co_spawn", argv );
+			   };
 
 expression : T_BOOLEAN										  { $$ = MK_CONST_NODE(@1.first_line, $1); }
 		   | T_INTEGER                                        { $$ = MK_CONST_NODE(@1.first_line, $1); }
@@ -498,9 +524,9 @@ expression : T_BOOLEAN										  { $$ = MK_CONST_NODE(@1.first_line, $1); }
            /* object reference */
            | T_AND expression								  { $$ = MK_REF_NODE(@2.first_line, $2); }
            /* attribute declaration/assignation */
-           | expression T_ASSIGN expression                   { $$ = MK_ASSIGN_NODE( @1.first_line, $1, $3 ); }
+           | expression T_ASSIGN expression                   %prec T_ASSIGN_END { $$ = MK_ASSIGN_NODE( @1.first_line, $1, $3 ); }
 		   /* identifier declaration/assignation */
-		   | T_IDENT T_ASSIGN expression       				  { $$ = MK_ASSIGN_NODE( @1.first_line, MK_IDENT_NODE(@1.first_line, $1), $3 ); }
+		   | T_IDENT T_ASSIGN expression       				  %prec T_ASSIGN_END { $$ = MK_ASSIGN_NODE( @1.first_line, MK_IDENT_NODE(@1.first_line, $1), $3 ); }
            /* a single subscript could be an expression itself */
            | expression '[' expression ']' %prec T_SB_END     { $$ = MK_SB_NODE( @1.first_line, $1, $3 ); }
            /* range evaluation */
@@ -515,6 +541,12 @@ expression : T_BOOLEAN										  { $$ = MK_CONST_NODE(@1.first_line, $1); }
            | expression T_REGEX_OP expression                 { $$ = MK_PCRE_NODE( @1.first_line, $1, $3 ); }
            /* call */
            | callExpression									  { $$ = REDUCE_NODE($1); }
+           /* await expression -> co_join( expression ) */
+           | T_AWAIT expression {
+        	   llist_t *argv = ll_create();
+        	   ll_append( argv, $2 );
+        	   $$ = MK_CALL_NODE( @1.first_line, (char *)"co_join", argv );
+           }
            /* group expression */
            | '(' expression ')'                               { $$ = REDUCE_NODE($2); };
 
@@ -19,10 +19,16 @@
 #include "common.h"
 #include "gc.h"
 #include "vm.h"
+#include "tracer.h"
+#include "probes.h"
 /*
  * The main garbage collector global structure.
  */
 static gc_t __gc;
+/*
+ * Multi threading flag, see gc.h .
+ */
+volatile bool __hyb_threaded = false;
 
 /*
  * Define to print GC debug messages.
@@ -39,13 +45,13 @@ static gc_t __gc;
  * Lock the gc mutex.
  */
 INLINE void gc_lock(){
-	pthread_mutex_lock( &__gc.mutex );
+	hyb_mutex_lock( &__gc.mutex );
 }
 /*
  * Unlock the gc mutex.
  */
 INLINE void gc_unlock(){
-	pthread_mutex_unlock( &__gc.mutex );
+	hyb_mutex_unlock( &__gc.mutex );
 }
 /*
  * Free 'item' and remove it from 'list'.
@@ -60,6 +66,12 @@ void gc_free( llist_t *list, ll_item_t *item ){
      * basically each root object has to deallocate its elements if any.
      */
 	ob_free( obj );
+	/*
+	 * Owned handle values are released only here, see handle_release.
+	 */
+	if( ob_is_handle(obj) ){
+		handle_release( ob_handle_ucast(obj) );
+	}
 	/*
 	 * Finally delete the object pointer itself.
 	 */
@@ -116,6 +128,14 @@ Object *gc_track( Object *o, size_t size ){
     	hyb_error( H_ET_GENERIC, "Reached max allowed memory usage (%d bytes)", __gc.mm_threshold );
     }
 
+    /*
+     * Collections and strings could have been already filled by their
+     * constructor, so let the type tell its real footprint if it can.
+     */
+    if( o->type->get_footprint != NULL ){
+    	size = o->type->get_footprint(o);
+    }
+
     gc_lock();
 
     DEBUG( "[GC DEBUG] Tracking new object at %p [%d bytes].\n", o, size );
@@ -124,6 +144,8 @@ Object *gc_track( Object *o, size_t size ){
      * Increment memory usage counter.
      */
     __gc.usage += size;
+    __gc.stats.allocated_objects++;
+    __gc.stats.allocated_bytes += size;
     /*
      * Update the gc_size inner descriptor.
      */
@@ -133,9 +155,53 @@ Object *gc_track( Object *o, size_t size ){
 
     gc_unlock();
 
+    trc_count_alloc();
+    hyb_probe_object_alloc( o->type->name, size );
+
     return o;
 }
 
+/*
+ * Update the memory footprint of an already tracked object
+ * whose inner buffers grew or shrunk, adjusting the global
+ * usage counter by the difference.
+ */
+void gc_resize( Object *o, size_t size ){
+	bool grown = ( size > o->gc_size );
+
+	gc_lock();
+
+	DEBUG( "[GC DEBUG] Resizing object at %p [%d -> %d bytes].\n", o, o->gc_size, size );
+
+	if( grown ){
+		__gc.usage                 += size - o->gc_size;
+		__gc.stats.allocated_bytes += size - o->gc_size;
+	}
+	else{
+		__gc.usage -= o->gc_size - size;
+	}
+	o->gc_size = size;
+
+	gc_unlock();
+	/*
+	 * Growing a buffer is an allocation like any other, so check
+	 * the maximum memory usage here too.
+	 */
+	if( grown && __gc.usage >= __gc.mm_threshold ){
+		hyb_error( H_ET_GENERIC, "Reached max allowed memory usage (%d bytes)", __gc.mm_threshold );
+	}
+}
+
+void gc_set_log( bool enabled ){
+	__gc.log = enabled;
+}
+
+void gc_get_stats( gc_stats_t *stats ){
+	gc_lock();
+	memcpy( stats, &__gc.stats, sizeof(gc_stats_t) );
+	gc_unlock();
+}
+
 size_t gc_mm_items(){
 	return __gc.heap.items + __gc.lag.items + __gc.constants.items;
 }
@@ -219,6 +285,8 @@ void gc_sweep_generation( llist_t *generation ){
 				 */
 				if( generation != &__gc.lag && GC_IS_LAGGING(++o->gc_count) ){
 					DEBUG( "[GC DEBUG] Migrating %p (collected %d times) to the lag space.\n", o, o->gc_count );
+
+					__gc.stats.last_promoted++;
 					/*
 					 * Migrate the object.
 					 */
@@ -233,6 +301,9 @@ void gc_sweep_generation( llist_t *generation ){
 			else{
 				DEBUG( "[GC DEBUG] Releasing %p [%s] .\n", o, ob_typename(o) );
 
+				__gc.stats.last_freed_objects++;
+				__gc.stats.last_freed_bytes += o->gc_size;
+
 				gc_free( generation, ll_item );
 			}
 		}
@@ -241,6 +312,169 @@ void gc_sweep_generation( llist_t *generation ){
 	}
 }
 
+void gc_add_root( MemorySegment *root ){
+	gc_lock();
+	ll_append( &__gc.roots, root );
+	gc_unlock();
+}
+
+void gc_remove_root( MemorySegment *root ){
+	gc_lock();
+	ll_foreach( &__gc.roots, item ){
+		if( ll_data( MemorySegment *, item ) == root ){
+			ll_remove( &__gc.roots, item );
+			break;
+		}
+	}
+	gc_unlock();
+}
+void gc_add_root_walker( gc_root_walker_t walker, void *data ){
+	gc_walker_t *w = (gc_walker_t *)malloc( sizeof(gc_walker_t) );
+
+	w->walker = walker;
+	w->data   = data;
+
+	gc_lock();
+	ll_append( &__gc.walkers, w );
+	gc_unlock();
+}
+
+void gc_remove_root_walker( gc_root_walker_t walker, void *data ){
+	gc_lock();
+	ll_foreach( &__gc.walkers, item ){
+		gc_walker_t *w = ll_data( gc_walker_t *, item );
+		if( w->walker == walker && w->data == data ){
+			free(w);
+			ll_remove( &__gc.walkers, item );
+			break;
+		}
+	}
+	gc_unlock();
+}
+/*
+ * Visitor given to native root walkers during the mark phase.
+ */
+static void gc_alive_visitor( Object *o, void *data ){
+	gc_set_alive( o );
+}
+/*
+ * Mark every object defined in a memory frame.
+ */
+INLINE void gc_mark_frame( vframe_t *frame ){
+	size_t j, size( frame->size() );
+	/*
+	 * Loop each object defined into this frame.
+	 */
+	for( j = 0; j < size; ++j ){
+		/*
+		 * Mark the object and its referenced objects as live objects.
+		 */
+		gc_set_alive( frame->at(j) );
+	}
+}
+/*
+ * Mark every object defined in the frames of a thread scope.
+ */
+INLINE void gc_mark_scope( vm_scope_t *scope ){
+	ll_item_t *item;
+	/*
+	 * Loop each active memory frame and mark alive objects.
+	 */
+	for( item = scope->head; item; item = item->next ){
+		gc_mark_frame( ll_data( vframe_t *, item ) );
+	}
+}
+void gc_walk_objects( gc_visitor_t visitor, void *data ){
+	gc_lock();
+	ll_foreach( &__gc.heap, item ){
+		visitor( ll_data( Object *, item ), data );
+	}
+	ll_foreach( &__gc.lag, item ){
+		visitor( ll_data( Object *, item ), data );
+	}
+	ll_foreach( &__gc.constants, item ){
+		visitor( ll_data( Object *, item ), data );
+	}
+	gc_unlock();
+}
+/*
+ * Visit every object defined in the frames of a thread scope.
+ */
+INLINE void gc_walk_scope( vm_scope_t *scope, gc_visitor_t visitor, void *data ){
+	ll_item_t *item;
+	vframe_t  *frame;
+	size_t	   i;
+
+	for( item = scope->head; item; item = item->next ){
+		frame = ll_data( vframe_t *, item );
+		for( i = 0; i < frame->size(); ++i ){
+			if( frame->at(i) ){
+				visitor( frame->at(i), data );
+			}
+		}
+	}
+}
+
+void gc_walk_roots( vm_t *vm, gc_visitor_t visitor, void *data ){
+	vm_thread_scope_t::iterator i_scope;
+	vframe_t *frame;
+	size_t	  i;
+
+	gc_walk_scope( &vm->frames, visitor, data );
+
+	vv_foreach( vm_thread_scope_t, i_scope, vm->th_frames ){
+		gc_walk_scope( i_scope->second, visitor, data );
+	}
+
+	gc_lock();
+	ll_foreach( &__gc.roots, item ){
+		frame = ll_data( vframe_t *, item );
+		for( i = 0; i < frame->size(); ++i ){
+			if( frame->at(i) ){
+				visitor( frame->at(i), data );
+			}
+		}
+	}
+	ll_foreach( &__gc.walkers, item ){
+		gc_walker_t *w = ll_data( gc_walker_t *, item );
+		w->walker( w->data, visitor, data );
+	}
+	ll_foreach( &__gc.constants, item ){
+		visitor( ll_data( Object *, item ), data );
+	}
+	gc_unlock();
+}
+/*
+ * Update statistics at the end of a collection, 'start', 'marked' and
+ * 'end' are the timestamps of the beginning of the mark phase, of the
+ * sweep phase and of the end of the collection.
+ */
+INLINE void gc_account_collection( ulong start, ulong marked, ulong end ){
+	ulong  pause  = end - start,
+		   us	  = pause / 1000;
+	size_t bucket = 0;
+
+	while( us > 1 && bucket < GC_PAUSE_BUCKETS - 1 ){
+		us >>= 1;
+		++bucket;
+	}
+
+	gc_lock();
+
+	__gc.stats.freed_objects  += __gc.stats.last_freed_objects;
+	__gc.stats.freed_bytes    += __gc.stats.last_freed_bytes;
+	__gc.stats.promoted		  += __gc.stats.last_promoted;
+	__gc.stats.last_mark_time  = marked - start;
+	__gc.stats.last_sweep_time = end - marked;
+	__gc.stats.mark_time	  += __gc.stats.last_mark_time;
+	__gc.stats.sweep_time	  += __gc.stats.last_sweep_time;
+	__gc.stats.pauses[bucket]++;
+	if( pause > __gc.stats.max_pause ){
+		__gc.stats.max_pause = pause;
+	}
+
+	gc_unlock();
+}
 /*
  * The main collection routine.
  */
@@ -250,37 +484,51 @@ void gc_collect( vm_t *vm ){
      * threshold.
      */
     if( __gc.usage >= __gc.gc_threshold ){
-		ll_item_t *item;
-    	vframe_t  *frame;
-    	size_t j, size;
-
+    	vm_thread_scope_t::iterator i_scope;
+    	ulong  start,
+    		   marked,
+    		   end;
+    	size_t usage;
     	/*
     	 * Lock the virtual machine to prevent new frames to be added.
     	 */
     	vm_mm_lock( vm );
-    	/*
-    	 * Get the scope to collect.
-    	 */
-    	vm_scope_t *scope = vm_find_scope(vm);
 
-    	DEBUG( "[GC DEBUG] GC quota (%d bytes) reached with %d bytes, collecting thread %p scope ...\n", __gc.gc_threshold, __gc.usage, pthread_self() );
+    	hyb_probe_gc_start( __gc.usage );
+
+    	start = gc_now();
+    	usage = __gc.usage;
+
+    	__gc.stats.last_freed_objects = 0;
+    	__gc.stats.last_freed_bytes   = 0;
+    	__gc.stats.last_promoted	  = 0;
+
+    	DEBUG( "[GC DEBUG] GC quota (%d bytes) reached with %d bytes, collecting from thread %p ...\n", __gc.gc_threshold, __gc.usage, pthread_self() );
 
 		/*
-		 * Loop each active main memory frame and mark alive objects.
+		 * Every thread scope is a root set, objects living in a worker
+		 * thread frames (thread arguments, pending results, etc) must
+		 * survive a collection triggered by another thread.
 		 */
-		for( item = scope->head; item; item = item->next ){
-			frame = ll_data( vframe_t *, item );
-			size  = frame->size();
-			/*
-			 * Loop each object defined into this frame.
-			 */
-			for( j = 0; j < size; ++j ){
-				/*
-				 * Mark the object and its referenced objects as live objects.
-				 */
-				gc_set_alive( frame->at(j) );
-			}
+		gc_mark_scope( &vm->frames );
+
+		vv_foreach( vm_thread_scope_t, i_scope, vm->th_frames ){
+			gc_mark_scope( i_scope->second );
+		}
+		/*
+		 * Finally mark explicitly registered root sets.
+		 */
+		gc_lock();
+		ll_foreach( &__gc.roots, item ){
+			gc_mark_frame( ll_data( vframe_t *, item ) );
 		}
+		ll_foreach( &__gc.walkers, item ){
+			gc_walker_t *w = ll_data( gc_walker_t *, item );
+			w->walker( w->data, gc_alive_visitor, NULL );
+		}
+		gc_unlock();
+
+		marked = gc_now();
 		/*
 		 * New collection, increment global collections counter.
 		 */
@@ -292,14 +540,36 @@ void gc_collect( vm_t *vm ){
 			DEBUG( "[GC DEBUG] Lag space (%d items) is bigger than heap space (%d items), collecting it.\n", __gc.lag.items, __gc.heap.items );
 
 			gc_sweep_generation( &__gc.lag );
+
+			__gc.stats.lag_collections++;
 		}
 		/*
 		 * Sweep younger objects in the heap space.
 		 */
 		gc_sweep_generation( &__gc.heap );
 
+		__gc.stats.heap_collections++;
+
 		DEBUG( "[GC DEBUG] Garbage collection cycle done, %d collections done.\n", __gc.collections );
 
+		end = gc_now();
+
+		gc_account_collection( start, marked, end );
+
+		if( __gc.log ){
+			fprintf( stderr, "[GC] #%lu %lu -> %lu bytes, freed %lu objects (%lu bytes), promoted %lu, mark %.3f ms, sweep %.3f ms\n",
+							 __gc.collections,
+							 usage,
+							 __gc.usage,
+							 __gc.stats.last_freed_objects,
+							 __gc.stats.last_freed_bytes,
+							 __gc.stats.last_promoted,
+							 (marked - start) / 1000000.0,
+							 (end - marked) / 1000000.0 );
+		}
+
+		hyb_probe_gc_done( __gc.usage, __gc.collections );
+
 		/*
 		 * Unlock the virtual machine frames vector.
 		 */
@@ -335,4 +605,11 @@ void gc_release(){
 	gc_free_generation( &__gc.heap );
 	gc_free_generation( &__gc.lag );
 	gc_free_generation( &__gc.constants );
+
+	ll_clear( &__gc.roots );
+
+	ll_foreach( &__gc.walkers, item ){
+		free( item->data );
+	}
+	ll_clear( &__gc.walkers );
 }
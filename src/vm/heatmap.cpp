@@ -0,0 +1,367 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "heatmap.h"
+#include "vm.h"
+#include "parser.h"
+#include <time.h>
+#include <sched.h>
+#include <vector>
+#include <string>
+
+using std::vector;
+using std::string;
+
+typedef struct {
+	ulong hits;
+	ulong time;
+}
+hm_line_t;
+
+typedef vector<hm_line_t> hm_lines_t;
+
+/*
+ * Per thread heatmap, lines of each source are indexed by
+ * [source][lineno], once created it's pushed on a global lock-free
+ * list.
+ * The owner raises 'busy' while recording a hit, hm_stop disables the
+ * heatmap and waits for the flag to drop before merging and clearing
+ * the table. Tables of other threads are never released, since their
+ * owners keep a pointer to them.
+ */
+typedef struct _hm_thread_t {
+	int					 busy;
+	vector<hm_lines_t>   sources;
+	/*
+	 * Last evaluated node position and timestamp.
+	 */
+	bool				 last_valid;
+	unsigned int		 last_source;
+	size_t				 last_line;
+	ulong				 last_ts;
+	struct _hm_thread_t *next;
+}
+hm_thread_t;
+
+volatile bool 		  __hm_enabled = false;
+__thread unsigned int __hm_source  = 0;
+
+static __thread hm_thread_t *__hm_thread  = NULL;
+static hm_thread_t *volatile __hm_threads = NULL;
+/*
+ * Sources table, index 0 is used for nodes created outside the parser.
+ * Names are never released nor moved so they can be read without locking.
+ */
+static const char	  *__hm_sources[HM_MAX_SOURCES] = { "<unknown>" };
+static volatile size_t __hm_nsources = 1;
+static pthread_mutex_t __hm_sources_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char			   __hm_filename[0xFF] = {0};
+
+/*
+ * Current time in nanoseconds.
+ */
+INLINE ulong hm_now(){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+INLINE hm_thread_t *hm_thread(){
+	hm_thread_t *th;
+
+	if( __hm_thread == NULL ){
+		th = __hm_thread = new hm_thread_t;
+		th->busy	   = 0;
+		th->last_valid = false;
+		do{
+			th->next = __hm_threads;
+		}
+		while( __sync_bool_compare_and_swap( &__hm_threads, th->next, th ) == false );
+	}
+
+	return __hm_thread;
+}
+
+INLINE hm_line_t *hm_line( hm_thread_t *th, unsigned int source, size_t lineno ){
+	if( source >= th->sources.size() ){
+		th->sources.resize( source + 1 );
+	}
+	if( lineno >= th->sources[source].size() ){
+		hm_line_t empty = { 0, 0 };
+		th->sources[source].resize( lineno + 1, empty );
+	}
+
+	return &th->sources[source][lineno];
+}
+
+unsigned int hm_set_source( const char *path ){
+	unsigned int prev = __hm_source,
+				 i;
+
+	pthread_mutex_lock( &__hm_sources_mutex );
+	for( i = 0; i < __hm_nsources; ++i ){
+		if( strcmp( __hm_sources[i], path ) == 0 ){
+			break;
+		}
+	}
+	if( i == __hm_nsources ){
+		/*
+		 * Table is full, account further sources as unknown.
+		 */
+		if( i == HM_MAX_SOURCES ){
+			i = 0;
+		}
+		else{
+			__hm_sources[i] = strdup(path);
+			__sync_synchronize();
+			__hm_nsources = i + 1;
+		}
+	}
+	pthread_mutex_unlock( &__hm_sources_mutex );
+
+	__hm_source = i;
+
+	return prev;
+}
+
+void hm_restore_source( unsigned int source ){
+	__hm_source = source;
+}
+
+const char *hm_source_name( unsigned int source ){
+	return ( source < __hm_nsources ? __hm_sources[source] : __hm_sources[0] );
+}
+
+void hm_start( vm_t *vm, const char *filename ){
+	strncpy( __hm_filename, filename, sizeof(__hm_filename) - 1 );
+
+	__hm_enabled = true;
+}
+
+void hm_hit( Node *node ){
+	ulong		 now = hm_now();
+	hm_thread_t *th  = hm_thread();
+
+	__atomic_store_n( &th->busy, 1, __ATOMIC_SEQ_CST );
+	/*
+	 * Disabled meanwhile, the table could be being merged.
+	 */
+	if( __atomic_load_n( &__hm_enabled, __ATOMIC_SEQ_CST ) == false ){
+		__atomic_store_n( &th->busy, 0, __ATOMIC_RELEASE );
+		return;
+	}
+
+	if( th->last_valid ){
+		hm_line( th, th->last_source, th->last_line )->time += now - th->last_ts;
+	}
+	/*
+	 * Only count statements as line hits, otherwise a line would be
+	 * hit once for each node of its expressions.
+	 */
+	if( node->type == H_NT_STATEMENT || (node->type == H_NT_EXPRESSION && node->opcode == T_EOSTMT) ){
+		hm_line( th, node->source, node->lineno )->hits++;
+	}
+
+	th->last_valid  = true;
+	th->last_source = node->source;
+	th->last_line   = node->lineno;
+	th->last_ts     = now;
+
+	__atomic_store_n( &th->busy, 0, __ATOMIC_RELEASE );
+}
+
+static void hm_json_string( FILE *fp, const char *s ){
+	fputc( '"', fp );
+	for( ; *s; ++s ){
+		if( *s == '"' || *s == '\\' ){
+			fputc( '\\', fp );
+		}
+		fputc( *s, fp );
+	}
+	fputc( '"', fp );
+}
+
+static void hm_write_json( FILE *fp, vector<hm_lines_t>& merged, ulong total ){
+	size_t s, l;
+	bool   first_source = true,
+		   first_line;
+
+	fprintf( fp, "{\n  \"total_ms\" : %.3f,\n  \"sources\" : [", total / 1000000.0 );
+	for( s = 0; s < merged.size(); ++s ){
+		if( merged[s].empty() ){
+			continue;
+		}
+		fprintf( fp, "%s\n    { \"file\" : ", first_source ? "" : "," );
+		hm_json_string( fp, __hm_sources[s] );
+		fprintf( fp, ", \"lines\" : [" );
+
+		first_line = true;
+		for( l = 0; l < merged[s].size(); ++l ){
+			if( merged[s][l].hits || merged[s][l].time ){
+				fprintf( fp, "%s\n      { \"line\" : %lu, \"hits\" : %lu, \"time_ms\" : %.3f }",
+							 first_line ? "" : ",",
+							 l,
+							 merged[s][l].hits,
+							 merged[s][l].time / 1000000.0 );
+				first_line = false;
+			}
+		}
+		fprintf( fp, "\n    ] }" );
+		first_source = false;
+	}
+	fprintf( fp, "\n  ]\n}\n" );
+}
+
+static void hm_write_listing( FILE *fp, vector<hm_lines_t>& merged, ulong total ){
+	size_t s, l;
+	FILE  *src;
+	char   line[1024];
+	bool   eol;
+
+	for( s = 0; s < merged.size(); ++s ){
+		if( merged[s].empty() ){
+			continue;
+		}
+		fprintf( fp, "==== %s ====\n\n%10s %12s %7s %6s\n", __hm_sources[s], "hits", "time (ms)", "%", "line" );
+
+		src = fopen( __hm_sources[s], "r" );
+		l   = 1;
+		eol = true;
+		/*
+		 * Annotate each source line, or just dump the numbers if
+		 * the source can not be read (i.e. <stdin>).
+		 */
+		while( src && fgets( line, sizeof(line), src ) != NULL ){
+			/*
+			 * Only annotate the first chunk of lines longer than the buffer.
+			 */
+			if( eol ){
+				if( l < merged[s].size() && (merged[s][l].hits || merged[s][l].time) ){
+					fprintf( fp, "%10lu %12.3f %6.2f%% %6lu | ",
+								 merged[s][l].hits,
+								 merged[s][l].time / 1000000.0,
+								 total ? merged[s][l].time * 100.0 / total : 0.0,
+								 l );
+				}
+				else{
+					fprintf( fp, "%10s %12s %7s %6lu | ", "", "", "", l );
+				}
+			}
+			fputs( line, fp );
+
+			eol = strchr( line, '\n' ) != NULL;
+			if( eol ){
+				++l;
+			}
+		}
+
+		if( src ){
+			fclose(src);
+		}
+		else{
+			for( l = 0; l < merged[s].size(); ++l ){
+				if( merged[s][l].hits || merged[s][l].time ){
+					fprintf( fp, "%10lu %12.3f %6.2f%% %6lu\n",
+								 merged[s][l].hits,
+								 merged[s][l].time / 1000000.0,
+								 total ? merged[s][l].time * 100.0 / total : 0.0,
+								 l );
+				}
+			}
+		}
+		fprintf( fp, "\n" );
+	}
+}
+
+void hm_stop( vm_t *vm ){
+	vector<hm_lines_t> merged;
+	hm_thread_t 	  *th,
+					  *prev;
+	hm_line_t		  *line;
+	size_t			   s, l, len;
+	ulong			   total = 0;
+	FILE			  *fp;
+
+	if( __hm_enabled == false ){
+		return;
+	}
+
+	__atomic_store_n( &__hm_enabled, false, __ATOMIC_SEQ_CST );
+
+	for( th = __hm_threads; th; th = th->next ){
+		while( __atomic_load_n( &th->busy, __ATOMIC_SEQ_CST ) ){
+			sched_yield();
+		}
+
+		for( s = 0; s < th->sources.size(); ++s ){
+			for( l = 0; l < th->sources[s].size(); ++l ){
+				if( th->sources[s][l].hits || th->sources[s][l].time ){
+					if( s >= merged.size() ){
+						merged.resize( s + 1 );
+					}
+					if( l >= merged[s].size() ){
+						hm_line_t empty = { 0, 0 };
+						merged[s].resize( l + 1, empty );
+					}
+					line = &merged[s][l];
+
+					line->hits += th->sources[s][l].hits;
+					line->time += th->sources[s][l].time;
+					total	   += th->sources[s][l].time;
+				}
+			}
+		}
+
+		th->sources.clear();
+		th->last_valid = false;
+	}
+	/*
+	 * Only the table of the calling thread is surely unused now, other
+	 * threads only push on the list head.
+	 */
+	if( __hm_thread ){
+		if( __sync_bool_compare_and_swap( &__hm_threads, __hm_thread, __hm_thread->next ) == false ){
+			for( prev = __hm_threads; prev; prev = prev->next ){
+				if( prev->next == __hm_thread ){
+					prev->next = __hm_thread->next;
+					break;
+				}
+			}
+		}
+
+		delete __hm_thread;
+		__hm_thread = NULL;
+	}
+
+	if( (fp = fopen( __hm_filename, "w+t" )) == NULL ){
+		hyb_error( H_ET_WARNING, "could not open heatmap output file '%s'", __hm_filename );
+		return;
+	}
+
+	len = strlen(__hm_filename);
+	if( len > 5 && strcmp( __hm_filename + len - 5, ".json" ) == 0 ){
+		hm_write_json( fp, merged, total );
+	}
+	else{
+		hm_write_listing( fp, merged, total );
+	}
+
+	fclose(fp);
+}
@@ -19,7 +19,7 @@
 #include "memory.h"
 #include "common.h"
 
-MemorySegment::MemorySegment() : ITree<Object>(), mutex(PTHREAD_MUTEX_INITIALIZER) {
+MemorySegment::MemorySegment() : ITree<Object>(), lineno(0), mutex(PTHREAD_MUTEX_INITIALIZER) {
 
 }
 
@@ -39,7 +39,7 @@ Object *MemorySegment::add( char *identifier, Object *object ){
     	next->use_ref = false;
     }
 
-    pthread_mutex_lock( &mutex );
+    hyb_mutex_lock( &mutex );
 
     /* if object does not exist yet, insert as a new one */
     if( (prev = get( identifier )) == H_UNDEFINED ){
@@ -66,7 +66,7 @@ Object *MemorySegment::add( char *identifier, Object *object ){
 			 retn = next;
 		 }
     }
-    pthread_mutex_unlock( &mutex );
+    hyb_mutex_unlock( &mutex );
 
     return retn;
 }
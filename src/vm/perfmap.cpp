@@ -0,0 +1,172 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "perfmap.h"
+#include "vm.h"
+#include "heatmap.h"
+#include <sys/mman.h>
+#include <map>
+
+using std::map;
+
+typedef Object *(*pm_exec_t)( vm_t *, vframe_t *, Node * );
+typedef Object *(*pm_trampoline_t)( vm_t *, vframe_t *, Node *, pm_exec_t );
+
+/*
+ * The trampoline gets the vm_exec arguments in the first three argument
+ * registers and vm_exec itself in the fourth one, it sets up a regular
+ * frame (so frame pointer based unwinders can walk through it) and calls
+ * vm_exec, leaving the first three arguments untouched.
+ */
+#if defined(__x86_64__)
+static const unsigned char __pm_code[] = {
+	0x55,				/* push %rbp 		*/
+	0x48, 0x89, 0xe5,	/* mov  %rsp,%rbp 	*/
+	0xff, 0xd1,			/* call *%rcx 		*/
+	0x5d,				/* pop  %rbp 		*/
+	0xc3				/* ret 				*/
+};
+#elif defined(__aarch64__)
+static const unsigned int __pm_code[] = {
+	0xa9bf7bfd,			/* stp x29, x30, [sp, #-16]! */
+	0x910003fd,			/* mov x29, sp 				 */
+	0xd63f0060,			/* blr x3 					 */
+	0xa8c17bfd,			/* ldp x29, x30, [sp], #16 	 */
+	0xd65f03c0			/* ret 						 */
+};
+#endif
+
+typedef map<Node *, pm_trampoline_t> pm_functions_t;
+
+typedef struct {
+	FILE		   *fp;
+	pthread_mutex_t mutex;
+	/*
+	 * Current chunk of trampolines and next free slot.
+	 */
+	unsigned char  *chunk;
+	size_t			next;
+	pm_functions_t  functions;
+}
+pm_t;
+
+volatile bool __pm_enabled = false;
+
+static pm_t __pm = { NULL, PTHREAD_MUTEX_INITIALIZER, NULL, PM_CHUNK_SLOTS };
+
+/*
+ * Allocate a new chunk of trampolines, since they are all the same
+ * code, the whole chunk is filled at once and made executable without
+ * ever being writable again.
+ */
+static bool pm_alloc_chunk(){
+#if defined(__x86_64__) || defined(__aarch64__)
+	unsigned char *chunk;
+	size_t		   i;
+
+	chunk = (unsigned char *)mmap( NULL, PM_CHUNK_SLOTS * PM_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( chunk == MAP_FAILED ){
+		return false;
+	}
+
+	for( i = 0; i < PM_CHUNK_SLOTS; ++i ){
+		memcpy( chunk + i * PM_SLOT_SIZE, __pm_code, sizeof(__pm_code) );
+	}
+
+	__builtin___clear_cache( (char *)chunk, (char *)chunk + PM_CHUNK_SLOTS * PM_SLOT_SIZE );
+
+	if( mprotect( chunk, PM_CHUNK_SLOTS * PM_SLOT_SIZE, PROT_READ | PROT_EXEC ) != 0 ){
+		munmap( chunk, PM_CHUNK_SLOTS * PM_SLOT_SIZE );
+		return false;
+	}
+
+	__pm.chunk = chunk;
+	__pm.next  = 0;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void pm_start( vm_t *vm ){
+#if defined(__x86_64__) || defined(__aarch64__)
+	char filename[0xFF] = {0};
+
+	snprintf( filename, sizeof(filename), "/tmp/perf-%d.map", getpid() );
+
+	if( (__pm.fp = fopen( filename, "w+t" )) == NULL ){
+		hyb_error( H_ET_WARNING, "could not open perf map file '%s'", filename );
+		return;
+	}
+
+	__pm_enabled = true;
+#else
+	hyb_error( H_ET_WARNING, "perf map is not supported on this architecture" );
+#endif
+}
+
+void pm_stop( vm_t *vm ){
+	if( __pm.fp ){
+		__pm_enabled = false;
+
+		fclose( __pm.fp );
+		__pm.fp = NULL;
+	}
+}
+
+/*
+ * Find or create the trampoline of a function.
+ */
+static pm_trampoline_t pm_trampoline( Node *function, const string& name, Node *body ){
+	pm_functions_t::iterator i;
+	pm_trampoline_t			 trampoline = NULL;
+
+	hyb_mutex_lock( &__pm.mutex );
+
+	if( (i = __pm.functions.find(function)) != __pm.functions.end() ){
+		trampoline = i->second;
+	}
+	else if( __pm.next < PM_CHUNK_SLOTS || pm_alloc_chunk() ){
+		trampoline = (pm_trampoline_t)( __pm.chunk + __pm.next++ * PM_SLOT_SIZE );
+
+		__pm.functions[function] = trampoline;
+
+		fprintf( __pm.fp, "%lx %x hy::%s [%s:%lu]\n",
+						  (unsigned long)trampoline,
+						  PM_SLOT_SIZE,
+						  name.c_str(),
+						  hm_source_name( body ? body->source : function->source ),
+						  function->lineno );
+		fflush( __pm.fp );
+	}
+
+	hyb_mutex_unlock( &__pm.mutex );
+
+	return trampoline;
+}
+
+Object *pm_exec( vm_t *vm, vframe_t *frame, Node *function, const string& name, Node *body ){
+	pm_trampoline_t trampoline = pm_trampoline( function, name, body );
+
+	if( trampoline == NULL ){
+		return vm_exec( vm, frame, body );
+	}
+
+	return trampoline( vm, frame, body, vm_exec );
+}
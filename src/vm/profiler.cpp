@@ -0,0 +1,306 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "profiler.h"
+#include "vm.h"
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <map>
+
+using std::map;
+
+typedef struct {
+	/*
+	 * 0 = free, 1 = being written, otherwise the hash of the name.
+	 */
+	volatile unsigned int hash;
+	char				  name[PROF_NAME_SIZE];
+}
+prof_name_t;
+
+typedef struct {
+	/*
+	 * 0 = free, 1 = being written, otherwise the hash of the stack.
+	 */
+	volatile unsigned long hash;
+	volatile size_t		   count;
+	size_t				   depth;
+	/*
+	 * Each frame is ( name index << 32 | lineno ).
+	 */
+	unsigned long		   frames[PROF_MAX_DEPTH];
+}
+prof_stack_t;
+
+typedef struct {
+	vm_t 			 *vm;
+	bool			  running;
+	char			  filename[0xFF];
+	prof_stack_t 	 *stacks;
+	volatile size_t   samples;
+	volatile size_t   dropped;
+	prof_name_t 	 *names;
+	struct sigaction  old_action;
+}
+prof_t;
+
+static prof_t __prof;
+
+/*
+ * FNV-1a hash of a frame name, never 0 or 1.
+ */
+INLINE unsigned int prof_hash( const char *name, size_t len ){
+	unsigned int h = 2166136261U;
+	size_t 		 i;
+
+	for( i = 0; i < len; ++i ){
+		h = (h ^ (unsigned char)name[i]) * 16777619U;
+	}
+
+	return ( h < 2 ? h + 2 : h );
+}
+/*
+ * Find or insert a frame name in the intern table, return its index
+ * or -1 if the table is full.
+ * Entries being written by another thread are skipped, at worst the
+ * same name will be interned twice, names are merged when dumping.
+ */
+static long prof_intern( const char *name, size_t len ){
+	unsigned int h = prof_hash( name, len ),
+				 i, idx, cur;
+
+	if( len >= PROF_NAME_SIZE ){
+		len = PROF_NAME_SIZE - 1;
+	}
+
+	for( i = 0; i < PROF_MAX_NAMES; ++i ){
+		idx = (h + i) % PROF_MAX_NAMES;
+		cur = __prof.names[idx].hash;
+
+		if( cur == h && strncmp( __prof.names[idx].name, name, len ) == 0 && __prof.names[idx].name[len] == 0x00 ){
+			return idx;
+		}
+		else if( cur == 0 && __sync_bool_compare_and_swap( &__prof.names[idx].hash, 0, 1 ) ){
+			memcpy( __prof.names[idx].name, name, len );
+			__prof.names[idx].name[len] = 0x00;
+			__sync_synchronize();
+			__prof.names[idx].hash = h;
+			return idx;
+		}
+	}
+
+	return -1;
+}
+/*
+ * FNV-1a hash of a stack, never 0 or 1.
+ */
+INLINE unsigned long prof_stack_hash( unsigned long *frames, size_t depth ){
+	unsigned long h = 14695981039346656037UL;
+	size_t 		  i;
+
+	for( i = 0; i < depth; ++i ){
+		h = (h ^ frames[i]) * 1099511628211UL;
+	}
+
+	return ( h < 2 ? h + 2 : h );
+}
+/*
+ * Count a sample of the given stack, return false if the table is full.
+ * As for names, entries being written by another thread are skipped and
+ * duplicates are merged when dumping.
+ */
+static bool prof_account( unsigned long *frames, size_t depth ){
+	unsigned long h = prof_stack_hash( frames, depth ),
+				  cur;
+	size_t 		  i, idx;
+	prof_stack_t *stack;
+
+	for( i = 0; i < PROF_MAX_PROBES; ++i ){
+		idx   = (h + i) % PROF_MAX_STACKS;
+		stack = &__prof.stacks[idx];
+		cur   = stack->hash;
+
+		if( cur == h && stack->depth == depth && memcmp( stack->frames, frames, depth * sizeof(unsigned long) ) == 0 ){
+			__sync_fetch_and_add( &stack->count, 1 );
+			return true;
+		}
+		else if( cur == 0 && __sync_bool_compare_and_swap( &stack->hash, 0, 1 ) ){
+			memcpy( stack->frames, frames, depth * sizeof(unsigned long) );
+			stack->depth = depth;
+			stack->count = 1;
+			__sync_synchronize();
+			stack->hash = h;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void prof_signal_handler( int sig ){
+	vm_t 	   	 *vm = __prof.vm;
+	vm_scope_t 	 *scope;
+	ll_item_t  	 *item;
+	vframe_t   	 *frame;
+	unsigned long frames[PROF_MAX_DEPTH];
+	size_t 		  depth, i;
+	long		  name;
+	int			  saved_errno = errno;
+
+	if( __prof.running == false ){
+		return;
+	}
+	/*
+	 * Cached thread scope, which is the one of the running coroutine
+	 * when a scheduler switched to it, or the main one if the main
+	 * thread did not cache it yet.
+	 */
+	scope = __vm_scope;
+	if( scope == NULL && pthread_self() == vm->main_tid ){
+		scope = &vm->frames;
+	}
+	if( scope == NULL || scope->items == 0 ){
+		__sync_fetch_and_add( &__prof.dropped, 1 );
+		errno = saved_errno;
+		return;
+	}
+
+	depth = ( scope->items > PROF_MAX_DEPTH ? PROF_MAX_DEPTH : scope->items );
+	/*
+	 * The scope is walked from the outer frame, if the list is being
+	 * modified right now, the loop stops at the first NULL item.
+	 */
+	for( i = 0, item = scope->head; item && i < depth; item = item->next ){
+		frame = ll_data( vframe_t *, item );
+		name  = prof_intern( frame->owner.c_str(), frame->owner.size() );
+		if( name >= 0 ){
+			frames[i++] = ((unsigned long)name << 32) | (frame->lineno & 0xFFFFFFFF);
+		}
+	}
+
+	if( i == 0 || prof_account( frames, i ) == false ){
+		__sync_fetch_and_add( &__prof.dropped, 1 );
+	}
+	else{
+		__sync_fetch_and_add( &__prof.samples, 1 );
+	}
+
+	errno = saved_errno;
+}
+
+void prof_start( vm_t *vm, const char *filename ){
+	struct sigaction action;
+	struct itimerval timer;
+
+	memset( &__prof, 0x00, sizeof(prof_t) );
+
+	__prof.vm = vm;
+	strncpy( __prof.filename, filename, sizeof(__prof.filename) - 1 );
+
+	__prof.stacks = (prof_stack_t *)mmap( NULL, PROF_MAX_STACKS * sizeof(prof_stack_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	__prof.names = (prof_name_t *)mmap( NULL, PROF_MAX_NAMES * sizeof(prof_name_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+	if( __prof.stacks == MAP_FAILED || __prof.names == MAP_FAILED ){
+		hyb_error( H_ET_GENERIC, "could not allocate profiler buffers" );
+	}
+
+	memset( &action, 0x00, sizeof(action) );
+	action.sa_handler = prof_signal_handler;
+	action.sa_flags   = SA_RESTART;
+	sigemptyset( &action.sa_mask );
+
+	sigaction( SIGPROF, &action, &__prof.old_action );
+
+	__prof.running = true;
+	/*
+	 * ITIMER_PROF counts cpu time of the whole process, so busy threads
+	 * are sampled proportionally to the cpu they use.
+	 */
+	timer.it_interval.tv_sec  = 0;
+	timer.it_interval.tv_usec = PROF_INTERVAL_US;
+	timer.it_value			  = timer.it_interval;
+
+	setitimer( ITIMER_PROF, &timer, NULL );
+}
+
+void prof_stop( vm_t *vm ){
+	struct itimerval  timer;
+	map<string,size_t> stacks;
+	map<string,size_t>::iterator i_stack;
+	prof_stack_t	 *entry;
+	size_t 			  pos, i, name, lineno;
+	char			  lbuffer[0xFF];
+	FILE			 *fp;
+
+	if( __prof.running == false ){
+		return;
+	}
+
+	memset( &timer, 0x00, sizeof(timer) );
+	setitimer( ITIMER_PROF, &timer, NULL );
+
+	__prof.running = false;
+
+	sigaction( SIGPROF, &__prof.old_action, NULL );
+	/*
+	 * Resolve names of the aggregated stacks, the map merges entries
+	 * that were duplicated by concurrent inserts.
+	 */
+	for( pos = 0; pos < PROF_MAX_STACKS; ++pos ){
+		string stack;
+
+		entry = &__prof.stacks[pos];
+		if( entry->hash < 2 ){
+			continue;
+		}
+
+		for( i = 0; i < entry->depth; ++i ){
+			name   = entry->frames[i] >> 32;
+			lineno = entry->frames[i] & 0xFFFFFFFF;
+
+			if( i ){
+				stack += ";";
+			}
+			stack += __prof.names[name].name;
+			if( lineno ){
+				sprintf( lbuffer, ":%lu", lineno );
+				stack += lbuffer;
+			}
+		}
+
+		stacks[stack] += entry->count;
+	}
+
+	if( (fp = fopen( __prof.filename, "w+t" )) == NULL ){
+		hyb_error( H_ET_WARNING, "could not open profiler output file '%s'", __prof.filename );
+	}
+	else{
+		for( i_stack = stacks.begin(); i_stack != stacks.end(); ++i_stack ){
+			fprintf( fp, "%s %lu\n", i_stack->first.c_str(), i_stack->second );
+		}
+		fclose(fp);
+	}
+
+	if( __prof.dropped ){
+		hyb_error( H_ET_WARNING, "profiler dropped %lu samples out of %lu", __prof.dropped, __prof.dropped + __prof.samples );
+	}
+
+	munmap( __prof.stacks, PROF_MAX_STACKS * sizeof(prof_stack_t) );
+	munmap( __prof.names, PROF_MAX_NAMES * sizeof(prof_name_t) );
+}
@@ -0,0 +1,346 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "tracer.h"
+#include "vm.h"
+#include <time.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <sched.h>
+
+using std::map;
+using std::vector;
+
+/*
+ * Accumulated statistics of a single function.
+ */
+typedef struct {
+	ulong calls;
+	/*
+	 * Inclusive time, only accounted by the outermost call of a
+	 * recursion, otherwise nested calls would be counted more times.
+	 */
+	ulong total;
+	ulong self;
+	ulong allocs;
+	ulong active;
+}
+trc_stat_t;
+
+/*
+ * An active call.
+ */
+typedef struct {
+	trc_stat_t *stat;
+	ulong		start;
+	ulong		child;
+	ulong		allocs;
+	ulong		child_allocs;
+}
+trc_call_t;
+
+typedef map<string,trc_stat_t> trc_stats_t;
+typedef vector<trc_call_t>	   trc_calls_t;
+/*
+ * Active calls of each execution context of the thread (the thread
+ * scope or the scope of a coroutine), so that swapping context in the
+ * middle of a call does not charge time to the wrong function.
+ */
+typedef map<void *,trc_calls_t> trc_stacks_t;
+/*
+ * Interned "type::method" key of a method call.
+ */
+typedef struct {
+	string		type;
+	string		method;
+	trc_stat_t *stat;
+}
+trc_method_t;
+
+typedef map< std::pair<const char *,const char *>, trc_method_t > trc_methods_t;
+
+/*
+ * Per thread tracing buffer, once created it's pushed on a global
+ * lock-free list.
+ * Only the owner thread records on it, without any lock. The 'busy'
+ * flag is raised while it's doing so, trc_stop disables the tracer
+ * and waits for the flag to drop before merging and clearing the
+ * table, which is never released under the feet of its owner.
+ */
+typedef struct _trc_thread_t {
+	int						busy;
+	trc_stacks_t			stacks;
+	/*
+	 * Last used context and its stack.
+	 */
+	void				   *context;
+	trc_calls_t			   *calls;
+	trc_stats_t		   		stats;
+	trc_methods_t			methods;
+	struct _trc_thread_t   *next;
+}
+trc_thread_t;
+
+volatile bool	  __trc_enabled = false;
+__thread ulong 	  __trc_allocs  = 0;
+
+static __thread trc_thread_t *__trc_thread = NULL;
+static trc_thread_t *volatile __trc_threads = NULL;
+static vm_t					 *__trc_vm		= NULL;
+
+/*
+ * Current time in nanoseconds.
+ */
+INLINE ulong trc_now(){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+INLINE trc_thread_t *trc_thread(){
+	trc_thread_t *th;
+
+	if( __trc_thread == NULL ){
+		th = __trc_thread = new trc_thread_t;
+
+		th->busy	= 0;
+		th->context = NULL;
+		th->calls	= NULL;
+
+		do{
+			th->next = __trc_threads;
+		}
+		while( __sync_bool_compare_and_swap( &__trc_threads, th->next, th ) == false );
+	}
+
+	return __trc_thread;
+}
+/*
+ * Raise the busy flag, return false (and drop it) if the tracer has
+ * been disabled meanwhile.
+ */
+INLINE bool trc_begin( trc_thread_t *th ){
+	__atomic_store_n( &th->busy, 1, __ATOMIC_SEQ_CST );
+	if( __atomic_load_n( &__trc_enabled, __ATOMIC_SEQ_CST ) == false ){
+		__atomic_store_n( &th->busy, 0, __ATOMIC_RELEASE );
+		return false;
+	}
+	return true;
+}
+
+INLINE void trc_end( trc_thread_t *th ){
+	__atomic_store_n( &th->busy, 0, __ATOMIC_RELEASE );
+}
+/*
+ * Active calls of the running context.
+ */
+INLINE trc_calls_t *trc_calls( trc_thread_t *th ){
+	void *context = ( __vm_scope ? __vm_scope : vm_find_scope(__trc_vm) );
+
+	if( th->calls == NULL || th->context != context ){
+		th->context = context;
+		th->calls	= &th->stacks[context];
+	}
+
+	return th->calls;
+}
+
+void trc_start( vm_t *vm ){
+	__trc_vm	  = vm;
+	__trc_enabled = true;
+}
+
+static void trc_push( trc_thread_t *th, trc_stat_t *stat ){
+	trc_call_t call;
+
+	stat->calls++;
+	stat->active++;
+
+	call.stat		  = stat;
+	call.child		  = 0;
+	call.child_allocs = 0;
+	call.allocs		  = __trc_allocs;
+	call.start		  = trc_now();
+
+	trc_calls(th)->push_back(call);
+}
+
+void trc_enter( const string& name ){
+	trc_thread_t *th = trc_thread();
+
+	if( trc_begin(th) ){
+		trc_push( th, &th->stats[name] );
+		trc_end(th);
+	}
+}
+
+void trc_enter_method( const char *type, const char *method ){
+	trc_thread_t *th = trc_thread();
+	trc_method_t *m;
+
+	if( trc_begin(th) == false ){
+		return;
+	}
+
+	m = &th->methods[ std::make_pair( type, method ) ];
+	/*
+	 * First call from this pair of addresses, or they're being reused
+	 * by other names.
+	 */
+	if( m->stat == NULL || m->type != type || m->method != method ){
+		m->type   = type;
+		m->method = method;
+		m->stat	  = &th->stats[ m->type + "::" + m->method ];
+	}
+
+	trc_push( th, m->stat );
+
+	trc_end(th);
+}
+
+void trc_leave(){
+	ulong		  end = trc_now(),
+				  elapsed,
+				  allocs;
+	trc_thread_t *th  = trc_thread();
+	trc_calls_t  *calls;
+	trc_call_t   *call;
+
+	if( trc_begin(th) == false ){
+		return;
+	}
+
+	calls = trc_calls(th);
+	/*
+	 * The tracer was enabled while this call was already running.
+	 */
+	if( calls->empty() ){
+		trc_end(th);
+		return;
+	}
+
+	call    = &calls->back();
+	elapsed = end - call->start;
+	allocs  = __trc_allocs - call->allocs;
+	/*
+	 * Allocations are counted per thread, other contexts could have
+	 * run in between.
+	 */
+	call->stat->self   += ( elapsed > call->child ? elapsed - call->child : 0 );
+	call->stat->allocs += ( allocs > call->child_allocs ? allocs - call->child_allocs : 0 );
+	if( --call->stat->active == 0 ){
+		call->stat->total += elapsed;
+	}
+
+	calls->pop_back();
+	/*
+	 * Account this call on its caller, or drop the stack of a context
+	 * with no more active calls.
+	 */
+	if( calls->empty() == false ){
+		calls->back().child 	   += elapsed;
+		calls->back().child_allocs += allocs;
+	}
+	else{
+		th->stacks.erase( th->context );
+		th->calls = NULL;
+	}
+
+	trc_end(th);
+}
+
+static bool trc_cmp_self( const std::pair<string,trc_stat_t>& a, const std::pair<string,trc_stat_t>& b ){
+	return a.second.self > b.second.self;
+}
+
+void trc_stop( vm_t *vm ){
+	trc_thread_t *th,
+				 *next;
+	trc_stats_t   merged;
+	trc_stats_t::iterator si;
+	trc_stat_t   *stat;
+	vector< std::pair<string,trc_stat_t> > sorted;
+	vector< std::pair<string,trc_stat_t> >::iterator vi;
+
+	if( __trc_enabled == false ){
+		return;
+	}
+
+	__atomic_store_n( &__trc_enabled, false, __ATOMIC_SEQ_CST );
+	/*
+	 * Merge each thread table once its owner is not recording anymore,
+	 * from now on it will see the tracer disabled.
+	 */
+	for( th = __trc_threads; th; th = th->next ){
+		while( __atomic_load_n( &th->busy, __ATOMIC_SEQ_CST ) ){
+			sched_yield();
+		}
+
+		for( si = th->stats.begin(); si != th->stats.end(); ++si ){
+			stat = &merged[si->first];
+
+			stat->calls  += si->second.calls;
+			stat->total  += si->second.total;
+			stat->self   += si->second.self;
+			stat->allocs += si->second.allocs;
+		}
+
+		th->methods.clear();
+		th->stats.clear();
+		th->stacks.clear();
+		th->calls = NULL;
+	}
+
+	sorted.assign( merged.begin(), merged.end() );
+	std::sort( sorted.begin(), sorted.end(), trc_cmp_self );
+
+	fprintf( stderr, "\n%-40s %10s %14s %14s %10s\n", "function", "calls", "total (ms)", "self (ms)", "allocs" );
+	for( vi = sorted.begin(); vi != sorted.end(); ++vi ){
+		fprintf( stderr, "%-40s %10lu %14.3f %14.3f %10lu\n",
+						 vi->first.c_str(),
+						 vi->second.calls,
+						 vi->second.total / 1000000.0,
+						 vi->second.self  / 1000000.0,
+						 vi->second.allocs );
+	}
+
+	/*
+	 * Only the table of the calling thread is surely unused now, the
+	 * others stay (empty) until the process exits.
+	 */
+	if( __trc_thread ){
+		/*
+		 * Other threads only push on the list head.
+		 */
+		if( __sync_bool_compare_and_swap( &__trc_threads, __trc_thread, __trc_thread->next ) == false ){
+			for( th = __trc_threads; th; th = next ){
+				next = th->next;
+				if( next == __trc_thread ){
+					th->next = next->next;
+					break;
+				}
+			}
+		}
+
+		delete __trc_thread;
+		__trc_thread = NULL;
+	}
+}
@@ -19,6 +19,11 @@
 #include "vm.h"
 #include "parser.h"
 #include "hybris.h"
+#include "profiler.h"
+#include "tracer.h"
+#include "heatmap.h"
+#include "perfmap.h"
+#include "probes.h"
 
 #ifndef MAX_STRING_SIZE
 #	define MAX_STRING_SIZE 1024
@@ -78,6 +83,7 @@ FILE *vm_fopen( vm_t *vm ){
     		filename = sep + 1;
     	}
     	vm_set_source( vm, filename );
+    	hm_set_source( filename );
 
     	__hyb_file_stack.push_back( filename );
     	__hyb_line_stack.push_back( 1 );
@@ -87,6 +93,7 @@ FILE *vm_fopen( vm_t *vm ){
     }
     else{
     	vm_set_source( vm, "<stdin>" );
+    	hm_set_source( "<stdin>" );
 
     	__hyb_file_stack.push_back("<stdin>");
 
@@ -161,6 +168,33 @@ void vm_init( vm_t *vm, int optind, int *argc, char **argv[], char *envp[] ){
     if( vm->args.mm_threshold > 0 ){
 		gc_set_mm_threshold(vm->args.mm_threshold);
 	}
+    if( vm->args.gc_log ){
+    	gc_set_log(true);
+    }
+    /*
+     * Start the sampling profiler if requested.
+     */
+    if( *vm->args.profile ){
+    	prof_start( vm, vm->args.profile );
+    }
+    /*
+     * Enable the call tracer if requested.
+     */
+    if( vm->args.trace_calls ){
+    	trc_start( vm );
+    }
+    /*
+     * Enable the line heatmap if requested.
+     */
+    if( *vm->args.heatmap ){
+    	hm_start( vm, vm->args.heatmap );
+    }
+    /*
+     * Create the perf map and enable function trampolines if requested.
+     */
+    if( vm->args.perf_map ){
+    	pm_start( vm );
+    }
 
     vm->vmem.owner = "<main>";
     /*
@@ -195,8 +229,44 @@ void vm_init( vm_t *vm, int optind, int *argc, char **argv[], char *envp[] ){
     vm->env = envp;
 }
 
+__thread vm_scope_t *__vm_scope __attribute__((tls_model("initial-exec"))) = NULL;
+
+static vm_io_waiter_t __vm_io_waiter = NULL;
+
+void vm_set_io_waiter( vm_io_waiter_t waiter ){
+	__vm_io_waiter = waiter;
+}
+
+int vm_io_wait( int fd, int events, int timeout ){
+	return ( __vm_io_waiter ? __vm_io_waiter( fd, events, timeout ) : -1 );
+}
+
 void vm_release( vm_t *vm ){
+	ll_item_t	  *m_item,
+				  *f_item;
+	vm_module_t   *module;
+
 	vm->releasing = true;
+	/*
+	 * Stop the profiler (if running) and write its output.
+	 */
+	prof_stop( vm );
+	/*
+	 * Give modules a chance to release their resources (and stop
+	 * their own threads) while the vm is still fully functional.
+	 */
+	for( m_item = vm->modules.head; m_item; m_item = m_item->next ){
+		module = ll_data( vm_module_t *, m_item );
+		if( module->finalizer ){
+			module->finalizer( vm );
+		}
+	}
+	/*
+	 * Print the call tracer report now that module threads are gone.
+	 */
+	trc_stop( vm );
+	hm_stop( vm );
+	pm_stop( vm );
 
     vm_mm_lock( vm );
         if( vm->th_frames.size() ){
@@ -230,10 +300,6 @@ void vm_release( vm_t *vm ){
      */
     gc_release();
 
-	ll_item_t	  *m_item,
-				  *f_item;
-	vm_module_t   *module;
-
 	for( m_item = vm->modules.head; m_item; m_item = m_item->next ){
 		module = ll_data( vm_module_t *, m_item );
 		for( f_item = module->functions.head; f_item; f_item = f_item->next ){
@@ -318,7 +384,13 @@ void vm_load_module( vm_t *vm, string path, string name ){
         return;
     }
 
-    module = new vm_module_t( name, path, hmodule, initializer );
+    /*
+     * Load the optional finalization routine, called by vm_release before
+     * any remaining thread is killed (to join worker threads and so on).
+     */
+    finalizer_t finalizer = (finalizer_t)dlsym( hmodule, "hybris_module_fini" );
+
+    module = new vm_module_t( name, path, hmodule, initializer, finalizer );
 
     while( functions[i].function != NULL ){
         vm_function_t *function = new vm_function_t();
@@ -366,6 +438,8 @@ void vm_load_module( vm_t *vm, string path, string name ){
     }
 
     ll_append( &vm->modules, module );
+
+    hyb_probe_module_load( name.c_str(), path.c_str() );
 }
 
 void vm_load_module( vm_t *vm, char *module ){
@@ -424,6 +498,8 @@ Object *vm_raise_exception( const char *fmt, ... ){
 	 */
 	gc_set_alive(exception);
 
+	hyb_probe_exception_throw( __hyb_vm->source.c_str(), __hyb_vm->lineno );
+
 	vm_frame(__hyb_vm)->state.set( Exception, exception );
 
 	vm_mm_unlock( __hyb_vm );
@@ -922,6 +998,9 @@ Object *vm_exec( vm_t *vm, vframe_t *frame, Node *node ){
 	 * Set current line number.
 	 */
 	vm_set_lineno( vm, node->lineno );
+	frame->lineno = node->lineno;
+
+	hm_exec_hook(node);
 
 	/*
 	 * TODO
@@ -1278,7 +1357,8 @@ INLINE Object *vm_exec_attribute_request( vm_t *vm, vframe_t *frame, Node *node
 }
 
 INLINE Object *vm_exec_method_call( vm_t *vm, vframe_t *frame, Node *node ){
-	Object  *cobj   = H_UNDEFINED;
+	Object  *cobj   = H_UNDEFINED,
+			*result = H_UNDEFINED;
 	char    *name,
 			*owner_id;
 	Node    *member = node->value.member;
@@ -1287,7 +1367,13 @@ INLINE Object *vm_exec_method_call( vm_t *vm, vframe_t *frame, Node *node ){
 	owner_id = (char *)node->value.owner->value.identifier.c_str();
 	name 	 = (char *)member->value.call.c_str();
 
-	return ob_call_method( vm, frame, cobj, owner_id, name, member );
+	hyb_probe_function_entry( name, hm_source_name(node->source), node->lineno );
+
+	result = ob_call_method( vm, frame, cobj, owner_id, name, member );
+
+	hyb_probe_function_return( name, hm_source_name(node->source), node->lineno );
+
+	return result;
 }
 
 INLINE Object *vm_exec_constant( vm_t *vm, vframe_t *frame, Node *node ){
@@ -1476,9 +1562,15 @@ INLINE Object *vm_exec_builtin_function_call( vm_t *vm, vframe_t *frame, Node *
 
     vm_check_frame_exit(frame);
 
+    trc_enter_call( stack.owner );
+    hyb_probe_function_entry( callname, hm_source_name(call->source), call->lineno );
+
     /* call the function */
     result = function->function( vm, &stack );
 
+    hyb_probe_function_return( callname, hm_source_name(call->source), call->lineno );
+    trc_leave_call();
+
 	/*
 	 * Check for unhandled exceptions and put them on the root
 	 * memory frame.
@@ -1493,7 +1585,7 @@ INLINE Object *vm_exec_builtin_function_call( vm_t *vm, vframe_t *frame, Node *
     return result;
 }
 
-Object *vm_exec_threaded_call( vm_t *vm, string function_name, vmem_t *argv ){
+Object *vm_exec_threaded_call( vm_t *vm, string function_name, vmem_t *argv, vframe_t *frame /*= NULL*/, vmem_t *root /*= NULL*/ ){
 	Node    *function = H_UNDEFINED;
 	vframe_t stack;
 	Object  *result   = H_UNDEFINED;
@@ -1538,13 +1630,21 @@ Object *vm_exec_threaded_call( vm_t *vm, string function_name, vmem_t *argv ){
 	/* call the function */
 	result = vm_exec( vm, &stack, body );
 
+	if( frame && stack.state.is(Exception) ){
+		frame->state.set( Exception, stack.state.e_value );
+	}
+
+	if( root && result ){
+		root->push_tmp( result );
+	}
+
 	vm_dismiss_stack( vm );
 
 	/* return function evaluation value */
 	return result;
 }
 
-Object *vm_exec_threaded_call( vm_t *vm, Node *function, vframe_t *frame, vmem_t *argv ){
+Object *vm_exec_threaded_call( vm_t *vm, Node *function, vframe_t *frame, vmem_t *argv, vmem_t *root /*= NULL*/ ){
 	vframe_t stack;
 	Object  *result = H_UNDEFINED;
 	Node    *body   = H_UNDEFINED;
@@ -1582,6 +1682,10 @@ Object *vm_exec_threaded_call( vm_t *vm, Node *function, vframe_t *frame, vmem_t
 		frame->state.set( Exception, stack.state.e_value );
 	}
 
+	if( root && result ){
+		root->push_tmp( result );
+	}
+
 	vm_dismiss_stack( vm );
 
 	/* return function evaluation value */
@@ -1631,8 +1735,14 @@ INLINE Object *vm_exec_user_function_call( vm_t *vm, vframe_t *frame, Node *call
 
     vm_check_frame_exit(frame);
 
+    trc_enter_call( stack.owner );
+    hyb_probe_function_entry( stack.owner.c_str(), hm_source_name(call->source), call->lineno );
+
     /* call the function */
-    result = vm_exec( vm, &stack, function->body );
+    result = pm_exec_body( vm, &stack, function, stack.owner, function->body );
+
+    hyb_probe_function_return( stack.owner.c_str(), hm_source_name(call->source), call->lineno );
+    trc_leave_call();
 
     vm_dismiss_stack( vm );
 	/*
@@ -1783,9 +1893,15 @@ INLINE Object *vm_exec_dll_function_call( vm_t *vm, vframe_t *frame, Node *call
 
     vm_check_frame_exit(frame);
 
+    trc_enter_call( stack.owner );
+    hyb_probe_function_entry( callname, hm_source_name(call->source), call->lineno );
+
     /* call the function */
     result = dllcall->function( vm, &stack );
 
+    hyb_probe_function_return( callname, hm_source_name(call->source), call->lineno );
+    trc_leave_call();
+
     vm_dismiss_stack( vm );
 
     /* return function evaluation value */
@@ -2076,18 +2192,128 @@ INLINE Object *vm_exec_for( vm_t *vm, vframe_t *frame, Node *node ){
     return result;
 }
 
+/*
+ * Handle the state of the frame after a foreach iteration, return true
+ * if the loop has to be interrupted.
+ */
+INLINE bool vm_foreach_interrupted( vframe_t *frame, Object *&result ){
+	if( frame->state.is(Exception) ){
+		result = frame->state.e_value;
+		return true;
+	}
+	else if( frame->state.is(Return) ){
+		result = frame->state.r_value;
+		return true;
+	}
+	else if( frame->state.is(Break) ){
+		frame->state.unset(Break);
+		return true;
+	}
+	frame->state.unset(Next);
+
+	return false;
+}
+/*
+ * foreach( i of a..b ) with integer or char bounds, the range is walked
+ * without building its vector, so it takes constant memory whatever its
+ * size is.
+ */
+INLINE Object *vm_exec_foreach_range( vm_t *vm, vframe_t *frame, char *identifier, long start, long end, bool chars, Node *body ){
+	Object *result = H_UNDEFINED;
+	long	i;
+
+	for( i = start; i <= end; ++i ){
+		/*
+		 * ::add clones the item, so it can live on the stack.
+		 */
+		if( chars ){
+			Char item(i);
+			frame->add( identifier, (Object *)&item );
+		}
+		else{
+			Integer item(i);
+			frame->add( identifier, (Object *)&item );
+		}
+
+		result = vm_exec( vm, frame, body );
+
+		if( vm_foreach_interrupted( frame, result ) ){
+			break;
+		}
+	}
+
+	return result;
+}
+/*
+ * foreach over a class implementing the iterator protocol, __has_next
+ * and __next are called on each step, so generators and streams are
+ * consumed lazily.
+ */
+INLINE Object *vm_exec_foreach_iterator( vm_t *vm, vframe_t *frame, char *identifier, Object *iterator, Node *body ){
+	Object *result = H_UNDEFINED,
+		   *item   = H_UNDEFINED;
+
+	while( ob_lvalue( class_call_overloaded_descriptor( iterator, "__has_next", false, 0 ) ) ){
+		if( frame->state.is(Exception) ){
+			return frame->state.e_value;
+		}
+
+		item = class_call_overloaded_descriptor( iterator, "__next", false, 0 );
+		if( frame->state.is(Exception) ){
+			return frame->state.e_value;
+		}
+
+		frame->add( identifier, item );
+
+		result = vm_exec( vm, frame, body );
+
+		if( vm_foreach_interrupted( frame, result ) ){
+			break;
+		}
+	}
+
+	return result;
+}
+
 INLINE Object *vm_exec_foreach( vm_t *vm, vframe_t *frame, Node *node ){
     int     size;
-    Node   *body;
+    Node   *body,
+    	   *collection;
     Object *v      = H_UNDEFINED,
            *result = H_UNDEFINED;
     char   *identifier;
     Integer index(0);
 
     identifier = (char *)node->child(0)->value.identifier.c_str();
-    v          = vm_exec( vm, frame, node->child(1) );
+    collection = node->child(1);
     body       = node->child(2);
-    size       = ob_get_size(v);
+
+    if( collection->type == H_NT_EXPRESSION && collection->opcode == T_RANGE ){
+    	Object *from = vm_exec( vm, frame, collection->child(0) ),
+    		   *to   = vm_exec( vm, frame, collection->child(1) );
+
+    	vm_check_frame_exit(frame)
+    	/*
+    	 * Same bounds ordering of int_range and char_range.
+    	 */
+    	if( ob_is_int(from) && ob_is_int(to) ){
+    		long a = (ob_int_ucast(from))->value,
+    			 b = (ob_int_ucast(to))->value;
+
+    		return vm_exec_foreach_range( vm, frame, identifier, (a < b ? a : b), (a < b ? b : a), false, body );
+    	}
+    	else if( ob_is_char(from) && ob_is_char(to) ){
+    		long a = ob_char_ucast(from)->value,
+    			 b = ob_char_ucast(to)->value;
+
+    		return vm_exec_foreach_range( vm, frame, identifier, (a < b ? a : b), (a < b ? b : a), true, body );
+    	}
+
+    	v = ob_range( from, to );
+    }
+    else{
+    	v = vm_exec( vm, frame, collection );
+    }
 
     /*
      * Prevent the vector from being garbage collected, because may cause
@@ -2097,24 +2323,24 @@ INLINE Object *vm_exec_foreach( vm_t *vm, vframe_t *frame, Node *node ){
      */
     frame->push_tmp(v);
 
+    if( ob_is_class(v) && ob_get_method( v, "__next", 0 ) != H_UNDEFINED ){
+    	result = vm_exec_foreach_iterator( vm, frame, identifier, v, body );
+
+    	frame->remove_tmp(v);
+
+    	return result;
+    }
+
+    size = ob_get_size(v);
+
     for( ; index.value < size; ++index.value ){
         frame->add( identifier, ob_cl_at( v, (Object *)&index ) );
 
         result = vm_exec( vm, frame, body );
 
-        if( frame->state.is(Exception) ){
-        	result = frame->state.e_value;
+        if( vm_foreach_interrupted( frame, result ) ){
         	break;
-	    }
-		else if( frame->state.is(Return) ){
-			result = frame->state.r_value;
-			break;
-		}
-		else if( frame->state.is(Break) ){
-			frame->state.unset(Break);
-			break;
-		}
-		frame->state.unset(Next);
+        }
     }
 
     frame->remove_tmp(v);
@@ -2304,6 +2530,8 @@ INLINE Object *vm_exec_throw( vm_t *vm, vframe_t *frame, Node *node ){
 	 */
 	gc_set_alive(exception);
 
+	hyb_probe_exception_throw( hm_source_name(node->source), node->lineno );
+
 	frame->state.set( Exception, exception );
 
 	return exception;
@@ -17,17 +17,28 @@
  * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <hybris.h>
+#include <map>
+#include <string>
+
+using std::map;
+using std::string;
 
 HYBRIS_DEFINE_FUNCTION(hgc_collect);
 HYBRIS_DEFINE_FUNCTION(hgc_mm_items);
 HYBRIS_DEFINE_FUNCTION(hgc_mm_usage);
 HYBRIS_DEFINE_FUNCTION(hgc_collect_threshold);
+HYBRIS_DEFINE_FUNCTION(hgc_stats);
+HYBRIS_DEFINE_FUNCTION(hgc_census);
+HYBRIS_DEFINE_FUNCTION(hgc_dump);
 
 HYBRIS_EXPORTED_FUNCTIONS() {
 	{ "gc_collect",	 		  hgc_collect, 		  	 H_NO_ARGS },
     { "gc_mm_items", 		  hgc_mm_items, 		 H_NO_ARGS },
     { "gc_mm_usage", 		  hgc_mm_usage, 		 H_NO_ARGS },
     { "gc_collect_threshold", hgc_collect_threshold, H_NO_ARGS },
+    { "gc_stats",			  hgc_stats,			 H_NO_ARGS },
+    { "gc_census",			  hgc_census,			 H_NO_ARGS },
+    { "gc_dump",			  hgc_dump,				 H_REQ_ARGC(1), { H_REQ_TYPES(otString) } },
     { "", NULL }
 };
 
@@ -47,3 +58,148 @@ HYBRIS_DEFINE_FUNCTION(hgc_mm_usage){
 HYBRIS_DEFINE_FUNCTION(hgc_collect_threshold){
 	return ob_dcast( gc_new_integer(gc_collect_threshold()) );
 }
+
+#define gc_stats_set( map, name, value ) ob_cl_set( map, (Object *)gc_new_string(name), (Object *)(value) )
+#define NS_TO_MS(t) ( (t) / 1000000.0 )
+
+HYBRIS_DEFINE_FUNCTION(hgc_stats){
+	gc_stats_t stats;
+	Object    *map  	 = (Object *)gc_new_map(),
+			  *histogram = (Object *)gc_new_map();
+	double	   elapsed;
+	size_t	   i;
+	char	   label[0xFF];
+
+	gc_get_stats( &stats );
+
+	elapsed = (gc_now() - stats.started) / 1000000000.0;
+
+	gc_stats_set( map, "usage", 			 gc_new_integer( gc_mm_usage() ) );
+	gc_stats_set( map, "items", 			 gc_new_integer( gc_mm_items() ) );
+	gc_stats_set( map, "heap_collections",   gc_new_integer( stats.heap_collections ) );
+	gc_stats_set( map, "lag_collections", 	 gc_new_integer( stats.lag_collections ) );
+	gc_stats_set( map, "allocated_objects",  gc_new_integer( stats.allocated_objects ) );
+	gc_stats_set( map, "allocated_bytes", 	 gc_new_integer( stats.allocated_bytes ) );
+	gc_stats_set( map, "alloc_rate", 		 gc_new_float( elapsed > 0 ? stats.allocated_bytes / elapsed : 0.0 ) );
+	gc_stats_set( map, "freed_objects", 	 gc_new_integer( stats.freed_objects ) );
+	gc_stats_set( map, "freed_bytes", 		 gc_new_integer( stats.freed_bytes ) );
+	gc_stats_set( map, "promoted", 			 gc_new_integer( stats.promoted ) );
+	gc_stats_set( map, "last_freed_objects", gc_new_integer( stats.last_freed_objects ) );
+	gc_stats_set( map, "last_freed_bytes", 	 gc_new_integer( stats.last_freed_bytes ) );
+	gc_stats_set( map, "last_promoted", 	 gc_new_integer( stats.last_promoted ) );
+	gc_stats_set( map, "mark_time", 		 gc_new_float( NS_TO_MS(stats.mark_time) ) );
+	gc_stats_set( map, "sweep_time", 		 gc_new_float( NS_TO_MS(stats.sweep_time) ) );
+	gc_stats_set( map, "last_mark_time", 	 gc_new_float( NS_TO_MS(stats.last_mark_time) ) );
+	gc_stats_set( map, "last_sweep_time", 	 gc_new_float( NS_TO_MS(stats.last_sweep_time) ) );
+	gc_stats_set( map, "max_pause", 		 gc_new_float( NS_TO_MS(stats.max_pause) ) );
+	/*
+	 * Pause histogram, labels are the upper bound of each bucket.
+	 */
+	for( i = 0; i < GC_PAUSE_BUCKETS; ++i ){
+		if( i < GC_PAUSE_BUCKETS - 1 ){
+			sprintf( label, "<%luus", 2UL << i );
+		}
+		else{
+			sprintf( label, ">=%luus", 1UL << i );
+		}
+		gc_stats_set( histogram, label, gc_new_integer( stats.pauses[i] ) );
+	}
+	gc_stats_set( map, "pauses", histogram );
+
+	return map;
+}
+
+typedef struct {
+	size_t objects;
+	size_t bytes;
+}
+census_item_t;
+
+typedef map<string,census_item_t> census_t;
+
+static void census_visitor( Object *o, void *data ){
+	census_item_t *item = &(*(census_t *)data)[ ob_typename(o) ];
+
+	item->objects++;
+	item->bytes += o->gc_size;
+}
+
+HYBRIS_DEFINE_FUNCTION(hgc_census){
+	census_t 		   census;
+	census_t::iterator i;
+	Object  		  *map = (Object *)gc_new_map(),
+					  *item;
+	/*
+	 * The gc pool is locked while walking, so objects are aggregated
+	 * natively and the result map is built afterwards.
+	 */
+	gc_walk_objects( census_visitor, &census );
+
+	for( i = census.begin(); i != census.end(); ++i ){
+		item = (Object *)gc_new_map();
+
+		gc_stats_set( item, "objects", gc_new_integer( i->second.objects ) );
+		gc_stats_set( item, "bytes",   gc_new_integer( i->second.bytes ) );
+
+		gc_stats_set( map, i->first.c_str(), item );
+	}
+
+	return map;
+}
+
+typedef struct {
+	FILE  *fp;
+	size_t objects;
+}
+dump_t;
+
+static void dump_root_visitor( Object *o, void *data ){
+	fprintf( ((dump_t *)data)->fp, "R %p\n", o );
+}
+
+static void dump_object_visitor( Object *o, void *data ){
+	dump_t *dump = (dump_t *)data;
+	Object *child;
+	int		i;
+
+	fprintf( dump->fp, "O %p %lu %s\n", o, o->gc_size, ob_typename(o) );
+	for( i = 0; (child = ob_traverse( o, i )) != NULL; ++i ){
+		fprintf( dump->fp, "E %p %p\n", o, child );
+	}
+
+	dump->objects++;
+}
+
+/*
+ * Write a heap snapshot to the given file, one record per line :
+ *
+ * 	R <address>					 : Object directly referenced by a root set.
+ * 	O <address> <size> <type>	 : Tracked object.
+ * 	E <from> <to>				 : Reference from an object to another.
+ *
+ * Records are written while walking, so the dump does not need any
+ * memory proportional to the heap size. Use the heapanalyzer tool to
+ * compute dominators and retained sizes.
+ */
+HYBRIS_DEFINE_FUNCTION(hgc_dump){
+	char  *filename;
+	dump_t dump;
+
+	vm_parse_argv( "p", &filename );
+
+	if( (dump.fp = fopen( filename, "w+t" )) == NULL ){
+		return vm_raise_exception( "could not open '%s' for writing", filename );
+	}
+	dump.objects = 0;
+
+	fprintf( dump.fp, "# hybris heap snapshot 1\n" );
+
+	vm_mm_lock( vm );
+		gc_walk_roots( vm, dump_root_visitor, &dump );
+		gc_walk_objects( dump_object_visitor, &dump );
+	vm_mm_unlock( vm );
+
+	fclose( dump.fp );
+
+	return (Object *)gc_new_integer( dump.objects );
+}
@@ -17,7 +17,11 @@
  * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include <hybris.h>
 
 HYBRIS_DEFINE_FUNCTION(hfopen);
@@ -30,6 +34,16 @@ HYBRIS_DEFINE_FUNCTION(hfgets);
 HYBRIS_DEFINE_FUNCTION(hfclose);
 HYBRIS_DEFINE_FUNCTION(hfile);
 HYBRIS_DEFINE_FUNCTION(hreaddir);
+HYBRIS_DEFINE_FUNCTION(hread_into);
+HYBRIS_DEFINE_FUNCTION(hbreader_open);
+HYBRIS_DEFINE_FUNCTION(hbreader_readline);
+HYBRIS_DEFINE_FUNCTION(hbreader_read);
+HYBRIS_DEFINE_FUNCTION(hbreader_close);
+HYBRIS_DEFINE_FUNCTION(hbwriter_open);
+HYBRIS_DEFINE_FUNCTION(hbwriter_write);
+HYBRIS_DEFINE_FUNCTION(hbwriter_writev);
+HYBRIS_DEFINE_FUNCTION(hbwriter_flush);
+HYBRIS_DEFINE_FUNCTION(hbwriter_close);
 
 HYBRIS_EXPORTED_FUNCTIONS() {
 	{ "fopen",   hfopen,   H_REQ_ARGC(2),   { H_REQ_TYPES(otString), H_REQ_TYPES(otString) } },
@@ -42,6 +56,16 @@ HYBRIS_EXPORTED_FUNCTIONS() {
 	{ "fclose",  hfclose,  H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
 	{ "file",    hfile,    H_REQ_ARGC(1),   { H_REQ_TYPES(otString) } },
 	{ "readdir", hreaddir, H_REQ_ARGC(1,2), { H_REQ_TYPES(otString), H_REQ_TYPES(otBoolean) } },
+	{ "read_into", hread_into, H_REQ_ARGC(2,4), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString,otBinary), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
+	{ "breader_open",     hbreader_open,     H_REQ_ARGC(1,2), { H_REQ_TYPES(otString), H_REQ_TYPES(otInteger) } },
+	{ "breader_readline", hbreader_readline, H_REQ_ARGC(1,2), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString) } },
+	{ "breader_read",     hbreader_read,     H_REQ_ARGC(3),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString), H_REQ_TYPES(otInteger) } },
+	{ "breader_close",    hbreader_close,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "bwriter_open",     hbwriter_open,     H_REQ_ARGC(1,3), { H_REQ_TYPES(otString), H_REQ_TYPES(otBoolean), H_REQ_TYPES(otInteger) } },
+	{ "bwriter_write",    hbwriter_write,    H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_ANY_TYPE } },
+	{ "bwriter_writev",   hbwriter_writev,   H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otVector) } },
+	{ "bwriter_flush",    hbwriter_flush,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "bwriter_close",    hbwriter_close,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
 	{ "", NULL }
 };
 
@@ -305,3 +329,573 @@ HYBRIS_DEFINE_FUNCTION(hreaddir){
     return files;
 }
 
+
+/*
+ * Read up to 'max' bytes (the buffer size minus 'offset' if 0) from a file
+ * opened with fopen and store them at 'offset' in the given string or
+ * binary, which is resized to offset + read bytes.
+ * Return the number of bytes read, 0 at EOF.
+ */
+HYBRIS_DEFINE_FUNCTION(hread_into){
+	Handle *handle;
+	Object *buffer;
+	long	offset = 0,
+			max	   = 0;
+	size_t	rd;
+
+	vm_parse_argv( "HOll", &handle, &buffer, &offset, &max );
+
+	if( handle->value == NULL ){
+		return H_DEFAULT_ERROR;
+	}
+	else if( offset < 0 ){
+		return vm_raise_exception( "invalid negative offset %ld", offset );
+	}
+	else if( max <= 0 ){
+		max = ob_get_size(buffer) > (size_t)offset ? ob_get_size(buffer) - offset : BUFSIZ;
+	}
+
+	if( ob_is_string(buffer) ){
+		string& value = ob_string_val(buffer);
+
+		value.resize( offset + max );
+
+		rd = fread( &value[offset], 1, max, (FILE *)handle->value );
+
+		value.resize( offset + rd );
+
+		ob_string_ucast(buffer)->items = value.size();
+		ob_update_footprint(buffer);
+	}
+	else{
+		char *scratch = new char[max];
+
+		rd = fread( scratch, 1, max, (FILE *)handle->value );
+
+		binary_set_bytes( buffer, offset, scratch, rd );
+
+		delete[] scratch;
+	}
+
+	return (Object *)gc_new_integer(rd);
+}
+/*
+ * Buffered readers and writers work on raw descriptors with their own
+ * buffer, so reading a line or writing an object costs a memchr or a
+ * memcpy instead of a stdio call, and the syscalls are amortized over
+ * the whole buffer.
+ * Both are released (the writer flushed) when their handle is collected.
+ */
+#define BIO_DEFAULT_SIZE 65536
+#define BIO_MAX_IOV		 64
+
+typedef struct {
+	int    fd;
+	char  *buffer;
+	size_t size;
+	/*
+	 * Bytes in [start,end) are buffered but not consumed yet.
+	 */
+	size_t start;
+	size_t end;
+}
+breader_t;
+
+typedef struct {
+	int    fd;
+	char  *buffer;
+	size_t size;
+	size_t used;
+}
+bwriter_t;
+
+#define breader_ucast(o) ((breader_t *)ob_handle_val(o))
+#define bwriter_ucast(o) ((bwriter_t *)ob_handle_val(o))
+
+static void breader_finalize( void *value );
+static void bwriter_finalize( void *value );
+/*
+ * Readers and writers are recognized by the finalizer of their handle,
+ * any other handle (a FILE *, a socket, ...) is rejected.
+ */
+#define ob_is_breader(o) (((Handle *)(o))->finalizer == breader_finalize)
+#define ob_is_bwriter(o) (((Handle *)(o))->finalizer == bwriter_finalize)
+
+static void breader_release( breader_t *reader ){
+	if( reader->fd >= 0 ){
+		close( reader->fd );
+		free( reader->buffer );
+
+		reader->fd 	   = -1;
+		reader->buffer = NULL;
+		reader->start  =
+		reader->end    = 0;
+	}
+}
+
+static void breader_finalize( void *value ){
+	breader_release( (breader_t *)value );
+
+	delete (breader_t *)value;
+}
+/*
+ * Read more data into the buffer, compacting it first and growing it
+ * if it's full, return what read returned (-1 with ENOMEM if the buffer
+ * could not grow).
+ */
+static ssize_t breader_fill( breader_t *reader ){
+	ssize_t rd;
+	char   *buffer;
+
+	if( reader->start > 0 ){
+		memmove( reader->buffer, reader->buffer + reader->start, reader->end - reader->start );
+		reader->end  -= reader->start;
+		reader->start = 0;
+	}
+
+	if( reader->end == reader->size ){
+		if( (buffer = (char *)realloc( reader->buffer, reader->size * 2 )) == NULL ){
+			errno = ENOMEM;
+			return -1;
+		}
+		reader->buffer = buffer;
+		reader->size  *= 2;
+	}
+
+	while( (rd = read( reader->fd, reader->buffer + reader->end, reader->size - reader->end )) < 0 && errno == EINTR );
+
+	if( rd > 0 ){
+		reader->end += rd;
+	}
+
+	return rd;
+}
+/*
+ * Return the size of the next line, new line included, 0 at EOF or -1
+ * on a read error.
+ */
+static ssize_t breader_next_line( breader_t *reader ){
+	size_t 		scanned = 0;
+	ssize_t		rd;
+	const char *found;
+
+	for(;;){
+		found = (const char *)memchr( reader->buffer + reader->start + scanned, '\n', reader->end - reader->start - scanned );
+		if( found ){
+			return found - (reader->buffer + reader->start) + 1;
+		}
+
+		scanned = reader->end - reader->start;
+
+		if( (rd = breader_fill(reader)) <= 0 ){
+			return ( rd < 0 && reader->end == reader->start ? -1 : reader->end - reader->start );
+		}
+	}
+}
+
+/*
+ * Send the buffered data, on a write error the bytes that were not
+ * written are kept in the buffer and false is returned with errno set.
+ */
+static bool bwriter_flush( bwriter_t *writer ){
+	size_t  done = 0;
+	ssize_t wr;
+
+	while( done < writer->used ){
+		if( (wr = write( writer->fd, writer->buffer + done, writer->used - done )) < 0 ){
+			if( errno == EINTR ){
+				continue;
+			}
+			memmove( writer->buffer, writer->buffer + done, writer->used - done );
+			writer->used -= done;
+			return false;
+		}
+		done += wr;
+	}
+
+	writer->used = 0;
+
+	return true;
+}
+/*
+ * Flush and close the writer, return false if the pending data could
+ * not be written.
+ */
+static bool bwriter_release( bwriter_t *writer ){
+	bool flushed = true;
+	int  error   = 0;
+
+	if( writer->fd >= 0 ){
+		if( !(flushed = bwriter_flush( writer )) ){
+			error = errno;
+		}
+
+		close( writer->fd );
+		free( writer->buffer );
+
+		writer->fd 	   = -1;
+		writer->buffer = NULL;
+		writer->used   = 0;
+	}
+
+	if( !flushed ){
+		errno = error;
+	}
+
+	return flushed;
+}
+
+static void bwriter_finalize( void *value ){
+	bwriter_release( (bwriter_t *)value );
+
+	delete (bwriter_t *)value;
+}
+/*
+ * Write a whole iovec array handling partial writes.
+ */
+static bool bwriter_writev_all( int fd, struct iovec *iov, int iovcnt ){
+	ssize_t wr;
+
+	while( iovcnt > 0 ){
+		if( (wr = writev( fd, iov, iovcnt )) < 0 ){
+			if( errno == EINTR ){
+				continue;
+			}
+			return false;
+		}
+		while( iovcnt > 0 && (size_t)wr >= iov->iov_len ){
+			wr -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if( iovcnt > 0 ){
+			iov->iov_base = (char *)iov->iov_base + wr;
+			iov->iov_len -= wr;
+		}
+	}
+	return true;
+}
+/*
+ * Raw bytes of an object, strings and binaries are written as they
+ * are, anything else by its string representation (kept in 'tmp').
+ */
+static INLINE void bwriter_bytes( Object *o, string& tmp, const char *&data, size_t& size ){
+	if( ob_is_string(o) ){
+		data = ob_string_val(o).data();
+		size = ob_string_val(o).size();
+	}
+	else{
+		if( ob_is_binary(o) ){
+			Binary *b = ob_binary_ucast(o);
+
+			tmp.resize( b->value.size() );
+			for( size_t i = 0; i < b->value.size(); ++i ){
+				tmp[i] = ob_char_ucast( b->value[i] )->value;
+			}
+		}
+		else{
+			tmp = ob_svalue(o);
+		}
+		data = tmp.data();
+		size = tmp.size();
+	}
+}
+
+HYBRIS_DEFINE_FUNCTION(hbreader_open){
+	char *filename;
+	long  size = BIO_DEFAULT_SIZE;
+	int	  fd;
+
+	vm_parse_argv( "pl", &filename, &size );
+
+	if( (fd = open( filename, O_RDONLY )) < 0 ){
+		return vm_raise_exception( "could not open '%s' for reading : %s", filename, strerror(errno) );
+	}
+
+	breader_t *reader = new breader_t;
+
+	reader->fd 	   = fd;
+	reader->size   = ( size > 0 ? size : BIO_DEFAULT_SIZE );
+	reader->buffer = (char *)malloc( reader->size );
+	reader->start  =
+	reader->end    = 0;
+
+	posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+	Handle *handle = gc_new_handle(reader);
+
+	handle_set_finalizer( handle, breader_finalize );
+
+	return (Object *)handle;
+}
+/*
+ * Return the next line, or false at EOF. If a string is given, the line
+ * is stored into it and true is returned, so a loop can reuse the same
+ * object instead of allocating a new one per line.
+ */
+HYBRIS_DEFINE_FUNCTION(hbreader_readline){
+	Handle *handle;
+	Object *line = NULL;
+
+	vm_parse_argv( "HO", &handle, &line );
+
+	if( !ob_is_breader(handle) ){
+		return vm_raise_exception( "handle is not a buffered reader" );
+	}
+
+	breader_t *reader = breader_ucast(handle);
+	ssize_t	   size;
+
+	if( reader->fd < 0 || (size = breader_next_line(reader)) == 0 ){
+		return (Object *)gc_new_boolean(false);
+	}
+	else if( size < 0 ){
+		return vm_raise_exception( "read failed : %s", strerror(errno) );
+	}
+
+	if( line == NULL ){
+		line = (Object *)gc_new_string("");
+	}
+
+	ob_string_val(line).assign( reader->buffer + reader->start, size );
+	ob_string_ucast(line)->items = size;
+	ob_update_footprint(line);
+
+	reader->start += size;
+
+	return ( vm_argc() > 1 ? (Object *)gc_new_boolean(true) : line );
+}
+/*
+ * Read up to 'size' bytes into 'chunk' (reusing its buffer) and return
+ * how many bytes were read, 0 at EOF.
+ */
+HYBRIS_DEFINE_FUNCTION(hbreader_read){
+	Handle *handle;
+	Object *chunk;
+	long	size;
+
+	vm_parse_argv( "HOl", &handle, &chunk, &size );
+
+	if( !ob_is_breader(handle) ){
+		return vm_raise_exception( "handle is not a buffered reader" );
+	}
+
+	breader_t *reader = breader_ucast(handle);
+	string&	   value  = ob_string_val(chunk);
+	size_t	   pending;
+	ssize_t	   rd = 0;
+
+	value.clear();
+
+	if( reader->fd >= 0 && size > 0 ){
+		pending = reader->end - reader->start;
+		/*
+		 * Serve buffered bytes first, then read what's missing straight
+		 * into the chunk to avoid a double copy of big reads.
+		 */
+		if( pending ){
+			pending = ( pending < (size_t)size ? pending : size );
+
+			value.assign( reader->buffer + reader->start, pending );
+			reader->start += pending;
+		}
+		else if( (size_t)size >= reader->size ){
+			value.resize( size );
+
+			while( (rd = read( reader->fd, &value[0], size )) < 0 && errno == EINTR );
+
+			value.resize( rd > 0 ? rd : 0 );
+		}
+		else if( (rd = breader_fill(reader)) > 0 ){
+			pending = reader->end - reader->start;
+			pending = ( pending < (size_t)size ? pending : size );
+
+			value.assign( reader->buffer + reader->start, pending );
+			reader->start += pending;
+		}
+
+		if( rd < 0 ){
+			ob_string_ucast(chunk)->items = 0;
+			ob_update_footprint(chunk);
+
+			return vm_raise_exception( "read failed : %s", strerror(errno) );
+		}
+	}
+
+	ob_string_ucast(chunk)->items = value.size();
+	ob_update_footprint(chunk);
+
+	return (Object *)gc_new_integer( value.size() );
+}
+
+HYBRIS_DEFINE_FUNCTION(hbreader_close){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	if( !ob_is_breader(handle) ){
+		return vm_raise_exception( "handle is not a buffered reader" );
+	}
+
+	breader_release( breader_ucast(handle) );
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hbwriter_open){
+	char *filename;
+	bool  append = false;
+	long  size   = BIO_DEFAULT_SIZE;
+	int	  fd;
+
+	vm_parse_argv( "pbl", &filename, &append, &size );
+
+	if( (fd = open( filename, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644 )) < 0 ){
+		return vm_raise_exception( "could not open '%s' for writing : %s", filename, strerror(errno) );
+	}
+
+	bwriter_t *writer = new bwriter_t;
+
+	writer->fd 	   = fd;
+	writer->size   = ( size > 0 ? size : BIO_DEFAULT_SIZE );
+	writer->buffer = (char *)malloc( writer->size );
+	writer->used   = 0;
+
+	Handle *handle = gc_new_handle(writer);
+
+	handle_set_finalizer( handle, bwriter_finalize );
+
+	return (Object *)handle;
+}
+
+HYBRIS_DEFINE_FUNCTION(hbwriter_write){
+	Handle *handle;
+	Object *o;
+
+	vm_parse_argv( "HO", &handle, &o );
+
+	if( !ob_is_bwriter(handle) ){
+		return vm_raise_exception( "handle is not a buffered writer" );
+	}
+
+	bwriter_t  *writer = bwriter_ucast(handle);
+	string		tmp;
+	const char *bytes;
+	size_t		size;
+
+	if( writer->fd < 0 ){
+		return vm_raise_exception( "write on a closed buffered writer" );
+	}
+
+	bwriter_bytes( o, tmp, bytes, size );
+
+	if( writer->used + size <= writer->size ){
+		memcpy( writer->buffer + writer->used, bytes, size );
+		writer->used += size;
+	}
+	/*
+	 * Does not fit, send the buffer and the object with a single
+	 * writev instead of copying it.
+	 */
+	else{
+		struct iovec iov[2] = { { writer->buffer, writer->used }, { (void *)bytes, size } };
+
+		if( !bwriter_writev_all( writer->fd, iov, 2 ) ){
+			return vm_raise_exception( "write failed : %s", strerror(errno) );
+		}
+		writer->used = 0;
+	}
+
+	return (Object *)gc_new_integer(size);
+}
+/*
+ * Write every item of a vector, items are batched in the buffer and
+ * big ones are sent together with it by writev.
+ */
+HYBRIS_DEFINE_FUNCTION(hbwriter_writev){
+	Handle *handle;
+	Vector *items;
+
+	vm_parse_argv( "HV", &handle, &items );
+
+	if( !ob_is_bwriter(handle) ){
+		return vm_raise_exception( "handle is not a buffered writer" );
+	}
+
+	bwriter_t   *writer = bwriter_ucast(handle);
+	string		 tmp[BIO_MAX_IOV];
+	struct iovec iov[BIO_MAX_IOV + 1];
+	int			 iovcnt = 0;
+	size_t		 i, n = items->value.size(), total = 0;
+	const char  *bytes;
+	size_t		 size;
+
+	if( writer->fd < 0 ){
+		return vm_raise_exception( "write on a closed buffered writer" );
+	}
+
+	for( i = 0; i < n; ++i ){
+		bwriter_bytes( items->value[i], tmp[iovcnt], bytes, size );
+		total += size;
+
+		if( iovcnt == 0 && writer->used + size <= writer->size ){
+			memcpy( writer->buffer + writer->used, bytes, size );
+			writer->used += size;
+			continue;
+		}
+		/*
+		 * The first entry of the batch is always the buffer.
+		 */
+		if( iovcnt == 0 ){
+			iov[0].iov_base = writer->buffer;
+			iov[0].iov_len  = writer->used;
+		}
+
+		iov[++iovcnt].iov_base = (void *)bytes;
+		iov[iovcnt].iov_len	   = size;
+
+		if( iovcnt == BIO_MAX_IOV || i == n - 1 ){
+			if( !bwriter_writev_all( writer->fd, iov, iovcnt + 1 ) ){
+				return vm_raise_exception( "write failed : %s", strerror(errno) );
+			}
+			writer->used = 0;
+			iovcnt		 = 0;
+		}
+	}
+
+	return (Object *)gc_new_integer(total);
+}
+
+HYBRIS_DEFINE_FUNCTION(hbwriter_flush){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	if( !ob_is_bwriter(handle) ){
+		return vm_raise_exception( "handle is not a buffered writer" );
+	}
+
+	bwriter_t *writer = bwriter_ucast(handle);
+
+	if( writer->fd >= 0 && !bwriter_flush( writer ) ){
+		return vm_raise_exception( "flush failed : %s", strerror(errno) );
+	}
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hbwriter_close){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	if( !ob_is_bwriter(handle) ){
+		return vm_raise_exception( "handle is not a buffered writer" );
+	}
+
+	if( !bwriter_release( bwriter_ucast(handle) ) ){
+		return vm_raise_exception( "flush failed : %s", strerror(errno) );
+	}
+
+	return H_DEFAULT_RETURN;
+}
@@ -0,0 +1,288 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <hybris.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pcre.h>
+
+HYBRIS_DEFINE_FUNCTION(hmmap_file);
+HYBRIS_DEFINE_FUNCTION(hmmap_size);
+HYBRIS_DEFINE_FUNCTION(hmmap_slice);
+HYBRIS_DEFINE_FUNCTION(hmmap_find);
+HYBRIS_DEFINE_FUNCTION(hmmap_match);
+HYBRIS_DEFINE_FUNCTION(hmmap_advise);
+HYBRIS_DEFINE_FUNCTION(hmmap_close);
+
+HYBRIS_EXPORTED_FUNCTIONS() {
+	{ "mmap_file",   hmmap_file,   H_REQ_ARGC(1,2), { H_REQ_TYPES(otString), H_REQ_TYPES(otInteger) } },
+	{ "mmap_size",   hmmap_size,   H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "mmap_slice",  hmmap_slice,  H_REQ_ARGC(3),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
+	{ "mmap_find",   hmmap_find,   H_REQ_ARGC(2,3), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString,otChar), H_REQ_TYPES(otInteger) } },
+	{ "mmap_match",  hmmap_match,  H_REQ_ARGC(2,3), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString), H_REQ_TYPES(otInteger) } },
+	{ "mmap_advise", hmmap_advise, H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "mmap_close",  hmmap_close,  H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "", NULL }
+};
+
+/*
+ * Read only views of whole files mapped in memory.
+ *
+ * The functions of this module work straight on the mapped pages, so
+ * scanning a file (mmap_find, mmap_match) does not copy it anywhere and
+ * only the slices explicitly requested with mmap_slice become strings.
+ * The mapping is released when the last handle referencing it is
+ * collected, or before with mmap_close.
+ */
+typedef struct {
+	char   *data;
+	size_t  size;
+}
+mmap_view_t;
+
+#define mmap_ucast(o) ((mmap_view_t *)ob_handle_val(o))
+
+extern "C" void hybris_module_init( vm_t * vm ){
+	HYBRIS_DEFINE_CONSTANT( vm, "MADV_NORMAL",     gc_new_integer(MADV_NORMAL) );
+	HYBRIS_DEFINE_CONSTANT( vm, "MADV_SEQUENTIAL", gc_new_integer(MADV_SEQUENTIAL) );
+	HYBRIS_DEFINE_CONSTANT( vm, "MADV_RANDOM",     gc_new_integer(MADV_RANDOM) );
+	HYBRIS_DEFINE_CONSTANT( vm, "MADV_WILLNEED",   gc_new_integer(MADV_WILLNEED) );
+	HYBRIS_DEFINE_CONSTANT( vm, "MADV_DONTNEED",   gc_new_integer(MADV_DONTNEED) );
+}
+
+static void mmap_unmap( mmap_view_t *view ){
+	if( view->data ){
+		munmap( view->data, view->size );
+		view->data = NULL;
+		view->size = 0;
+	}
+}
+
+static void mmap_finalize( void *value ){
+	mmap_view_t *view = (mmap_view_t *)value;
+
+	mmap_unmap( view );
+
+	delete view;
+}
+/*
+ * Check that [offset,offset+size) is inside the view, clamping 'size'
+ * to the end of the mapping.
+ */
+static INLINE bool mmap_range( mmap_view_t *view, long offset, long& size ){
+	if( offset < 0 || (size_t)offset > view->size || size < 0 ){
+		return false;
+	}
+	if( (size_t)(offset + size) > view->size ){
+		size = view->size - offset;
+	}
+	return true;
+}
+
+HYBRIS_DEFINE_FUNCTION(hmmap_file){
+	char 	   *filename;
+	int			advice = MADV_SEQUENTIAL,
+				fd;
+	struct stat st;
+
+	vm_parse_argv( "pi", &filename, &advice );
+
+	if( (fd = open( filename, O_RDONLY )) < 0 ){
+		return vm_raise_exception( "could not open '%s' for reading : %s", filename, strerror(errno) );
+	}
+
+	if( fstat( fd, &st ) != 0 ){
+		close(fd);
+		return vm_raise_exception( "could not stat '%s' : %s", filename, strerror(errno) );
+	}
+
+	mmap_view_t *view = new mmap_view_t;
+
+	view->data = NULL;
+	view->size = st.st_size;
+	/*
+	 * Zero sized mappings are not allowed, an empty file is
+	 * just an empty view.
+	 */
+	if( view->size ){
+		view->data = (char *)mmap( NULL, view->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( view->data == MAP_FAILED ){
+			close(fd);
+			delete view;
+			return vm_raise_exception( "could not map '%s' : %s", filename, strerror(errno) );
+		}
+
+		madvise( view->data, view->size, advice );
+	}
+	/*
+	 * The mapping keeps its own reference to the file.
+	 */
+	close(fd);
+
+	Handle *handle = gc_new_handle(view);
+
+	handle_set_finalizer( handle, mmap_finalize );
+
+	return (Object *)handle;
+}
+
+HYBRIS_DEFINE_FUNCTION(hmmap_size){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	return (Object *)gc_new_integer( mmap_ucast(handle)->size );
+}
+/*
+ * Copy 'size' bytes starting at 'offset' into a new string.
+ */
+HYBRIS_DEFINE_FUNCTION(hmmap_slice){
+	Handle *handle;
+	long	offset,
+			size;
+
+	vm_parse_argv( "Hll", &handle, &offset, &size );
+
+	mmap_view_t *view = mmap_ucast(handle);
+
+	if( mmap_range( view, offset, size ) == false ){
+		return vm_raise_exception( "slice [%ld,%ld) out of the mapping bounds", offset, offset + size );
+	}
+
+	String *slice = gc_new_string("");
+
+	slice->value.assign( view->data + offset, size );
+	slice->items = size;
+
+	ob_update_footprint( (Object *)slice );
+
+	return (Object *)slice;
+}
+/*
+ * Return the offset of the first occurrence of 'needle' from 'offset'
+ * on, or -1.
+ */
+HYBRIS_DEFINE_FUNCTION(hmmap_find){
+	Handle *handle;
+	Object *needle;
+	long	offset = 0,
+			size;
+
+	vm_parse_argv( "HOl", &handle, &needle, &offset );
+
+	mmap_view_t *view = mmap_ucast(handle);
+	const char  *found;
+
+	size = view->size;
+	if( view->data == NULL || mmap_range( view, offset, size ) == false ){
+		return (Object *)gc_new_integer(-1);
+	}
+
+	if( ob_is_char(needle) ){
+		found = (const char *)memchr( view->data + offset, ob_char_ucast(needle)->value, size );
+	}
+	else{
+		string& s = ob_string_val(needle);
+
+		found = (const char *)memmem( view->data + offset, size, s.data(), s.size() );
+	}
+
+	return (Object *)gc_new_integer( found ? found - view->data : -1 );
+}
+/*
+ * Match a "/regex/flags" pattern from 'offset' on, return the vector
+ * [ start, end ] of the first match or false.
+ * PCRE subjects are limited to INT_MAX bytes, so on bigger mappings
+ * the scan has to be resumed from the returned or a later offset.
+ */
+HYBRIS_DEFINE_FUNCTION(hmmap_match){
+	Handle *handle;
+	string  rawreg,
+			pattern;
+	long	offset = 0,
+			size;
+	int		opts,
+			eoffset,
+			rc,
+			ovector[3];
+	const char *error;
+	pcre	   *compiled;
+
+	vm_parse_argv( "Hsl", &handle, &rawreg, &offset );
+
+	mmap_view_t *view = mmap_ucast(handle);
+
+	size = view->size;
+	if( view->data == NULL || mmap_range( view, offset, size ) == false ){
+		return (Object *)gc_new_boolean(false);
+	}
+	if( size > INT_MAX ){
+		size = INT_MAX;
+	}
+
+	string_parse_pcre( rawreg, pattern, opts );
+
+	compiled = vm_pcre_compile( vm, pattern, opts, &error, &eoffset );
+	if( !compiled ){
+		return vm_raise_exception( "error during regex evaluation at offset %d (%s)", eoffset, error );
+	}
+
+	rc = pcre_exec( compiled, 0, view->data + offset, size, 0, 0, ovector, 3 );
+	if( rc < 0 ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	Object *match = (Object *)gc_new_vector();
+
+	ob_cl_push_reference( match, (Object *)gc_new_integer( offset + ovector[0] ) );
+	ob_cl_push_reference( match, (Object *)gc_new_integer( offset + ovector[1] ) );
+
+	return match;
+}
+
+HYBRIS_DEFINE_FUNCTION(hmmap_advise){
+	Handle *handle;
+	int		advice;
+
+	vm_parse_argv( "Hi", &handle, &advice );
+
+	mmap_view_t *view = mmap_ucast(handle);
+
+	if( view->data == NULL ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	return (Object *)gc_new_boolean( madvise( view->data, view->size, advice ) == 0 );
+}
+/*
+ * Unmap the file now instead of waiting for the gc, every clone of the
+ * handle will see an empty view.
+ */
+HYBRIS_DEFINE_FUNCTION(hmmap_close){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	mmap_unmap( mmap_ucast(handle) );
+
+	return H_DEFAULT_RETURN;
+}
@@ -0,0 +1,536 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <hybris.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <queue>
+#include <map>
+
+HYBRIS_DEFINE_FUNCTION(hev_loop);
+HYBRIS_DEFINE_FUNCTION(hev_watch);
+HYBRIS_DEFINE_FUNCTION(hev_unwatch);
+HYBRIS_DEFINE_FUNCTION(hev_timer);
+HYBRIS_DEFINE_FUNCTION(hev_cancel);
+HYBRIS_DEFINE_FUNCTION(hev_run);
+HYBRIS_DEFINE_FUNCTION(hev_stop);
+HYBRIS_DEFINE_FUNCTION(hev_close);
+
+HYBRIS_EXPORTED_FUNCTIONS() {
+	{ "ev_loop",    hev_loop,    H_NO_ARGS },
+	{ "ev_watch",   hev_watch,   H_REQ_ARGC(4,5), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger), H_REQ_TYPES(otString), H_ANY_TYPE } },
+	{ "ev_unwatch", hev_unwatch, H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "ev_timer",   hev_timer,   H_REQ_ARGC(4,5), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger), H_REQ_TYPES(otString), H_ANY_TYPE } },
+	{ "ev_cancel",  hev_cancel,  H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "ev_run",     hev_run,     H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "ev_stop",    hev_stop,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "ev_close",   hev_close,   H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "", NULL }
+};
+
+/*
+ * Single threaded event loop built on epoll.
+ *
+ * Watchers are stored in a vector indexed by file descriptor and timers
+ * in a binary heap ordered by deadline, so tens of thousands of idle
+ * connections cost one epoll registration and one slot each, and every
+ * iteration only touches the descriptors that are ready.
+ *
+ * Callbacks are user functions called as :
+ *
+ * 	callback( fd, events, data ) : for descriptors watchers.
+ * 	callback( id, data )		 : for timers.
+ *
+ * Watchers are level triggered unless EV_EDGE is given, and the 'data'
+ * objects are kept alive by a gc root walker until they're removed.
+ */
+#define EV_MAX_EVENTS 1024
+
+typedef struct {
+	bool	active;
+	int		events;
+	string	function;
+	Object *data;
+}
+ev_watcher_t;
+
+typedef struct {
+	long    id;
+	ulong   deadline;
+	ulong   interval;
+	bool	cancelled;
+	string  function;
+	Object *data;
+}
+ev_timer_t;
+
+struct ev_timer_cmp {
+	bool operator()( const ev_timer_t *a, const ev_timer_t *b ) const {
+		return a->deadline > b->deadline;
+	}
+};
+
+typedef std::priority_queue< ev_timer_t *, vector<ev_timer_t *>, ev_timer_cmp > ev_timers_heap_t;
+typedef std::map< long, ev_timer_t * > 										 ev_timers_map_t;
+
+typedef struct {
+	int 				 epfd;
+	bool 				 running;
+	/*
+	 * Watchers indexed by file descriptor.
+	 */
+	vector<ev_watcher_t> watchers;
+	size_t 				 n_watchers;
+	/*
+	 * Pending timers, cancelled ones are removed from the map
+	 * immediately and from the heap when they expire.
+	 */
+	ev_timers_heap_t 	 timers;
+	ev_timers_map_t		 timers_by_id;
+	long				 next_timer_id;
+	/*
+	 * Protects the watchers and timers against the gc walker.
+	 */
+	pthread_mutex_t 	 mutex;
+}
+ev_loop_t;
+
+#define ev_loop_ucast(o) ((ev_loop_t *)ob_handle_val(o))
+
+extern "C" void hybris_module_init( vm_t * vm ){
+	HYBRIS_DEFINE_CONSTANT( vm, "EV_READ",  gc_new_integer(EPOLLIN) );
+	HYBRIS_DEFINE_CONSTANT( vm, "EV_WRITE", gc_new_integer(EPOLLOUT) );
+	HYBRIS_DEFINE_CONSTANT( vm, "EV_HUP",   gc_new_integer(EPOLLHUP | EPOLLRDHUP) );
+	HYBRIS_DEFINE_CONSTANT( vm, "EV_ERROR", gc_new_integer(EPOLLERR) );
+	HYBRIS_DEFINE_CONSTANT( vm, "EV_EDGE",  gc_new_integer(EPOLLET) );
+}
+
+static INLINE ulong ev_now(){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+/*
+ * Visit watchers and timers data.
+ */
+void ev_walker( void *data, gc_visitor_t visitor, void *vdata ){
+	ev_loop_t *loop = (ev_loop_t *)data;
+	size_t	   i;
+
+	pthread_mutex_lock( &loop->mutex );
+
+	for( i = 0; i < loop->watchers.size(); ++i ){
+		if( loop->watchers[i].active && loop->watchers[i].data ){
+			visitor( loop->watchers[i].data, vdata );
+		}
+	}
+	for( ev_timers_map_t::iterator ti = loop->timers_by_id.begin(); ti != loop->timers_by_id.end(); ++ti ){
+		if( ti->second->data ){
+			visitor( ti->second->data, vdata );
+		}
+	}
+
+	pthread_mutex_unlock( &loop->mutex );
+}
+
+static Node *ev_get_function( vm_t *vm, string& function ){
+	Node *node = vm->vcode.get( (char *)function.c_str() );
+
+	if( node == H_UNDEFINED ){
+		hyb_error( H_ET_SYNTAX, "'%s' undeclared user function identifier", function.c_str() );
+	}
+
+	return node;
+}
+/*
+ * Call a user function with the given arguments, return false if it
+ * raised an exception (it's already set on 'frame').
+ */
+static bool ev_call( vm_t *vm, vmem_t *frame, string& function, vmem_t *argv ){
+	vm_exec_threaded_call( vm, ev_get_function( vm, function ), frame, argv );
+
+	return !frame->state.is(Exception);
+}
+/*
+ * Milliseconds until the next timer expires, or -1 if there are no timers.
+ */
+static int ev_next_timeout( ev_loop_t *loop ){
+	ulong now;
+
+	while( !loop->timers.empty() && loop->timers.top()->cancelled ){
+		delete loop->timers.top();
+		loop->timers.pop();
+	}
+
+	if( loop->timers.empty() ){
+		return -1;
+	}
+
+	now = ev_now();
+
+	return ( loop->timers.top()->deadline > now ? loop->timers.top()->deadline - now : 0 );
+}
+
+static bool ev_run_timers( vm_t *vm, vmem_t *frame, ev_loop_t *loop ){
+	ulong 		now = ev_now();
+	ev_timer_t *timer;
+
+	while( !loop->timers.empty() && loop->timers.top()->deadline <= now ){
+		pthread_mutex_lock( &loop->mutex );
+
+		timer = loop->timers.top();
+		loop->timers.pop();
+
+		if( timer->cancelled ){
+			pthread_mutex_unlock( &loop->mutex );
+			delete timer;
+			continue;
+		}
+		/*
+		 * One shot timers are removed before being called, periodic
+		 * ones are scheduled again.
+		 */
+		if( timer->interval ){
+			timer->deadline = now + timer->interval;
+			loop->timers.push( timer );
+		}
+		else{
+			loop->timers_by_id.erase( timer->id );
+		}
+
+		pthread_mutex_unlock( &loop->mutex );
+
+		vmem_t argv;
+
+		argv.push( (Object *)gc_new_integer( timer->id ) );
+		argv.push( timer->data ? timer->data : H_DEFAULT_RETURN );
+
+		bool ok = ev_call( vm, frame, timer->function, &argv );
+
+		if( timer->interval == 0 ){
+			delete timer;
+		}
+
+		if( !ok ){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Handle finalizer, the heap owns every timer, cancelled ones too.
+ */
+static void ev_finalize( void *value ){
+	ev_loop_t *loop = (ev_loop_t *)value;
+
+	gc_remove_root_walker( ev_walker, loop );
+
+	if( loop->epfd >= 0 ){
+		close( loop->epfd );
+	}
+
+	while( loop->timers.empty() == false ){
+		delete loop->timers.top();
+		loop->timers.pop();
+	}
+
+	pthread_mutex_destroy( &loop->mutex );
+
+	delete loop;
+}
+
+HYBRIS_DEFINE_FUNCTION(hev_loop){
+	int epfd = epoll_create1( EPOLL_CLOEXEC );
+
+	if( epfd < 0 ){
+		return vm_raise_exception( "epoll_create1 failed : %s", strerror(errno) );
+	}
+
+	ev_loop_t *loop = new ev_loop_t;
+
+	loop->epfd 			= epfd;
+	loop->running 		= false;
+	loop->n_watchers 	= 0;
+	loop->next_timer_id = 1;
+
+	pthread_mutex_init( &loop->mutex, NULL );
+
+	gc_add_root_walker( ev_walker, loop );
+
+	Handle *handle = gc_new_handle(loop);
+
+	handle_set_finalizer( handle, ev_finalize );
+
+	return (Object *)handle;
+}
+
+HYBRIS_DEFINE_FUNCTION(hev_watch){
+	Handle *handle;
+	int		fd,
+			events;
+	string  function;
+	Object *cbdata = H_UNDEFINED;
+
+	vm_parse_argv( "HiisO", &handle, &fd, &events, &function, &cbdata );
+
+	ev_loop_t 		  *loop = ev_loop_ucast(handle);
+	struct epoll_event ev;
+	int				   op;
+
+	if( fd < 0 ){
+		return vm_raise_exception( "invalid file descriptor %d", fd );
+	}
+	/*
+	 * Fail now instead of when the first event is dispatched.
+	 */
+	ev_get_function( vm, function );
+
+	pthread_mutex_lock( &loop->mutex );
+
+	if( (size_t)fd >= loop->watchers.size() ){
+		ev_watcher_t empty = { false, 0, "", NULL };
+
+		loop->watchers.resize( fd + 1, empty );
+	}
+
+	op = ( loop->watchers[fd].active ? EPOLL_CTL_MOD : EPOLL_CTL_ADD );
+
+	memset( &ev, 0x00, sizeof(ev) );
+	ev.events  = events;
+	ev.data.fd = fd;
+
+	if( epoll_ctl( loop->epfd, op, fd, &ev ) != 0 ){
+		pthread_mutex_unlock( &loop->mutex );
+		return vm_raise_exception( "epoll_ctl failed on descriptor %d : %s", fd, strerror(errno) );
+	}
+
+	if( op == EPOLL_CTL_ADD ){
+		loop->n_watchers++;
+	}
+
+	loop->watchers[fd].active   = true;
+	loop->watchers[fd].events   = events;
+	loop->watchers[fd].function = function;
+	loop->watchers[fd].data     = cbdata;
+
+	pthread_mutex_unlock( &loop->mutex );
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hev_unwatch){
+	Handle *handle;
+	int		fd;
+
+	vm_parse_argv( "Hi", &handle, &fd );
+
+	ev_loop_t *loop = ev_loop_ucast(handle);
+	bool	   found = false;
+
+	pthread_mutex_lock( &loop->mutex );
+
+	if( fd >= 0 && (size_t)fd < loop->watchers.size() && loop->watchers[fd].active ){
+		/*
+		 * The descriptor could have been already closed, which removes
+		 * it from the epoll set, so errors are ignored.
+		 */
+		epoll_ctl( loop->epfd, EPOLL_CTL_DEL, fd, NULL );
+
+		loop->watchers[fd].active = false;
+		loop->watchers[fd].data   = NULL;
+		loop->watchers[fd].function.clear();
+		loop->n_watchers--;
+
+		found = true;
+	}
+
+	pthread_mutex_unlock( &loop->mutex );
+
+	return (Object *)gc_new_boolean(found);
+}
+
+HYBRIS_DEFINE_FUNCTION(hev_timer){
+	Handle *handle;
+	long	timeout,
+			interval;
+	string  function;
+	Object *cbdata = H_UNDEFINED;
+
+	vm_parse_argv( "HllsO", &handle, &timeout, &interval, &function, &cbdata );
+
+	ev_loop_t  *loop  = ev_loop_ucast(handle);
+	ev_timer_t *timer;
+
+	ev_get_function( vm, function );
+
+	timer = new ev_timer_t;
+
+	timer->deadline  = ev_now() + ( timeout > 0 ? timeout : 0 );
+	timer->interval  = ( interval > 0 ? interval : 0 );
+	timer->cancelled = false;
+	timer->function  = function;
+	timer->data		 = cbdata;
+
+	pthread_mutex_lock( &loop->mutex );
+
+	timer->id = loop->next_timer_id++;
+
+	loop->timers.push( timer );
+	loop->timers_by_id[ timer->id ] = timer;
+
+	pthread_mutex_unlock( &loop->mutex );
+
+	return (Object *)gc_new_integer( timer->id );
+}
+
+HYBRIS_DEFINE_FUNCTION(hev_cancel){
+	Handle *handle;
+	long	id;
+
+	vm_parse_argv( "Hl", &handle, &id );
+
+	ev_loop_t 				 *loop = ev_loop_ucast(handle);
+	ev_timers_map_t::iterator ti;
+	bool					  found = false;
+
+	pthread_mutex_lock( &loop->mutex );
+
+	if( (ti = loop->timers_by_id.find(id)) != loop->timers_by_id.end() ){
+		/*
+		 * The heap owns the structure, it will be deleted
+		 * when it reaches the top.
+		 */
+		ti->second->cancelled = true;
+		ti->second->data 	  = NULL;
+		loop->timers_by_id.erase(ti);
+
+		found = true;
+	}
+
+	pthread_mutex_unlock( &loop->mutex );
+
+	return (Object *)gc_new_boolean(found);
+}
+
+HYBRIS_DEFINE_FUNCTION(hev_run){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	ev_loop_t 		  *loop = ev_loop_ucast(handle);
+	struct epoll_event events[EV_MAX_EVENTS];
+	int 			   n, i, fd;
+	bool			   ok = true;
+
+	loop->running = true;
+
+	while( ok && loop->running && (loop->n_watchers || !loop->timers_by_id.empty()) ){
+		n = epoll_wait( loop->epfd, events, EV_MAX_EVENTS, ev_next_timeout(loop) );
+		if( n < 0 ){
+			if( errno == EINTR ){
+				continue;
+			}
+			loop->running = false;
+			return vm_raise_exception( "epoll_wait failed : %s", strerror(errno) );
+		}
+
+		for( i = 0; i < n && ok; ++i ){
+			fd = events[i].data.fd;
+			/*
+			 * A previous callback of this batch could have removed the watcher
+			 * or changed it, so take a copy of what's needed to call it.
+			 */
+			pthread_mutex_lock( &loop->mutex );
+
+			if( (size_t)fd >= loop->watchers.size() || loop->watchers[fd].active == false ){
+				pthread_mutex_unlock( &loop->mutex );
+				continue;
+			}
+
+			string  function = loop->watchers[fd].function;
+			Object *cbdata   = loop->watchers[fd].data;
+
+			pthread_mutex_unlock( &loop->mutex );
+
+			vmem_t argv;
+
+			argv.push( (Object *)gc_new_integer(fd) );
+			argv.push( (Object *)gc_new_integer(events[i].events) );
+			argv.push( cbdata ? cbdata : H_DEFAULT_RETURN );
+
+			ok = ev_call( vm, data, function, &argv );
+		}
+
+		if( ok ){
+			ok = ev_run_timers( vm, data, loop );
+		}
+	}
+
+	loop->running = false;
+
+	return (ok ? H_DEFAULT_RETURN : H_DEFAULT_ERROR);
+}
+
+HYBRIS_DEFINE_FUNCTION(hev_stop){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	ev_loop_ucast(handle)->running = false;
+
+	return H_DEFAULT_RETURN;
+}
+/*
+ * Remove every watcher and timer, the loop structure itself stays
+ * allocated since other handles could still point to it.
+ */
+HYBRIS_DEFINE_FUNCTION(hev_close){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	ev_loop_t *loop = ev_loop_ucast(handle);
+
+	pthread_mutex_lock( &loop->mutex );
+
+	if( loop->epfd >= 0 ){
+		close( loop->epfd );
+		loop->epfd = -1;
+	}
+
+	loop->watchers.clear();
+	loop->n_watchers = 0;
+
+	for( ev_timers_map_t::iterator ti = loop->timers_by_id.begin(); ti != loop->timers_by_id.end(); ++ti ){
+		ti->second->cancelled = true;
+		ti->second->data      = NULL;
+	}
+	loop->timers_by_id.clear();
+
+	loop->running = false;
+
+	pthread_mutex_unlock( &loop->mutex );
+
+	return H_DEFAULT_RETURN;
+}
@@ -19,16 +19,39 @@
 #include <curl/curl.h>
 #include <curl/types.h>
 #include <curl/easy.h>
+#include <curl/multi.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/select.h>
+#include <deque>
+#include <set>
 #include <hybris.h>
 
+using std::deque;
+using std::set;
+
 HYBRIS_DEFINE_FUNCTION(hhttp_get);
 HYBRIS_DEFINE_FUNCTION(hhttp_post);
 HYBRIS_DEFINE_FUNCTION(hhttp_download);
+HYBRIS_DEFINE_FUNCTION(hhttp_client);
+HYBRIS_DEFINE_FUNCTION(hhttp_client_request);
+HYBRIS_DEFINE_FUNCTION(hhttp_client_add);
+HYBRIS_DEFINE_FUNCTION(hhttp_client_next);
+HYBRIS_DEFINE_FUNCTION(hhttp_client_pending);
+HYBRIS_DEFINE_FUNCTION(hhttp_client_close);
 
 HYBRIS_EXPORTED_FUNCTIONS() {
 	{ "http_get",      hhttp_get,      H_REQ_ARGC(2,3,4), { H_REQ_TYPES(otString), H_REQ_TYPES(otString), H_REQ_TYPES(otBoolean), H_REQ_TYPES(otMap) } },
 	{ "http_post",     hhttp_post,     H_REQ_ARGC(3,4,5), { H_REQ_TYPES(otString), H_REQ_TYPES(otString), H_REQ_TYPES(otMap), H_REQ_TYPES(otBoolean), H_REQ_TYPES(otMap) } },
 	{ "http_download", hhttp_download, H_REQ_ARGC(2,3),   { H_REQ_TYPES(otString), H_REQ_TYPES(otHandle), H_REQ_TYPES(otAlias) } },
+	{ "http_client",		 hhttp_client,		   H_REQ_ARGC(0,1,2),   { H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
+	{ "http_client_request", hhttp_client_request, H_REQ_ARGC(3,4,5),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString), H_REQ_TYPES(otString), H_REQ_TYPES(otString), H_REQ_TYPES(otMap) } },
+	{ "http_client_add",	 hhttp_client_add,	   H_REQ_ARGC(3,4,5),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString), H_REQ_TYPES(otString), H_REQ_TYPES(otString), H_REQ_TYPES(otMap) } },
+	{ "http_client_next",	 hhttp_client_next,	   H_REQ_ARGC(1,2),     { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "http_client_pending", hhttp_client_pending, H_REQ_ARGC(1),       { H_REQ_TYPES(otHandle) } },
+	{ "http_client_close",	 hhttp_client_close,   H_REQ_ARGC(1),       { H_REQ_TYPES(otHandle) } },
 	{ "", NULL }
 };
 
@@ -45,7 +68,10 @@ extern "C" void hybris_module_init( vm_t * vm ){
 
 static size_t http_append_callback( void *ptr, size_t size, size_t nmemb, void *data ){
 	string *buffer = (string *)data;
-	(*buffer) += (char *)ptr;
+	/*
+	 * Received data is not null terminated.
+	 */
+	buffer->append( (char *)ptr, size * nmemb );
 	return size * nmemb;
 }
 
@@ -283,3 +309,484 @@ HYBRIS_DEFINE_FUNCTION(hhttp_download){
 
 	return (Object *)gc_new_integer(res);
 }
+
+/*
+ * Persistent clients run every request through their own curl multi
+ * handle, which keeps the connection and DNS caches, so subsequent
+ * requests to the same host reuse the keep-alive connection (and its TLS
+ * session) instead of opening a new one.
+ * Easy handles are pooled and reset between requests.
+ *
+ * Requests added with http_client_add run concurrently and
+ * http_client_next returns them in order of completion.
+ */
+#define HTTP_CLIENT_MAX_CONNECTIONS 8
+
+typedef struct {
+	long 			   id;
+	CURL			  *easy;
+	string			   url;
+	string			   payload;
+	string			   headers;
+	string			   body;
+	struct curl_slist *headerlist;
+	CURLcode		   result;
+}
+http_request_t;
+
+typedef struct {
+	CURLM 				   *multi;
+	vector<CURL *>			idle;
+	/*
+	 * Finished requests not returned yet, because they completed while
+	 * waiting for another one.
+	 */
+	deque<http_request_t *> done;
+	set<http_request_t *>	running;
+	long					next_id;
+	long					timeout;
+	size_t					max_connections;
+	pthread_mutex_t			lock;
+	bool					closed;
+}
+http_client_t;
+
+#define http_client_ucast(o) ((http_client_t *)ob_handle_val(o))
+
+static void http_request_free( http_client_t *client, http_request_t *request ){
+	if( request->headerlist ){
+		curl_slist_free_all( request->headerlist );
+	}
+	if( client->closed || client->idle.size() >= client->max_connections ){
+		curl_easy_cleanup( request->easy );
+	}
+	else{
+		client->idle.push_back( request->easy );
+	}
+
+	delete request;
+}
+
+static void http_client_release( http_client_t *client ){
+	http_request_t *request;
+
+	client->closed = true;
+
+	while( client->done.empty() == false ){
+		request = client->done.front();
+		client->done.pop_front();
+
+		http_request_free( client, request );
+	}
+
+	while( client->idle.empty() == false ){
+		curl_easy_cleanup( client->idle.back() );
+		client->idle.pop_back();
+	}
+}
+
+static void http_client_finalize( void *value ){
+	http_client_t *client = (http_client_t *)value;
+	set<http_request_t *>::iterator i;
+
+	if( client->closed == false ){
+		http_client_release( client );
+	}
+	/*
+	 * Abort the transfers still running.
+	 */
+	for( i = client->running.begin(); i != client->running.end(); ++i ){
+		curl_multi_remove_handle( client->multi, (*i)->easy );
+		http_request_free( client, *i );
+	}
+
+	curl_multi_cleanup( client->multi );
+	pthread_mutex_destroy( &client->lock );
+
+	delete client;
+}
+
+static http_request_t *http_request_create( http_client_t *client, string& method, string& url, string& payload, Map *headers ){
+	http_request_t *request = new http_request_t;
+	CURL		   *easy;
+	size_t			i;
+
+	if( client->idle.empty() ){
+		easy = curl_easy_init();
+	}
+	else{
+		easy = client->idle.back();
+		client->idle.pop_back();
+
+		curl_easy_reset( easy );
+	}
+
+	request->id			= ++client->next_id;
+	request->easy		= easy;
+	request->url		= url;
+	request->payload	= payload;
+	request->headerlist = NULL;
+	request->result		= CURLE_OK;
+
+	curl_easy_setopt( easy, CURLOPT_URL, request->url.c_str() );
+	curl_easy_setopt( easy, CURLOPT_PRIVATE, (char *)request );
+	curl_easy_setopt( easy, CURLOPT_NOSIGNAL, 1L );
+	curl_easy_setopt( easy, CURLOPT_TCP_NODELAY, 1L );
+	curl_easy_setopt( easy, CURLOPT_TCP_KEEPALIVE, 1L );
+	curl_easy_setopt( easy, CURLOPT_ACCEPT_ENCODING, "" );
+	curl_easy_setopt( easy, CURLOPT_WRITEFUNCTION, http_append_callback );
+	curl_easy_setopt( easy, CURLOPT_WRITEDATA, (void *)&request->body );
+	curl_easy_setopt( easy, CURLOPT_HEADERFUNCTION, http_append_callback );
+	curl_easy_setopt( easy, CURLOPT_HEADERDATA, (void *)&request->headers );
+
+	if( client->timeout > 0 ){
+		curl_easy_setopt( easy, CURLOPT_TIMEOUT_MS, client->timeout );
+	}
+
+	if( method == "HEAD" ){
+		curl_easy_setopt( easy, CURLOPT_NOBODY, 1L );
+	}
+	else if( method != "GET" ){
+		curl_easy_setopt( easy, CURLOPT_CUSTOMREQUEST, method.c_str() );
+	}
+
+	if( request->payload.size() || method == "POST" || method == "PUT" ){
+		curl_easy_setopt( easy, CURLOPT_POSTFIELDS, request->payload.data() );
+		curl_easy_setopt( easy, CURLOPT_POSTFIELDSIZE, (long)request->payload.size() );
+	}
+
+	if( headers ){
+		string header;
+
+		for( i = 0; i < headers->items; ++i ){
+			header = ob_svalue( headers->keys[i] ) + ": " + ob_svalue( headers->values[i] );
+			request->headerlist = curl_slist_append( request->headerlist, header.c_str() );
+		}
+		curl_easy_setopt( easy, CURLOPT_HTTPHEADER, request->headerlist );
+	}
+
+	curl_multi_add_handle( client->multi, easy );
+	client->running.insert( request );
+
+	return request;
+}
+static INLINE long http_now_ms(){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+/*
+ * Wait up to 'timeout' milliseconds for activity on the transfers.
+ * A multi handle can't be used by two threads at once, so instead of
+ * curl_multi_wait the descriptors are collected with the client lock
+ * held and polled with the lock released, letting other threads add
+ * requests or drive their own ones meanwhile.
+ * Must be called with the client lock held, which is held again on return.
+ */
+static void http_client_poll( http_client_t *client, long timeout ){
+	struct pollfd fds[FD_SETSIZE];
+	fd_set		  rfds, wfds, efds;
+	nfds_t		  nfds = 0;
+	long		  curl_timeout = -1;
+	int			  maxfd = -1, fd;
+
+	FD_ZERO( &rfds );
+	FD_ZERO( &wfds );
+	FD_ZERO( &efds );
+
+	curl_multi_fdset( client->multi, &rfds, &wfds, &efds, &maxfd );
+	curl_multi_timeout( client->multi, &curl_timeout );
+
+	if( curl_timeout >= 0 && curl_timeout < timeout ){
+		timeout = curl_timeout;
+	}
+	/*
+	 * No descriptor yet (e.g. a name is being resolved), retry soon.
+	 */
+	if( maxfd < 0 && timeout > 100 ){
+		timeout = 100;
+	}
+
+	for( fd = 0; fd <= maxfd; ++fd ){
+		short events = ( FD_ISSET( fd, &rfds ) ? POLLIN : 0 ) |
+					   ( FD_ISSET( fd, &wfds ) ? POLLOUT : 0 ) |
+					   ( FD_ISSET( fd, &efds ) ? POLLPRI : 0 );
+		if( events ){
+			fds[nfds].fd	  = fd;
+			fds[nfds].events  = events;
+			fds[nfds].revents = 0;
+			++nfds;
+		}
+	}
+
+	pthread_mutex_unlock( &client->lock );
+
+	while( poll( fds, nfds, timeout ) < 0 && errno == EINTR );
+
+	pthread_mutex_lock( &client->lock );
+}
+/*
+ * Drive the transfers until the request 'id' (or any request if 0) is
+ * completed and return it, or NULL if nothing completed within 'timeout'
+ * milliseconds (wait forever if negative), nothing is running or the
+ * client was closed while waiting.
+ * Requests completed meanwhile are queued for http_client_next, another
+ * thread waiting on the same client could return them as well.
+ * Must be called with the client lock held, which is released while
+ * waiting for the transfers.
+ */
+static http_request_t *http_client_wait( http_client_t *client, long id, long timeout ){
+	http_request_t *request;
+	deque<http_request_t *>::iterator i;
+	CURLMsg		   *msg;
+	int				active, left;
+	long			deadline = http_now_ms() + timeout,
+					now;
+
+	for(;;){
+		if( client->closed ){
+			return NULL;
+		}
+
+		for( i = client->done.begin(); i != client->done.end(); ++i ){
+			if( id == 0 || (*i)->id == id ){
+				request = *i;
+				client->done.erase(i);
+				return request;
+			}
+		}
+
+		if( client->running.empty() ){
+			return NULL;
+		}
+
+		curl_multi_perform( client->multi, &active );
+
+		while( (msg = curl_multi_info_read( client->multi, &left )) ){
+			if( msg->msg == CURLMSG_DONE ){
+				curl_easy_getinfo( msg->easy_handle, CURLINFO_PRIVATE, (char **)&request );
+
+				request->result = msg->data.result;
+
+				curl_multi_remove_handle( client->multi, msg->easy_handle );
+				client->running.erase( request );
+				client->done.push_back( request );
+			}
+		}
+
+		if( client->done.empty() == false ){
+			continue;
+		}
+		else if( timeout < 0 ){
+			http_client_poll( client, 1000 );
+		}
+		else if( (now = http_now_ms()) < deadline ){
+			http_client_poll( client, deadline - now < 1000 ? deadline - now : 1000 );
+		}
+		else{
+			return NULL;
+		}
+	}
+}
+/*
+ * Create the result map of a completed request and release it.
+ */
+static Object *http_request_result( http_client_t *client, http_request_t *request ){
+	Object *map = (Object *)gc_new_map();
+	long	status	 = 0,
+			connects = 0;
+
+	curl_easy_getinfo( request->easy, CURLINFO_RESPONSE_CODE, &status );
+	/*
+	 * New connections the request had to open, 0 if it reused a
+	 * keep-alive one.
+	 */
+	curl_easy_getinfo( request->easy, CURLINFO_NUM_CONNECTS, &connects );
+
+	ob_cl_set( map, (Object *)gc_new_string("id"), 	 	(Object *)gc_new_integer( request->id ) );
+	ob_cl_set( map, (Object *)gc_new_string("url"), 	(Object *)gc_new_string( request->url.c_str() ) );
+	ob_cl_set( map, (Object *)gc_new_string("status"),  (Object *)gc_new_integer( status ) );
+	ob_cl_set( map, (Object *)gc_new_string("headers"), (Object *)gc_new_string( request->headers.c_str() ) );
+	ob_cl_set( map, (Object *)gc_new_string("connects"), (Object *)gc_new_integer( connects ) );
+
+	String *body = gc_new_string("");
+
+	body->value.assign( request->body.data(), request->body.size() );
+	body->items = request->body.size();
+	ob_update_footprint( (Object *)body );
+
+	ob_cl_set( map, (Object *)gc_new_string("body"), (Object *)body );
+
+	if( request->result != CURLE_OK ){
+		ob_cl_set( map, (Object *)gc_new_string("error"), (Object *)gc_new_string( curl_easy_strerror( request->result ) ) );
+	}
+
+	http_request_free( client, request );
+
+	return map;
+}
+
+HYBRIS_DEFINE_FUNCTION(hhttp_client){
+	long max_connections = HTTP_CLIENT_MAX_CONNECTIONS,
+		 timeout		 = 0;
+
+	vm_parse_argv( "ll", &max_connections, &timeout );
+
+	http_client_t *client = new http_client_t;
+
+	client->multi			= curl_multi_init();
+	client->next_id			= 0;
+	client->timeout			= timeout;
+	client->max_connections = ( max_connections > 0 ? max_connections : HTTP_CLIENT_MAX_CONNECTIONS );
+	client->closed			= false;
+
+	pthread_mutex_init( &client->lock, NULL );
+
+	curl_multi_setopt( client->multi, CURLMOPT_MAXCONNECTS, (long)client->max_connections );
+	curl_multi_setopt( client->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)client->max_connections );
+	curl_multi_setopt( client->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX );
+
+	Handle *handle = gc_new_handle(client);
+
+	handle_set_finalizer( handle, http_client_finalize );
+
+	return (Object *)handle;
+}
+/*
+ * Perform a single request and return its result map :
+ *
+ * 	[ "id", "url", "status", "headers", "connects", "body" ( , "error" ) ]
+ *
+ * Other requests added to the client make progress meanwhile.
+ */
+HYBRIS_DEFINE_FUNCTION(hhttp_client_request){
+	Handle *handle;
+	string  method,
+			url,
+			payload;
+	Map	   *headers = NULL;
+
+	vm_parse_argv( "HsssM", &handle, &method, &url, &payload, &headers );
+
+	http_client_t  *client = http_client_ucast(handle);
+	http_request_t *request;
+
+	pthread_mutex_lock( &client->lock );
+
+	if( client->closed ){
+		pthread_mutex_unlock( &client->lock );
+		return vm_raise_exception( "request on a closed http client" );
+	}
+
+	request = http_request_create( client, method, url, payload, headers );
+	/*
+	 * NULL only if another thread closed the client meanwhile.
+	 */
+	if( (request = http_client_wait( client, request->id, -1 )) == NULL ){
+		pthread_mutex_unlock( &client->lock );
+		return vm_raise_exception( "http client closed while waiting for the request" );
+	}
+
+	Object *result = http_request_result( client, request );
+
+	pthread_mutex_unlock( &client->lock );
+
+	return result;
+}
+/*
+ * Start a request without waiting for it and return its id.
+ */
+HYBRIS_DEFINE_FUNCTION(hhttp_client_add){
+	Handle *handle;
+	string  method,
+			url,
+			payload;
+	Map	   *headers = NULL;
+	int		active;
+
+	vm_parse_argv( "HsssM", &handle, &method, &url, &payload, &headers );
+
+	http_client_t  *client = http_client_ucast(handle);
+	http_request_t *request;
+
+	pthread_mutex_lock( &client->lock );
+
+	if( client->closed ){
+		pthread_mutex_unlock( &client->lock );
+		return vm_raise_exception( "request on a closed http client" );
+	}
+
+	request = http_request_create( client, method, url, payload, headers );
+	/*
+	 * Get the connection going right away.
+	 */
+	curl_multi_perform( client->multi, &active );
+
+	pthread_mutex_unlock( &client->lock );
+
+	return (Object *)gc_new_integer( request->id );
+}
+/*
+ * Return the result map of the next completed request, or false if no
+ * request is running or none completes within 'timeout' milliseconds.
+ */
+HYBRIS_DEFINE_FUNCTION(hhttp_client_next){
+	Handle *handle;
+	long	timeout = -1;
+
+	vm_parse_argv( "Hl", &handle, &timeout );
+
+	http_client_t  *client = http_client_ucast(handle);
+	http_request_t *request;
+	Object		   *result = NULL;
+
+	pthread_mutex_lock( &client->lock );
+
+	if( (request = http_client_wait( client, 0, timeout )) != NULL ){
+		result = http_request_result( client, request );
+	}
+
+	pthread_mutex_unlock( &client->lock );
+
+	return ( result ? result : (Object *)gc_new_boolean(false) );
+}
+/*
+ * Number of requests running or completed but not returned yet.
+ */
+HYBRIS_DEFINE_FUNCTION(hhttp_client_pending){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	http_client_t *client = http_client_ucast(handle);
+	size_t		   pending;
+
+	pthread_mutex_lock( &client->lock );
+	pending = client->running.size() + client->done.size();
+	pthread_mutex_unlock( &client->lock );
+
+	return (Object *)gc_new_integer(pending);
+}
+/*
+ * Release pooled handles and discard finished requests, running ones
+ * are aborted when the client is collected.
+ */
+HYBRIS_DEFINE_FUNCTION(hhttp_client_close){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	http_client_t *client = http_client_ucast(handle);
+
+	pthread_mutex_lock( &client->lock );
+
+	if( client->closed == false ){
+		http_client_release( client );
+	}
+
+	pthread_mutex_unlock( &client->lock );
+
+	return H_DEFAULT_RETURN;
+}
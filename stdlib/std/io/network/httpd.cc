@@ -0,0 +1,1143 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <hybris.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * Native HTTP/1.1 server.
+ *
+ * Every worker thread runs its own epoll loop on the shared listening
+ * socket and calls the script handler for each request, so requests are
+ * served by a long running interpreter instead of a CGI process each.
+ * Connections are kept alive and pipelined requests are answered in
+ * order with a single send per batch.
+ * The request head is parsed in place on the connection buffer, objects
+ * are only created for what is handed to the script.
+ */
+#ifndef EPOLLEXCLUSIVE
+#	define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+#define HTTPD_BUFFER_SIZE   16384
+#define HTTPD_MAX_HEAD		65536
+#define HTTPD_MAX_BODY		(16 * 1024 * 1024)
+#define HTTPD_MAX_HEADERS	64
+#define HTTPD_MAX_EVENTS	256
+#define HTTPD_IDLE_TIMEOUT  30000
+/*
+ * Bodies bigger than this are sent straight from the result string
+ * with sendmsg instead of being copied into the output buffer.
+ */
+#define HTTPD_DIRECT_BODY	65536
+
+HYBRIS_DEFINE_FUNCTION(hhttpd_listen);
+HYBRIS_DEFINE_FUNCTION(hhttpd_serve);
+HYBRIS_DEFINE_FUNCTION(hhttpd_stop);
+HYBRIS_DEFINE_FUNCTION(hhttpd_close);
+
+HYBRIS_EXPORTED_FUNCTIONS() {
+	{ "httpd_listen", hhttpd_listen, H_REQ_ARGC(1,2,3), { H_REQ_TYPES(otInteger), H_REQ_TYPES(otString), H_REQ_TYPES(otInteger) } },
+	{ "httpd_serve",  hhttpd_serve,  H_REQ_ARGC(2,3,4), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString), H_REQ_TYPES(otInteger), H_ANY_TYPE } },
+	{ "httpd_stop",   hhttpd_stop,   H_REQ_ARGC(1),	    { H_REQ_TYPES(otHandle) } },
+	{ "httpd_close",  hhttpd_close,  H_REQ_ARGC(1),	    { H_REQ_TYPES(otHandle) } },
+	{ "", NULL }
+};
+
+typedef struct {
+	const char *data;
+	size_t		size;
+}
+httpd_slice_t;
+/*
+ * A request parsed in place, slices point into the connection buffer.
+ */
+typedef struct {
+	httpd_slice_t method;
+	httpd_slice_t target;
+	httpd_slice_t version;
+	httpd_slice_t names[HTTPD_MAX_HEADERS];
+	httpd_slice_t values[HTTPD_MAX_HEADERS];
+	size_t		  nheaders;
+	/*
+	 * Size of the head, final empty line included, and of the whole
+	 * request as it is in the buffer.
+	 */
+	size_t		  head;
+	size_t		  total;
+	long		  length;
+	bool		  chunked;
+	bool		  keepalive;
+}
+httpd_request_t;
+
+typedef struct {
+	int	   fd;
+	char  *ibuf;
+	size_t isize;
+	size_t istart;
+	size_t iend;
+	/*
+	 * Bytes of the current request already scanned for the end of its
+	 * head, so a head received in several reads is not scanned again.
+	 */
+	size_t scanned;
+	string obuf;
+	size_t osent;
+	/*
+	 * Close the connection once the output is flushed.
+	 */
+	bool   closing;
+	/*
+	 * Chunked body of the current request walked so far : offset of the
+	 * next chunk from the start of the body and decoded size up to it,
+	 * so a body received in several reads is not walked again.
+	 */
+	size_t chunk_offset;
+	size_t chunk_decoded;
+	/*
+	 * A "100 Continue" was sent for the current request.
+	 */
+	bool   continued;
+	ulong  last;
+}
+httpd_conn_t;
+
+typedef struct {
+	int				lsd;
+	int				stopfd;
+	volatile bool	running;
+	vm_t		   *vm;
+	string			handler;
+	Object		   *data;
+	pthread_t	   *workers;
+	size_t			nworkers;
+}
+httpd_server_t;
+
+#define httpd_server_ucast(o) ((httpd_server_t *)ob_handle_val(o))
+/*
+ * Makes the workers wait for their scope to be registered.
+ */
+static pthread_mutex_t __httpd_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static INLINE ulong httpd_now(){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static INLINE bool httpd_slice_is( httpd_slice_t& s, const char *str ){
+	size_t len = strlen(str);
+
+	return s.size == len && strncasecmp( s.data, str, len ) == 0;
+}
+/*
+ * Value of the header 'name' or NULL.
+ */
+static httpd_slice_t *httpd_header( httpd_request_t *req, const char *name ){
+	size_t i;
+
+	for( i = 0; i < req->nheaders; ++i ){
+		if( httpd_slice_is( req->names[i], name ) ){
+			return &req->values[i];
+		}
+	}
+	return NULL;
+}
+
+static const char *httpd_reason( int status ){
+	switch( status ){
+		case 100 : return "Continue";
+		case 200 : return "OK";
+		case 201 : return "Created";
+		case 202 : return "Accepted";
+		case 204 : return "No Content";
+		case 206 : return "Partial Content";
+		case 301 : return "Moved Permanently";
+		case 302 : return "Found";
+		case 303 : return "See Other";
+		case 304 : return "Not Modified";
+		case 307 : return "Temporary Redirect";
+		case 400 : return "Bad Request";
+		case 401 : return "Unauthorized";
+		case 403 : return "Forbidden";
+		case 404 : return "Not Found";
+		case 405 : return "Method Not Allowed";
+		case 408 : return "Request Timeout";
+		case 411 : return "Length Required";
+		case 413 : return "Payload Too Large";
+		case 431 : return "Request Header Fields Too Large";
+		case 500 : return "Internal Server Error";
+		case 501 : return "Not Implemented";
+		case 502 : return "Bad Gateway";
+		case 503 : return "Service Unavailable";
+	}
+	return "Unknown";
+}
+/*
+ * Split a line starting at 'p' and ending before 'end' into the slice
+ * before the first 'sep' and the rest.
+ */
+static INLINE bool httpd_split( const char *p, const char *end, char sep, httpd_slice_t& first, httpd_slice_t& rest ){
+	const char *s = (const char *)memchr( p, sep, end - p );
+
+	if( s == NULL ){
+		return false;
+	}
+
+	first.data = p;
+	first.size = s - p;
+	rest.data  = s + 1;
+	rest.size  = end - (s + 1);
+
+	return true;
+}
+
+static INLINE void httpd_trim( httpd_slice_t& s ){
+	while( s.size && (s.data[0] == ' ' || s.data[0] == '\t') ){
+		s.data++;
+		s.size--;
+	}
+	while( s.size && (s.data[s.size - 1] == ' ' || s.data[s.size - 1] == '\t') ){
+		s.size--;
+	}
+}
+/*
+ * Walk a chunked body starting at 'start', return its encoded size or 0
+ * if it's not complete yet, -1 if it's malformed or too big.
+ * The walk resumes from 'offset' with 'decoded' bytes already seen, both
+ * are updated to the last complete chunk when more data is needed.
+ * If 'body' is given, the decoded data is appended to it.
+ */
+static long httpd_chunked( const char *start, const char *end, string *body, size_t& offset, size_t& decoded ){
+	const char *p = start + offset,
+			   *eol;
+	char	   *num_end;
+	long		size;
+
+	for(;;){
+		offset = p - start;
+
+
+		if( (eol = (const char *)memmem( p, end - p, "\r\n", 2 )) == NULL ){
+			return 0;
+		}
+
+		size = strtol( p, &num_end, 16 );
+		if( num_end == p || size < 0 || decoded + size > HTTPD_MAX_BODY ){
+			return -1;
+		}
+
+		p = eol + 2;
+		/*
+		 * Last chunk, skip the trailers up to the final empty line.
+		 */
+		if( size == 0 ){
+			for(;;){
+				if( (eol = (const char *)memmem( p, end - p, "\r\n", 2 )) == NULL ){
+					return 0;
+				}
+				else if( eol == p ){
+					return (eol + 2) - start;
+				}
+				p = eol + 2;
+			}
+		}
+
+		if( end - p < size + 2 ){
+			return 0;
+		}
+		if( body ){
+			body->append( p, size );
+		}
+		p 		+= size + 2;
+		decoded += size;
+	}
+}
+/*
+ * Answer "100 Continue" once if the client waits for it before sending
+ * the body of the request.
+ */
+static INLINE void httpd_continue( httpd_conn_t *conn, httpd_request_t *req ){
+	httpd_slice_t *header;
+
+	if( conn->continued == false && (header = httpd_header( req, "Expect" )) && httpd_slice_is( *header, "100-continue" ) ){
+		conn->obuf	 	+= "HTTP/1.1 100 Continue\r\n\r\n";
+		conn->continued  = true;
+	}
+}
+/*
+ * Parse the next request of the connection buffer, return 1 if it's
+ * complete, 0 if more data is needed or an http error status.
+ */
+static int httpd_parse( httpd_conn_t *conn, httpd_request_t *req ){
+	const char *base = conn->ibuf + conn->istart,
+			   *end  = conn->ibuf + conn->iend,
+			   *eoh,
+			   *p,
+			   *eol;
+	size_t		from = ( conn->scanned > 3 ? conn->scanned - 3 : 0 );
+	long		chunked;
+	httpd_slice_t rest, *header;
+
+	/*
+	 * Empty lines before a request are allowed.
+	 */
+	while( base + 1 < end && base[0] == '\r' && base[1] == '\n' ){
+		base += 2;
+		conn->istart += 2;
+	}
+
+	if( (eoh = (const char *)memmem( base + from, end - base - from, "\r\n\r\n", 4 )) == NULL ){
+		conn->scanned = end - base;
+		return ( conn->scanned > HTTPD_MAX_HEAD ? 431 : 0 );
+	}
+
+	req->head	   = (eoh + 4) - base;
+	req->nheaders  = 0;
+	req->length	   = 0;
+	req->chunked   = false;
+	/*
+	 * Request line.
+	 */
+	eol = (const char *)memmem( base, eoh + 2 - base, "\r\n", 2 );
+
+	if( !httpd_split( base, eol, ' ', req->method, rest ) ||
+		!httpd_split( rest.data, eol, ' ', req->target, req->version ) ||
+		req->version.size != 8 || strncmp( req->version.data, "HTTP/1.", 7 ) != 0 ){
+		return 400;
+	}
+	/*
+	 * Header lines.
+	 */
+	for( p = eol + 2; p < eoh + 2; p = eol + 2 ){
+		eol = (const char *)memmem( p, eoh + 2 - p, "\r\n", 2 );
+
+		if( req->nheaders == HTTPD_MAX_HEADERS ){
+			return 431;
+		}
+		else if( !httpd_split( p, eol, ':', req->names[req->nheaders], req->values[req->nheaders] ) ){
+			return 400;
+		}
+
+		httpd_trim( req->values[req->nheaders] );
+		req->nheaders++;
+	}
+
+	req->keepalive = ( req->version.data[7] == '1' );
+
+	if( (header = httpd_header( req, "Connection" )) ){
+		if( httpd_slice_is( *header, "close" ) ){
+			req->keepalive = false;
+		}
+		else if( httpd_slice_is( *header, "keep-alive" ) ){
+			req->keepalive = true;
+		}
+	}
+	/*
+	 * Body.
+	 */
+	if( (header = httpd_header( req, "Transfer-Encoding" )) ){
+		if( !httpd_slice_is( *header, "chunked" ) ){
+			return 501;
+		}
+		if( (chunked = httpd_chunked( eoh + 4, end, NULL, conn->chunk_offset, conn->chunk_decoded )) < 0 ){
+			return 413;
+		}
+		else if( chunked == 0 ){
+			httpd_continue( conn, req );
+			return 0;
+		}
+
+		req->chunked = true;
+		req->total	 = req->head + chunked;
+	}
+	else{
+		if( (header = httpd_header( req, "Content-Length" )) ){
+			req->length = strtol( header->data, NULL, 10 );
+			if( req->length < 0 ){
+				return 400;
+			}
+			else if( req->length > HTTPD_MAX_BODY ){
+				return 413;
+			}
+		}
+		if( (size_t)(end - base) < req->head + req->length ){
+			httpd_continue( conn, req );
+			return 0;
+		}
+
+		req->total = req->head + req->length;
+	}
+
+	return 1;
+}
+
+static INLINE Object *httpd_string( const char *data, size_t size ){
+	String *s = gc_new_string("");
+
+	s->value.assign( data, size );
+	s->items = size;
+	ob_update_footprint( (Object *)s );
+
+	return (Object *)s;
+}
+
+static INLINE Object *httpd_slice_string( httpd_slice_t& s ){
+	return httpd_string( s.data, s.size );
+}
+
+#define httpd_map_set( map, name, value ) ob_cl_set( map, (Object *)gc_new_string(name), (Object *)(value) )
+/*
+ * Create the map handed to the script handler :
+ *
+ * 	[ "method", "path", "query", "version", "headers", "body" ]
+ *
+ * Header names are lower case.
+ * The map is pushed on 'frame' before being filled, so a collection run
+ * by another worker meanwhile can't free it, the caller removes it once
+ * done.
+ */
+static Object *httpd_request_map( vmem_t *frame, httpd_conn_t *conn, httpd_request_t *req ){
+	Object 	   *map		= frame->push_tmp( (Object *)gc_new_map() ),
+			   *headers = frame->push_tmp( (Object *)gc_new_map() );
+	const char *base	= conn->ibuf + conn->istart,
+			   *query	= (const char *)memchr( req->target.data, '?', req->target.size );
+	string		name;
+	size_t		i, j;
+
+	httpd_map_set( map, "method", httpd_slice_string( req->method ) );
+
+	if( query ){
+		httpd_map_set( map, "path",  httpd_string( req->target.data, query - req->target.data ) );
+		httpd_map_set( map, "query", httpd_string( query + 1, req->target.data + req->target.size - query - 1 ) );
+	}
+	else{
+		httpd_map_set( map, "path",  httpd_slice_string( req->target ) );
+		httpd_map_set( map, "query", gc_new_string("") );
+	}
+
+	httpd_map_set( map, "version", httpd_slice_string( req->version ) );
+
+	for( i = 0; i < req->nheaders; ++i ){
+		name.assign( req->names[i].data, req->names[i].size );
+		for( j = 0; j < name.size(); ++j ){
+			name[j] = tolower( name[j] );
+		}
+		ob_cl_set( headers, (Object *)gc_new_string( name.c_str() ), httpd_slice_string( req->values[i] ) );
+	}
+
+	httpd_map_set( map, "headers", headers );
+	frame->remove_tmp( headers );
+
+	if( req->chunked ){
+		String *body 	= gc_new_string("");
+		size_t  offset  = 0,
+				decoded = 0;
+
+		body->value.reserve( conn->chunk_decoded );
+
+		httpd_chunked( base + req->head, base + req->total, &body->value, offset, decoded );
+		body->items = body->value.size();
+		ob_update_footprint( (Object *)body );
+
+		httpd_map_set( map, "body", body );
+	}
+	else{
+		httpd_map_set( map, "body", httpd_string( base + req->head, req->length ) );
+	}
+
+	return map;
+}
+
+static INLINE Object *httpd_map_get( Object *map, const char *key ){
+	Map   *m = ob_map_ucast(map);
+	size_t i;
+
+	for( i = 0; i < m->items; ++i ){
+		if( ob_is_string( m->keys[i] ) && ob_string_val( m->keys[i] ) == key ){
+			return m->values[i];
+		}
+	}
+	return NULL;
+}
+/*
+ * Append an http response to the output buffer, or send it right away
+ * together with its body if it's big and nothing else is pending.
+ * When 'body' is NULL, 'text' is sent instead.
+ * A vector body is sent with chunked encoding, or joined and sent with
+ * its Content-Length to HTTP/1.0 clients which don't support it.
+ */
+static void httpd_respond( httpd_conn_t *conn, int status, Object *headers, Object *body, bool head_only, bool http11, const char *text = "" ){
+	char   line[0xFF];
+	string out;
+	size_t i;
+	bool   chunked = ( body && ob_is_vector(body) && http11 ),
+		   has_type = false;
+
+	sprintf( line, "HTTP/1.1 %d %s\r\n", status, httpd_reason(status) );
+	out = line;
+
+	if( headers && ob_is_map(headers) ){
+		Map *m = ob_map_ucast(headers);
+
+		for( i = 0; i < m->items; ++i ){
+			string name = ob_svalue( m->keys[i] );
+
+			if( strcasecmp( name.c_str(), "content-type" ) == 0 ){
+				has_type = true;
+			}
+			out += name + ": " + ob_svalue( m->values[i] ) + "\r\n";
+		}
+	}
+
+	if( has_type == false ){
+		out += "Content-Type: text/html\r\n";
+	}
+
+	out += ( conn->closing ? "Connection: close\r\n" : "Connection: keep-alive\r\n" );
+
+	if( chunked ){
+		Vector *parts = ob_vector_ucast(body);
+
+		out += "Transfer-Encoding: chunked\r\n\r\n";
+
+		if( head_only == false ){
+			for( i = 0; i < parts->items; ++i ){
+				string part = ob_svalue( parts->value[i] );
+				/*
+				 * An empty chunk would terminate the body.
+				 */
+				if( part.size() ){
+					sprintf( line, "%lx\r\n", (unsigned long)part.size() );
+					out += line + part + "\r\n";
+				}
+			}
+			out += "0\r\n\r\n";
+		}
+
+		conn->obuf += out;
+		return;
+	}
+
+	const char *bdata;
+	size_t		bsize;
+	string		tmp;
+
+	if( body == NULL ){
+		bdata = text;
+		bsize = strlen(text);
+	}
+	else if( ob_is_string(body) ){
+		bdata = ob_string_val(body).data();
+		bsize = ob_string_val(body).size();
+	}
+	else if( ob_is_vector(body) ){
+		Vector *parts = ob_vector_ucast(body);
+
+		for( i = 0; i < parts->items; ++i ){
+			tmp += ob_svalue( parts->value[i] );
+		}
+		bdata = tmp.data();
+		bsize = tmp.size();
+	}
+	else{
+		tmp	  = ob_svalue(body);
+		bdata = tmp.data();
+		bsize = tmp.size();
+	}
+
+	sprintf( line, "Content-Length: %lu\r\n\r\n", (unsigned long)bsize );
+	out += line;
+
+	if( head_only ){
+		bsize = 0;
+	}
+
+	if( bsize >= HTTPD_DIRECT_BODY && conn->obuf.size() == conn->osent ){
+		struct iovec  iov[2] = { { (void *)out.data(), out.size() }, { (void *)bdata, bsize } };
+		struct msghdr msg;
+		ssize_t		  wr;
+
+		memset( &msg, 0x00, sizeof(msg) );
+
+		msg.msg_iov	   = iov;
+		msg.msg_iovlen = 2;
+
+		conn->obuf.clear();
+		conn->osent = 0;
+		/*
+		 * sendmsg instead of writev for MSG_NOSIGNAL, a client that went
+		 * away must not raise SIGPIPE.
+		 */
+		while( (wr = sendmsg( conn->fd, &msg, MSG_NOSIGNAL )) < 0 && errno == EINTR );
+
+		wr = ( wr > 0 ? wr : 0 );
+		/*
+		 * Buffer whatever was not sent.
+		 */
+		if( (size_t)wr < out.size() ){
+			conn->obuf.append( out, wr, string::npos );
+			conn->obuf.append( bdata, bsize );
+		}
+		else{
+			conn->obuf.append( bdata + (wr - out.size()), bsize - (wr - out.size()) );
+		}
+	}
+	else{
+		conn->obuf += out;
+		conn->obuf.append( bdata, bsize );
+	}
+}
+/*
+ * Call the script handler and queue its response. The handler returns
+ * either the body string or a map with optional "status", "headers"
+ * and "body" keys, where a vector body is sent with chunked encoding.
+ */
+static void httpd_dispatch( httpd_server_t *server, vmem_t *frame, Node *function, httpd_conn_t *conn, httpd_request_t *req ){
+	vmem_t  argv;
+	Object *request,
+		   *result;
+	bool	head_only = httpd_slice_is( req->method, "HEAD" ),
+			http11	  = ( req->version.data[7] == '1' );
+
+	if( req->keepalive == false ){
+		conn->closing = true;
+	}
+
+	request = httpd_request_map( frame, conn, req );
+
+	argv.push( request );
+	if( server->data ){
+		argv.push( server->data );
+	}
+
+	/*
+	 * The result is rooted on the frame before the handler stack is
+	 * dismissed, and the request stays pushed until the response is
+	 * queued, the handler could return it or one of its items.
+	 */
+	result = vm_exec_threaded_call( server->vm, function, frame, &argv, frame );
+
+	if( frame->state.is(Exception) ){
+		frame->state.unset(Exception);
+		frame->state.e_value = NULL;
+
+		httpd_respond( conn, 500, NULL, NULL, head_only, http11, httpd_reason(500) );
+	}
+	else if( result == H_UNDEFINED || result == NULL ){
+		httpd_respond( conn, 204, NULL, NULL, head_only, http11 );
+	}
+	else if( ob_is_map(result) ){
+		Object *status = httpd_map_get( result, "status" );
+
+		httpd_respond( conn,
+					   status ? ob_ivalue(status) : 200,
+					   httpd_map_get( result, "headers" ),
+					   httpd_map_get( result, "body" ),
+					   head_only,
+					   http11 );
+	}
+	else{
+		httpd_respond( conn, 200, NULL, result, head_only, http11 );
+	}
+
+	if( result ){
+		frame->remove_tmp( result );
+	}
+	frame->remove_tmp( request );
+}
+
+static INLINE void httpd_error( httpd_conn_t *conn, int status ){
+	conn->closing = true;
+
+	httpd_respond( conn, status, NULL, NULL, false, true, httpd_reason(status) );
+}
+
+static void httpd_conn_close( int epfd, vector<httpd_conn_t *>& conns, httpd_conn_t *conn ){
+	epoll_ctl( epfd, EPOLL_CTL_DEL, conn->fd, NULL );
+	close( conn->fd );
+
+	conns[conn->fd] = NULL;
+
+	free( conn->ibuf );
+	delete conn;
+}
+/*
+ * Send pending output, return false if the connection has to be closed.
+ */
+static bool httpd_flush( int epfd, httpd_conn_t *conn ){
+	struct epoll_event ev;
+	ssize_t			   wr;
+
+	while( conn->osent < conn->obuf.size() ){
+		wr = send( conn->fd, conn->obuf.data() + conn->osent, conn->obuf.size() - conn->osent, MSG_NOSIGNAL );
+		if( wr < 0 ){
+			if( errno == EINTR ){
+				continue;
+			}
+			else if( errno == EAGAIN || errno == EWOULDBLOCK ){
+				/*
+				 * Stop reading until the client consumes what's pending.
+				 */
+				ev.events  = EPOLLOUT;
+				ev.data.fd = conn->fd;
+				epoll_ctl( epfd, EPOLL_CTL_MOD, conn->fd, &ev );
+				return true;
+			}
+			return false;
+		}
+		conn->osent += wr;
+	}
+
+	conn->obuf.clear();
+	conn->osent = 0;
+
+	if( conn->closing ){
+		return false;
+	}
+
+	ev.events  = EPOLLIN;
+	ev.data.fd = conn->fd;
+	epoll_ctl( epfd, EPOLL_CTL_MOD, conn->fd, &ev );
+
+	return true;
+}
+/*
+ * Answer every complete request in the buffer, return false if the
+ * connection has to be closed.
+ */
+static bool httpd_process( httpd_server_t *server, vmem_t *frame, Node *function, int epfd, httpd_conn_t *conn ){
+	httpd_request_t req;
+	int				rc;
+
+	while( conn->closing == false && conn->istart < conn->iend ){
+		if( (rc = httpd_parse( conn, &req )) == 0 ){
+			break;
+		}
+		else if( rc != 1 ){
+			httpd_error( conn, rc );
+			break;
+		}
+
+		httpd_dispatch( server, frame, function, conn, &req );
+
+		conn->istart	   += req.total;
+		conn->scanned		= 0;
+		conn->chunk_offset  =
+		conn->chunk_decoded = 0;
+		conn->continued		= false;
+		/*
+		 * Don't pile up responses for a client that's not reading them.
+		 */
+		if( conn->obuf.size() - conn->osent > HTTPD_MAX_HEAD * 16 ){
+			break;
+		}
+	}
+
+	if( conn->istart == conn->iend ){
+		conn->istart = conn->iend = 0;
+	}
+
+	return httpd_flush( epfd, conn );
+}
+/*
+ * Read what's available, return false on EOF or error.
+ */
+static bool httpd_read( httpd_conn_t *conn ){
+	ssize_t rd;
+
+	for(;;){
+		if( conn->iend == conn->isize ){
+			if( conn->istart > 0 ){
+				memmove( conn->ibuf, conn->ibuf + conn->istart, conn->iend - conn->istart );
+				conn->iend  -= conn->istart;
+				conn->istart = 0;
+			}
+			else{
+				conn->isize *= 2;
+				conn->ibuf   = (char *)realloc( conn->ibuf, conn->isize );
+			}
+		}
+
+		rd = recv( conn->fd, conn->ibuf + conn->iend, conn->isize - conn->iend, 0 );
+		if( rd > 0 ){
+			conn->iend += rd;
+			/*
+			 * Let the parser catch up before buffering more.
+			 */
+			if( conn->iend < conn->isize ){
+				return true;
+			}
+		}
+		else if( rd < 0 && errno == EINTR ){
+			continue;
+		}
+		else if( rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ){
+			return true;
+		}
+		else{
+			return false;
+		}
+	}
+}
+
+static void httpd_accept( int epfd, int lsd, vector<httpd_conn_t *>& conns ){
+	struct epoll_event ev;
+	httpd_conn_t	  *conn;
+	int				   fd,
+					   one = 1;
+
+	while( (fd = accept4( lsd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC )) >= 0 ){
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+		conn = new httpd_conn_t;
+
+		conn->fd	  = fd;
+		conn->isize	  = HTTPD_BUFFER_SIZE;
+		conn->ibuf	  = (char *)malloc( conn->isize );
+		conn->istart  =
+		conn->iend	  =
+		conn->scanned =
+		conn->osent	  = 0;
+		conn->chunk_offset  =
+		conn->chunk_decoded = 0;
+		conn->closing	= false;
+		conn->continued = false;
+		conn->last		= httpd_now();
+
+		if( (size_t)fd >= conns.size() ){
+			conns.resize( fd + 1, NULL );
+		}
+		conns[fd] = conn;
+
+		ev.events  = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev );
+	}
+}
+
+static void *httpd_worker( void *arg ){
+	httpd_server_t	  *server = (httpd_server_t *)arg;
+	struct epoll_event ev,
+					   events[HTTPD_MAX_EVENTS];
+	vector<httpd_conn_t *> conns;
+	httpd_conn_t	  *conn;
+	vmem_t			   frame;
+	Node			  *function;
+	ulong			   now,
+					   sweep = httpd_now();
+	int				   epfd, n, i, fd;
+	size_t			   c;
+	bool			   alive;
+
+	pthread_mutex_lock( &__httpd_sync_mutex );
+	pthread_mutex_unlock( &__httpd_sync_mutex );
+
+	function = server->vm->vcode.get( (char *)server->handler.c_str() );
+	/*
+	 * Make the frame a gc root, so objects pushed on it with push_tmp
+	 * (the request map and the handler result) are marked by any
+	 * collection, whichever thread runs it. Objects not pushed yet are
+	 * not protected.
+	 */
+	gc_add_root( &frame );
+
+	epfd = epoll_create1( EPOLL_CLOEXEC );
+
+	ev.events  = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.fd = server->lsd;
+	epoll_ctl( epfd, EPOLL_CTL_ADD, server->lsd, &ev );
+
+	ev.events  = EPOLLIN;
+	ev.data.fd = server->stopfd;
+	epoll_ctl( epfd, EPOLL_CTL_ADD, server->stopfd, &ev );
+
+	while( server->running ){
+		n = epoll_wait( epfd, events, HTTPD_MAX_EVENTS, 1000 );
+
+		for( i = 0; i < n; ++i ){
+			fd = events[i].data.fd;
+
+			if( fd == server->lsd ){
+				httpd_accept( epfd, fd, conns );
+				continue;
+			}
+			else if( fd == server->stopfd ){
+				continue;
+			}
+			else if( (conn = conns[fd]) == NULL ){
+				continue;
+			}
+
+			conn->last = httpd_now();
+
+			if( events[i].events & EPOLLOUT ){
+				alive = httpd_flush( epfd, conn );
+				/*
+				 * Flushed, serve what was pipelined meanwhile.
+				 */
+				if( alive && conn->obuf.empty() ){
+					alive = httpd_process( server, &frame, function, epfd, conn );
+				}
+			}
+			else if( events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ){
+				alive = httpd_read( conn );
+				/*
+				 * A client may half close after sending its requests.
+				 */
+				if( conn->iend > conn->istart ){
+					alive = httpd_process( server, &frame, function, epfd, conn ) && alive;
+				}
+				if( !alive && conn->obuf.size() > conn->osent ){
+					conn->closing = true;
+					alive		  = httpd_flush( epfd, conn );
+				}
+			}
+			else{
+				alive = true;
+			}
+
+			if( !alive ){
+				httpd_conn_close( epfd, conns, conn );
+			}
+		}
+		/*
+		 * Drop idle keep-alive connections.
+		 */
+		if( (now = httpd_now()) - sweep >= 1000 ){
+			for( c = 0; c < conns.size(); ++c ){
+				if( conns[c] && now - conns[c]->last > HTTPD_IDLE_TIMEOUT ){
+					httpd_conn_close( epfd, conns, conns[c] );
+				}
+			}
+			sweep = now;
+		}
+	}
+
+	for( c = 0; c < conns.size(); ++c ){
+		if( conns[c] ){
+			httpd_conn_close( epfd, conns, conns[c] );
+		}
+	}
+
+	close( epfd );
+
+	gc_remove_root( &frame );
+
+	vm_depool( server->vm );
+
+	return NULL;
+}
+
+static void httpd_server_release( httpd_server_t *server ){
+	if( server->lsd >= 0 ){
+		close( server->lsd );
+		close( server->stopfd );
+
+		server->lsd	   =
+		server->stopfd = -1;
+	}
+}
+
+static void httpd_finalize( void *value ){
+	httpd_server_release( (httpd_server_t *)value );
+
+	delete (httpd_server_t *)value;
+}
+/*
+ * Create a listening socket, return its server handle or false.
+ */
+HYBRIS_DEFINE_FUNCTION(hhttpd_listen){
+	long   port,
+		   backlog = 1024;
+	string address = "0.0.0.0";
+	int	   sd,
+		   one = 1;
+
+	vm_parse_argv( "lsl", &port, &address, &backlog );
+
+	struct sockaddr_in addr;
+
+	bzero( &addr, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_port	= htons(port);
+
+	if( inet_pton( AF_INET, address.c_str(), &addr.sin_addr ) != 1 ){
+		return vm_raise_exception( "invalid address '%s'", address.c_str() );
+	}
+
+	if( (sd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 )) < 0 ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	setsockopt( sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+
+	if( bind( sd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 || listen( sd, backlog ) < 0 ){
+		close(sd);
+		return (Object *)gc_new_boolean(false);
+	}
+
+	httpd_server_t *server = new httpd_server_t;
+
+	server->lsd		 = sd;
+	server->stopfd	 = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	server->running	 = false;
+	server->vm		 = vm;
+	server->data	 = NULL;
+	server->workers	 = NULL;
+	server->nworkers = 0;
+
+	Handle *handle = gc_new_handle(server);
+
+	handle_set_finalizer( handle, httpd_finalize );
+
+	return (Object *)handle;
+}
+/*
+ * Serve requests with 'workers' threads (one per cpu if not given or 0)
+ * until httpd_stop is called, each request is passed to handler( request ),
+ * or handler( request, data ) if data is given.
+ */
+HYBRIS_DEFINE_FUNCTION(hhttpd_serve){
+	Handle *handle;
+	string  handler;
+	Object *cbdata  = NULL;
+	long	workers = 0;
+	uint64_t stops;
+	size_t	i, argc = 0;
+	Node   *function;
+
+	vm_parse_argv( "HslO", &handle, &handler, &workers, &cbdata );
+
+	httpd_server_t *server = httpd_server_ucast(handle);
+
+	if( server->lsd < 0 ){
+		return vm_raise_exception( "serve on a closed http server" );
+	}
+	else if( server->running ){
+		return vm_raise_exception( "http server already running" );
+	}
+	else if( (function = vm->vcode.get( (char *)handler.c_str() )) == H_UNDEFINED ){
+		return vm_raise_exception( "'%s' undeclared user function identifier", handler.c_str() );
+	}
+	/*
+	 * Check the handler signature now rather than on the first request.
+	 */
+	ll_foreach( &function->children, llitem ){
+		if( ll_node( llitem )->type != H_NT_IDENTIFIER ){
+			break;
+		}
+		argc++;
+	}
+
+	if( argc != (cbdata ? 2 : 1) ){
+		return vm_raise_exception( "function '%s' must accept %d parameters", handler.c_str(), cbdata ? 2 : 1 );
+	}
+	/*
+	 * Discard a stop request of a previous run.
+	 */
+	read( server->stopfd, &stops, sizeof(stops) );
+
+	server->handler	 = handler;
+	server->data	 = cbdata;
+	server->nworkers = ( workers > 0 ? workers : sysconf(_SC_NPROCESSORS_ONLN) );
+	server->workers	 = new pthread_t[server->nworkers];
+	server->running	 = true;
+
+	if( cbdata ){
+		data->push_tmp( cbdata );
+	}
+
+	hyb_set_threaded();
+	/*
+	 * Workers will not start until every scope is registered.
+	 */
+	pthread_mutex_lock( &__httpd_sync_mutex );
+
+	for( i = 0; i < server->nworkers; ++i ){
+		if( pthread_create( &server->workers[i], NULL, httpd_worker, (void *)server ) != 0 ){
+			hyb_error( H_ET_GENERIC, "Could not create http server worker %d", i );
+		}
+		vm_pool( vm, server->workers[i] );
+	}
+
+	pthread_mutex_unlock( &__httpd_sync_mutex );
+
+	for( i = 0; i < server->nworkers; ++i ){
+		pthread_join( server->workers[i], NULL );
+	}
+
+	delete[] server->workers;
+
+	server->workers	 = NULL;
+	server->nworkers = 0;
+
+	if( cbdata ){
+		data->remove_tmp( cbdata );
+	}
+
+	return H_DEFAULT_RETURN;
+}
+/*
+ * Make httpd_serve return, it can be called from a handler too.
+ */
+HYBRIS_DEFINE_FUNCTION(hhttpd_stop){
+	Handle  *handle;
+	uint64_t one = 1;
+
+	vm_parse_argv( "H", &handle );
+
+	httpd_server_t *server = httpd_server_ucast(handle);
+
+	server->running = false;
+
+	if( server->stopfd >= 0 ){
+		write( server->stopfd, &one, sizeof(one) );
+	}
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hhttpd_close){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	httpd_server_t *server = httpd_server_ucast(handle);
+
+	if( server->running == false ){
+		httpd_server_release( server );
+	}
+
+	return H_DEFAULT_RETURN;
+}
@@ -24,25 +24,204 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <signal.h>
 #include <hybris.h>
 
+/*
+ * Initial size of the per socket read buffer, it grows when a single
+ * line or record does not fit into it.
+ */
+#define SOCK_RBUF_SIZE 16384
+/*
+ * Default datagram size of recvmmsg buffers and maximum number of
+ * datagrams moved by a single recvmmsg/sendmmsg call.
+ */
+#define SOCK_DGRAM_SIZE 2048
+#define SOCK_MMSG_MAX	64
+
 typedef struct _SocketObject {
 	int sd;
 	int family;
 	int type;
 	int protocol;
+	/*
+	 * Read buffer used by recvline, recv_until and recv_exact, the
+	 * bytes in [rstart,rend) were received but not consumed yet.
+	 * It's allocated upon the first buffered read.
+	 */
+	char  *rbuf;
+	size_t rsize;
+	size_t rstart;
+	size_t rend;
+	/*
+	 * Set by setblocking, non blocking sockets never suspend the
+	 * calling coroutine.
+	 */
+	bool   nonblock;
+	/*
+	 * SO_RCVTIMEO and SO_SNDTIMEO in milliseconds (-1 if not set), so
+	 * a suspended coroutine is woken up when the blocking call would
+	 * have timed out.
+	 */
+	int	   rcvtimeo;
+	int	   sndtimeo;
+	/*
+	 * Set once the peer closed the connection, so that buffered reads
+	 * returning false can be told apart from non blocking ones which
+	 * would have blocked.
+	 */
+	bool   eof;
 
 	_SocketObject( int _sd, int _family, int _type, int _protocol ) :
 		sd(_sd),
 		family(_family),
 		type(_type),
-		protocol(_protocol) {
+		protocol(_protocol),
+		rbuf(NULL),
+		rsize(0),
+		rstart(0),
+		rend(0),
+		nonblock(false),
+		rcvtimeo(-1),
+		sndtimeo(-1),
+		eof(false) {
+
+	}
+
+	~_SocketObject(){
+		if( rbuf ){
+			free(rbuf);
+		}
+	}
 
+	INLINE size_t pending(){
+		return rend - rstart;
 	}
 }
 SocketObject;
 
-#define MK_SOCK(s,f,t,p) gc_new_handle( new SocketObject( s, f, t, p ) )
+/*
+ * Handle finalizer, the descriptor is closed too if the script didn't.
+ */
+static void sock_finalize( void *value ){
+	SocketObject *sobj = (SocketObject *)value;
+
+	if( sobj->sd >= 0 ){
+		close( sobj->sd );
+	}
+
+	delete sobj;
+}
+
+static Handle *sock_new_handle( int sd, int family, int type, int protocol ){
+	Handle *handle = gc_new_handle( new SocketObject( sd, family, type, protocol ) );
+
+	handle_set_finalizer( handle, sock_finalize );
+
+	return handle;
+}
+
+#define MK_SOCK(s,f,t,p) sock_new_handle( s, f, t, p )
+/*
+ * Socket handles are recognized by their finalizer.
+ */
+#define ob_is_socket(o)	 (((Handle *)(o))->finalizer == sock_finalize)
+/*
+ * True if the last operation failed because the socket is in non
+ * blocking mode and it would have blocked.
+ */
+#define SOCK_WOULDBLOCK() ( errno == EAGAIN || errno == EWOULDBLOCK )
+/*
+ * When called from a coroutine, suspend it until the socket is ready
+ * so that the following blocking call returns immediately, otherwise
+ * it's a no-op and the call blocks the thread as usual.
+ * Return false if the socket timeout expired first, with errno set as
+ * the blocking call would have done.
+ */
+static INLINE bool sock_wait( SocketObject *sobj, int events ){
+	if( sobj->nonblock == false && vm_io_wait( sobj->sd, events, events == POLLIN ? sobj->rcvtimeo : sobj->sndtimeo ) == 0 ){
+		errno = EAGAIN;
+		return false;
+	}
+	return true;
+}
+/*
+ * Wait for the socket to be ready even if it's in non blocking mode, for
+ * data that was already taken from somewhere else and has to be sent.
+ * A coroutine is suspended, any other caller polls the descriptor.
+ * Return false if the socket timeout expired first, with errno set to
+ * EAGAIN.
+ */
+static bool sock_wait_ready( SocketObject *sobj, int events ){
+	int timeout = ( events == POLLIN ? sobj->rcvtimeo : sobj->sndtimeo ),
+		ready;
+
+	if( (ready = vm_io_wait( sobj->sd, events, timeout )) < 0 ){
+		struct pollfd pfd = { sobj->sd, (short)events, 0 };
+
+		while( (ready = poll( &pfd, 1, timeout )) < 0 && errno == EINTR );
+	}
+
+	if( ready <= 0 ){
+		errno = EAGAIN;
+		return false;
+	}
+	return true;
+}
+/*
+ * sendfile and splice have no MSG_NOSIGNAL flag, so SIGPIPE is blocked
+ * in the calling thread around them and, if they raised it, consumed
+ * before it's unblocked; a closed peer then gives EPIPE as send does.
+ * The signal is blocked only around the syscall since sock_wait could
+ * let other coroutines run on this thread.
+ */
+typedef struct {
+	sigset_t mask;
+	bool	 pending;
+}
+sock_sigpipe_t;
+
+static INLINE void sock_sigpipe_block( sock_sigpipe_t *state ){
+	sigset_t sigpipe, pending;
+
+	sigemptyset( &sigpipe );
+	sigaddset( &sigpipe, SIGPIPE );
+	/*
+	 * A SIGPIPE that was already pending is not ours to consume.
+	 */
+	sigpending( &pending );
+	state->pending = sigismember( &pending, SIGPIPE );
+
+	pthread_sigmask( SIG_BLOCK, &sigpipe, &state->mask );
+}
+
+static INLINE void sock_sigpipe_unblock( sock_sigpipe_t *state, bool raised ){
+	static const struct timespec nowait = { 0, 0 };
+	sigset_t sigpipe;
+	int		 error = errno;
+
+	if( raised && state->pending == false ){
+		sigemptyset( &sigpipe );
+		sigaddset( &sigpipe, SIGPIPE );
+
+		while( sigtimedwait( &sigpipe, NULL, &nowait ) < 0 && errno == EINTR );
+	}
+
+	pthread_sigmask( SIG_SETMASK, &state->mask, NULL );
+
+	errno = error;
+}
+/*
+ * Keep track of the timeout (in microseconds) given to settimeout,
+ * connect or server, 0 means no timeout.
+ */
+static INLINE void sock_set_timeout( SocketObject *sobj, long timeout ){
+	sobj->rcvtimeo =
+	sobj->sndtimeo = ( timeout > 0 ? (timeout + 999) / 1000 : -1 );
+}
 
 HYBRIS_DEFINE_FUNCTION(hsocket);
 HYBRIS_DEFINE_FUNCTION(hbind);
@@ -56,6 +235,17 @@ HYBRIS_DEFINE_FUNCTION(hserver);
 HYBRIS_DEFINE_FUNCTION(hrecv);
 HYBRIS_DEFINE_FUNCTION(hsend);
 HYBRIS_DEFINE_FUNCTION(hclose);
+HYBRIS_DEFINE_FUNCTION(hrecvline);
+HYBRIS_DEFINE_FUNCTION(hrecv_until);
+HYBRIS_DEFINE_FUNCTION(hrecv_exact);
+HYBRIS_DEFINE_FUNCTION(hfileno);
+HYBRIS_DEFINE_FUNCTION(hsetblocking);
+HYBRIS_DEFINE_FUNCTION(hrecv_eof);
+HYBRIS_DEFINE_FUNCTION(hsendfile);
+HYBRIS_DEFINE_FUNCTION(hsplice);
+HYBRIS_DEFINE_FUNCTION(hrecv_into);
+HYBRIS_DEFINE_FUNCTION(hrecvmmsg);
+HYBRIS_DEFINE_FUNCTION(hsendmmsg);
 
 HYBRIS_EXPORTED_FUNCTIONS() {
 	{ "socket", 	 hsocket,      H_REQ_ARGC(2),   { H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
@@ -70,6 +260,17 @@ HYBRIS_EXPORTED_FUNCTIONS() {
 	{ "recv", 	     hrecv,        H_REQ_ARGC(2,3), { H_REQ_TYPES(otHandle), H_ANY_TYPE, H_REQ_TYPES(otInteger) } },
 	{ "send", 		 hsend,        H_REQ_ARGC(2,3), { H_REQ_TYPES(otHandle), H_ANY_TYPE, H_REQ_TYPES(otInteger) } },
 	{ "close", 		 hclose,       H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "recvline",    hrecvline,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "recv_until",  hrecv_until,  H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString,otChar) } },
+	{ "recv_exact",  hrecv_exact,  H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "fileno",      hfileno,      H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "setblocking", hsetblocking, H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otBoolean) } },
+	{ "recv_eof",    hrecv_eof,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "sendfile",    hsendfile,    H_REQ_ARGC(2,4), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otHandle,otString), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
+	{ "splice",      hsplice,      H_REQ_ARGC(2,3), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "recv_into",   hrecv_into,   H_REQ_ARGC(2,4), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otString,otBinary), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
+	{ "recvmmsg",    hrecvmmsg,    H_REQ_ARGC(2,5), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otVector), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger), H_REQ_TYPES(otVector) } },
+	{ "sendmmsg",    hsendmmsg,    H_REQ_ARGC(2,3), { H_REQ_TYPES(otHandle), H_REQ_TYPES(otVector), H_REQ_TYPES(otVector) } },
 	{ "", NULL }
 };
 
@@ -130,6 +331,148 @@ extern "C" void hybris_module_init( vm_t * vm ){
 	HYBRIS_DEFINE_CONSTANT( vm, "SOCK_NONBLOCK", gc_new_integer(SOCK_NONBLOCK) );
 }
 
+/*
+ * Receive as much data as the read buffer can hold, compacting
+ * or growing it if needed.
+ * Return the number of bytes received, 0 on EOF or -1 on error.
+ */
+static ssize_t sock_fill( SocketObject *sobj ){
+	ssize_t rd;
+
+	if( sobj->rbuf == NULL ){
+		sobj->rsize = SOCK_RBUF_SIZE;
+		sobj->rbuf  = (char *)malloc( sobj->rsize );
+	}
+	/*
+	 * Move pending bytes to the beginning of the buffer.
+	 */
+	else if( sobj->rstart > 0 ){
+		memmove( sobj->rbuf, sobj->rbuf + sobj->rstart, sobj->pending() );
+		sobj->rend  -= sobj->rstart;
+		sobj->rstart = 0;
+	}
+	/*
+	 * Still full, a single record is bigger than the buffer.
+	 */
+	if( sobj->rend == sobj->rsize ){
+		sobj->rsize *= 2;
+		sobj->rbuf   = (char *)realloc( sobj->rbuf, sobj->rsize );
+	}
+
+	if( sock_wait( sobj, POLLIN ) == false ){
+		return -1;
+	}
+
+	do{
+		rd = recv( sobj->sd, sobj->rbuf + sobj->rend, sobj->rsize - sobj->rend, 0 );
+	}
+	while( rd < 0 && errno == EINTR );
+
+	if( rd > 0 ){
+		sobj->rend += rd;
+	}
+	else if( rd == 0 ){
+		sobj->eof = true;
+	}
+
+	return rd;
+}
+/*
+ * Find the first occurrence of 'delim' inside 'data', memchr and memmem
+ * are vectorized by the libc, so this scans a word or more per step.
+ */
+static INLINE const char *sock_scan( const char *data, size_t size, const char *delim, size_t dlen ){
+	if( dlen == 1 ){
+		return (const char *)memchr( data, delim[0], size );
+	}
+	return (const char *)memmem( data, size, delim, dlen );
+}
+/*
+ * Buffer data until 'delim' is found and return the size of the record
+ * delimiter included, or the number of pending bytes if the connection
+ * was closed before the delimiter was received.
+ * On a non blocking socket with an incomplete record, 0 is returned and
+ * the data stays buffered for the next call.
+ */
+static size_t sock_read_until( SocketObject *sobj, const char *delim, size_t dlen ){
+	size_t 		pending,
+				scanned = 0;
+	ssize_t		rd;
+	const char *base,
+			   *found;
+
+	for(;;){
+		pending = sobj->pending();
+		if( pending >= dlen ){
+			base  = sobj->rbuf + sobj->rstart;
+			found = sock_scan( base + scanned, pending - scanned, delim, dlen );
+			if( found ){
+				return (found - base) + dlen;
+			}
+			/*
+			 * The delimiter could be split between this chunk and the
+			 * next one, so do not skip its last dlen - 1 bytes.
+			 */
+			scanned = pending - (dlen - 1);
+		}
+		if( (rd = sock_fill(sobj)) <= 0 ){
+			return ( rd < 0 && SOCK_WOULDBLOCK() ? 0 : sobj->pending() );
+		}
+	}
+}
+/*
+ * Buffer data until 'size' bytes are available and return 'size', or the
+ * number of pending bytes if the connection was closed before.
+ */
+static size_t sock_read_exact( SocketObject *sobj, size_t size ){
+	ssize_t rd;
+
+	while( sobj->pending() < size ){
+		if( (rd = sock_fill(sobj)) <= 0 ){
+			return ( rd < 0 && SOCK_WOULDBLOCK() ? 0 : sobj->pending() );
+		}
+	}
+	return size;
+}
+/*
+ * Receive something if the buffer is empty, then return up to 'size'
+ * pending bytes.
+ */
+static size_t sock_read_some( SocketObject *sobj, size_t size ){
+	if( sobj->pending() == 0 && sock_fill(sobj) <= 0 ){
+		return 0;
+	}
+	return (sobj->pending() < size ? sobj->pending() : size);
+}
+/*
+ * Mark 'size' bytes as consumed.
+ */
+static INLINE void sock_consume( SocketObject *sobj, size_t size ){
+	sobj->rstart += size;
+	if( sobj->rstart == sobj->rend ){
+		sobj->rstart = sobj->rend = 0;
+	}
+}
+/*
+ * Create a string from the first 'size' pending bytes and consume them,
+ * or return false if there's nothing to read.
+ */
+static Object *sock_consume_string( SocketObject *sobj, size_t size ){
+	if( size == 0 ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	String *str = gc_new_string("");
+
+	str->value.assign( sobj->rbuf + sobj->rstart, size );
+	str->items = size;
+	ob_update_footprint( (Object *)str );
+
+	sock_consume( sobj, size );
+
+	return (Object *)str;
+}
+
 HYBRIS_DEFINE_FUNCTION(hsocket){
 	int domain,
 		type;
@@ -199,13 +542,24 @@ HYBRIS_DEFINE_FUNCTION(haccept){
 	SocketObject *sobj = (SocketObject *)handle->value;
 	int			  csd  = -1;
 
+	if( sock_wait( sobj, POLLIN ) == false ){
+		return (Object *)gc_new_boolean(false);
+	}
+
 	csd = accept( sobj->sd, NULL, NULL );
 
 	if( csd <= 0 ){
 		return (Object *)gc_new_boolean(false);
 	}
 	else{
-		return  ob_dcast( MK_SOCK( csd, sobj->family, sobj->type, sobj->protocol ) );
+		Handle *client = MK_SOCK( csd, sobj->family, sobj->type, sobj->protocol );
+		/*
+		 * Accepted sockets inherit the timeouts of the listening one.
+		 */
+		((SocketObject *)client->value)->rcvtimeo = sobj->rcvtimeo;
+		((SocketObject *)client->value)->sndtimeo = sobj->sndtimeo;
+
+		return ob_dcast( client );
 	}
 }
 
@@ -302,9 +656,60 @@ HYBRIS_DEFINE_FUNCTION(hsettimeout){
 	setsockopt( sobj->sd, SOL_SOCKET, SO_SNDTIMEO, &tout, sizeof(tout) );
 	setsockopt( sobj->sd, SOL_SOCKET, SO_RCVTIMEO, &tout, sizeof(tout) );
 
+	sock_set_timeout( sobj, timeout );
+
 	return H_DEFAULT_RETURN;
 }
 
+HYBRIS_DEFINE_FUNCTION(hfileno){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	return (Object *)gc_new_integer( ((SocketObject *)handle->value)->sd );
+}
+/*
+ * In non blocking mode accept returns false, recv_* functions return
+ * false leaving partial records buffered and send returns -1 when the
+ * operation would block.
+ */
+HYBRIS_DEFINE_FUNCTION(hsetblocking){
+	Handle *handle;
+	bool	blocking;
+
+	vm_parse_argv( "Hb", &handle, &blocking );
+
+	SocketObject *sobj  = (SocketObject *)handle->value;
+	int			  flags = fcntl( sobj->sd, F_GETFL, 0 );
+
+	if( flags < 0 ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	flags = ( blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK );
+
+	if( fcntl( sobj->sd, F_SETFL, flags ) != 0 ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	sobj->nonblock = !blocking;
+
+	return (Object *)gc_new_boolean(true);
+}
+/*
+ * True if the peer closed the connection and every buffered byte was
+ * consumed.
+ */
+HYBRIS_DEFINE_FUNCTION(hrecv_eof){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	SocketObject *sobj = (SocketObject *)handle->value;
+
+	return (Object *)gc_new_boolean( sobj->eof && sobj->pending() == 0 );
+}
+
 HYBRIS_DEFINE_FUNCTION(hconnect){
 	char *servername;
 	int	  port,
@@ -338,7 +743,11 @@ HYBRIS_DEFINE_FUNCTION(hconnect){
 		return (Object *)gc_new_boolean(false);
 	}
 
-    return (Object *)MK_SOCK( sd, AF_INET, SOCK_STREAM, 0 );
+	Handle *handle = MK_SOCK( sd, AF_INET, SOCK_STREAM, 0 );
+
+	sock_set_timeout( (SocketObject *)handle->value, timeout );
+
+    return (Object *)handle;
 }
 
 HYBRIS_DEFINE_FUNCTION(hserver){
@@ -372,7 +781,11 @@ HYBRIS_DEFINE_FUNCTION(hserver){
 		return (Object *)gc_new_boolean(false);
 	}
 
-    return (Object *)MK_SOCK( sd, AF_INET, SOCK_STREAM, 0 );
+	Handle *handle = MK_SOCK( sd, AF_INET, SOCK_STREAM, 0 );
+
+	sock_set_timeout( (SocketObject *)handle->value, timeout );
+
+    return (Object *)handle;
 }
 
 HYBRIS_DEFINE_FUNCTION(hrecv){
@@ -382,9 +795,49 @@ HYBRIS_DEFINE_FUNCTION(hrecv){
 
 	vm_parse_argv( "HOi", &handle, &object, &size );
 
-	int sd  = ((SocketObject *)handle->value)->sd;
+	SocketObject *sobj = (SocketObject *)handle->value;
+	size_t 		  rd;
+	/*
+	 * Strings and chars are served from the read buffer, so a line
+	 * costs one recv per buffer fill instead of one per byte.
+	 */
+	if( ob_is_string(object) ){
+		rd = ( size ? sock_read_some( sobj, size ) : sock_read_until( sobj, "\n", 1 ) );
+		/*
+		 * As string_from_fd did, a sized read leaves the string as it
+		 * is on EOF or timeout, a line read always resets it.
+		 */
+		if( rd > 0 || size == 0 ){
+			ob_string_val(object).assign( sobj->rbuf ? sobj->rbuf + sobj->rstart : "", rd );
+			ob_string_ucast(object)->items = rd;
+			ob_update_footprint(object);
+
+			sock_consume( sobj, rd );
+		}
+
+		return ob_dcast( gc_new_integer(rd) );
+	}
+	else if( ob_is_char(object) ){
+		if( (rd = sock_read_some( sobj, 1 )) ){
+			ob_char_ucast(object)->value = sobj->rbuf[sobj->rstart];
+			sock_consume( sobj, 1 );
+		}
+
+		return ob_dcast( gc_new_integer(rd) );
+	}
+	/*
+	 * Other types read straight from the descriptor, which would
+	 * skip what is already buffered.
+	 */
+	else if( sobj->pending() ){
+		return vm_raise_exception( "%d buffered bytes pending, consume them with a string recv, recvline, recv_until or recv_exact first", sobj->pending() );
+	}
+
+	if( sock_wait( sobj, POLLIN ) == false ){
+		return (Object *)gc_new_integer(0);
+	}
 
-	return ob_from_fd( object, sd, size );
+	return ob_from_fd( object, sobj->sd, size );
 }
 
 HYBRIS_DEFINE_FUNCTION(hsend){
@@ -394,9 +847,13 @@ HYBRIS_DEFINE_FUNCTION(hsend){
 
 	vm_parse_argv( "HOi", &handle, &object, &size );
 
-	int sd  = ((SocketObject *)handle->value)->sd;
+	SocketObject *sobj = (SocketObject *)handle->value;
 
-	return ob_to_fd( object, sd, size );
+	if( sock_wait( sobj, POLLOUT ) == false ){
+		return (Object *)gc_new_integer(0);
+	}
+
+	return ob_to_fd( object, sobj->sd, size );
 }
 
 HYBRIS_DEFINE_FUNCTION(hclose){
@@ -404,11 +861,640 @@ HYBRIS_DEFINE_FUNCTION(hclose){
 
 	vm_parse_argv( "H", &handle );
 
-	if( handle->value ){
-		close( ((SocketObject *)handle->value)->sd );
-
-		handle->value = NULL;
+	SocketObject *sobj = (SocketObject *)handle->value;
+	/*
+	 * Other handle clones may still refer to the structure, which is
+	 * deleted by sock_finalize, just release the descriptor and the
+	 * read buffer.
+	 */
+	if( sobj && sobj->sd >= 0 ){
+		close( sobj->sd );
+
+		if( sobj->rbuf ){
+			free( sobj->rbuf );
+		}
+
+		sobj->sd	 = -1;
+		sobj->rbuf   = NULL;
+		sobj->rsize  =
+		sobj->rstart =
+		sobj->rend   = 0;
 	}
 
     return H_DEFAULT_RETURN;
 }
+
+HYBRIS_DEFINE_FUNCTION(hrecvline){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	SocketObject *sobj = (SocketObject *)handle->value;
+
+	return sock_consume_string( sobj, sock_read_until( sobj, "\n", 1 ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hrecv_until){
+	Handle *handle;
+	string  delim;
+
+	vm_parse_argv( "Hs", &handle, &delim );
+
+	SocketObject *sobj = (SocketObject *)handle->value;
+
+	if( delim.size() == 0 ){
+		return vm_raise_exception( "recv_until delimiter can not be empty" );
+	}
+
+	return sock_consume_string( sobj, sock_read_until( sobj, delim.c_str(), delim.size() ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hrecv_exact){
+	Handle *handle;
+	long	size;
+
+	vm_parse_argv( "Hl", &handle, &size );
+
+	SocketObject *sobj = (SocketObject *)handle->value;
+
+	if( size <= 0 ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	return sock_consume_string( sobj, sock_read_exact( sobj, size ) );
+}
+/*
+ * Send 'size' bytes of a buffer handling partial writes, used to flush
+ * what the read buffer holds before handing the descriptor to the kernel.
+ */
+static bool sock_send_all( SocketObject *sobj, const char *data, size_t size ){
+	ssize_t wr;
+
+	while( size > 0 ){
+		if( sock_wait( sobj, POLLOUT ) == false ){
+			return false;
+		}
+		if( (wr = send( sobj->sd, data, size, MSG_NOSIGNAL )) < 0 ){
+			if( errno == EINTR ){
+				continue;
+			}
+			else if( SOCK_WOULDBLOCK() && sock_wait_ready( sobj, POLLOUT ) ){
+				continue;
+			}
+			return false;
+		}
+		data += wr;
+		size -= wr;
+	}
+	return true;
+}
+/*
+ * Send 'count' bytes (or up to the end of the file if 0) of a file starting
+ * at 'offset' with sendfile, the data goes from the page cache to the
+ * socket without passing through user space nor creating any object.
+ * 'file' is either a path or a handle returned by fopen, whose position
+ * is left untouched.
+ * Return the number of bytes sent, which is less than requested on a non
+ * blocking socket that would block.
+ */
+HYBRIS_DEFINE_FUNCTION(hsendfile){
+	Handle *handle;
+	Object *file;
+	long	offset = 0,
+			count  = 0;
+
+	vm_parse_argv( "HOll", &handle, &file, &offset, &count );
+
+	if( !ob_is_socket(handle) ){
+		return vm_raise_exception( "sendfile requires a socket handle" );
+	}
+
+	SocketObject  *sobj = (SocketObject *)handle->value;
+	sock_sigpipe_t sigpipe;
+	struct stat    st;
+	off_t		   off  = offset;
+	size_t		   sent = 0;
+	ssize_t		   wr;
+	int			   fd;
+
+	if( ob_is_string(file) ){
+		if( (fd = open( ob_string_val(file).c_str(), O_RDONLY )) < 0 ){
+			return vm_raise_exception( "could not open '%s' : %s", ob_string_val(file).c_str(), strerror(errno) );
+		}
+	}
+	/*
+	 * Handles returned by fopen are the only ones without a finalizer,
+	 * anything else (a socket, a buffered reader, ...) is not a FILE.
+	 */
+	else if( ((Handle *)file)->finalizer != NULL ){
+		return vm_raise_exception( "sendfile requires a path or a handle returned by fopen" );
+	}
+	else if( ob_handle_val(file) != NULL ){
+		FILE *fp = (FILE *)ob_handle_val(file);
+		/*
+		 * Pending stdio writes must reach the file before the kernel
+		 * reads it.
+		 */
+		fflush( fp );
+		fd = fileno( fp );
+	}
+	else{
+		return vm_raise_exception( "sendfile on a closed file" );
+	}
+
+	if( count <= 0 ){
+		if( fstat( fd, &st ) == 0 && st.st_size > offset ){
+			count = st.st_size - offset;
+		}
+		else{
+			count = 0;
+		}
+	}
+
+	while( sent < (size_t)count ){
+		if( sock_wait( sobj, POLLOUT ) == false ){
+			break;
+		}
+
+		sock_sigpipe_block( &sigpipe );
+		wr = sendfile( sobj->sd, fd, &off, count - sent );
+		sock_sigpipe_unblock( &sigpipe, wr < 0 && errno == EPIPE );
+
+		if( wr <= 0 ){
+			if( wr < 0 && errno == EINTR ){
+				continue;
+			}
+			break;
+		}
+		sent += wr;
+	}
+
+	if( ob_is_string(file) ){
+		close(fd);
+	}
+
+	return (Object *)gc_new_integer(sent);
+}
+/*
+ * Close the pipe of a splice call and return the number of bytes forwarded.
+ */
+static INLINE Object *sock_splice_done( int *pipefd, size_t done ){
+	close( pipefd[0] );
+	close( pipefd[1] );
+
+	return (Object *)gc_new_integer(done);
+}
+/*
+ * Forward up to 'count' bytes (or everything up to EOF if 0) from one socket
+ * to another, bytes already buffered by the source are sent first, the
+ * rest goes socket -> pipe -> socket with splice and never reaches user
+ * space.
+ * Every call has its own pipe, since sock_wait could suspend the calling
+ * coroutine and let another one splice on the same thread meanwhile.
+ * Return the number of bytes forwarded.
+ */
+HYBRIS_DEFINE_FUNCTION(hsplice){
+	Handle *hfrom,
+		   *hto;
+	long	count = 0;
+
+	vm_parse_argv( "HHl", &hfrom, &hto, &count );
+
+	if( !ob_is_socket(hfrom) || !ob_is_socket(hto) ){
+		return vm_raise_exception( "splice requires two socket handles" );
+	}
+
+	SocketObject  *from = (SocketObject *)hfrom->value,
+				  *to   = (SocketObject *)hto->value;
+	sock_sigpipe_t sigpipe;
+	size_t		   done = 0,
+				   chunk,
+				   left;
+	ssize_t		   in,
+				   out;
+	int			   pipefd[2];
+
+	if( from->pending() ){
+		chunk = from->pending();
+		if( count > 0 && chunk > (size_t)count ){
+			chunk = count;
+		}
+
+		if( sock_send_all( to, from->rbuf + from->rstart, chunk ) == false ){
+			return (Object *)gc_new_integer(0);
+		}
+		sock_consume( from, chunk );
+		done += chunk;
+	}
+
+	if( pipe2( pipefd, O_CLOEXEC ) != 0 ){
+		return vm_raise_exception( "could not create the splice pipe : %s", strerror(errno) );
+	}
+
+	while( count <= 0 || done < (size_t)count ){
+		chunk = ( count > 0 ? count - done : SOCK_RBUF_SIZE * 4 );
+
+		if( sock_wait( from, POLLIN ) == false ){
+			break;
+		}
+
+		in = splice( from->sd, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE | (from->nonblock ? SPLICE_F_NONBLOCK : 0) );
+		if( in < 0 && errno == EINTR ){
+			continue;
+		}
+		else if( in <= 0 ){
+			break;
+		}
+		/*
+		 * Whatever entered the pipe must leave it, even if the destination
+		 * is a non blocking socket.
+		 */
+		for( left = in; left > 0; ){
+			if( sock_wait( to, POLLOUT ) == false ){
+				return sock_splice_done( pipefd, done + in - left );
+			}
+
+			sock_sigpipe_block( &sigpipe );
+			out = splice( pipefd[0], NULL, to->sd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE );
+			sock_sigpipe_unblock( &sigpipe, out < 0 && errno == EPIPE );
+
+			if( out < 0 ){
+				if( errno == EINTR ){
+					continue;
+				}
+				/*
+				 * A non blocking destination is full, suspend the coroutine
+				 * (or poll) until it drains instead of dropping the data.
+				 */
+				else if( SOCK_WOULDBLOCK() && sock_wait_ready( to, POLLOUT ) ){
+					continue;
+				}
+
+				return sock_splice_done( pipefd, done + in - left );
+			}
+			left -= out;
+		}
+		done += in;
+	}
+
+	return sock_splice_done( pipefd, done );
+}
+/*
+ * Receive up to 'max' bytes (the buffer size minus 'offset' if 0) and
+ * store them at 'offset' in the given string or binary, which is resized
+ * to offset + received bytes, so a buffer can be reused across calls
+ * without creating new objects.
+ * Return the number of bytes received, 0 on EOF or if a non blocking
+ * socket would block.
+ */
+HYBRIS_DEFINE_FUNCTION(hrecv_into){
+	Handle *handle;
+	Object *buffer;
+	long	offset = 0,
+			max	   = 0;
+
+	vm_parse_argv( "HOll", &handle, &buffer, &offset, &max );
+
+	SocketObject *sobj = (SocketObject *)handle->value;
+	ssize_t		  rd   = -1;
+
+	if( offset < 0 ){
+		return vm_raise_exception( "invalid negative offset %ld", offset );
+	}
+	else if( max <= 0 ){
+		max = ob_get_size(buffer) > (size_t)offset ? ob_get_size(buffer) - offset : SOCK_RBUF_SIZE;
+	}
+	/*
+	 * Buffered bytes first, they were already received by a buffered
+	 * read and must not be skipped.
+	 */
+	if( sobj->pending() ){
+		rd = ( sobj->pending() < (size_t)max ? sobj->pending() : max );
+
+		if( ob_is_string(buffer) ){
+			string& value = ob_string_val(buffer);
+
+			value.resize( offset );
+			value.append( sobj->rbuf + sobj->rstart, rd );
+		}
+		else{
+			binary_set_bytes( buffer, offset, sobj->rbuf + sobj->rstart, rd );
+		}
+
+		sock_consume( sobj, rd );
+	}
+	else if( ob_is_string(buffer) ){
+		string& value = ob_string_val(buffer);
+
+		value.resize( offset + max );
+
+		if( sock_wait( sobj, POLLIN ) ){
+			while( (rd = recv( sobj->sd, &value[offset], max, 0 )) < 0 && errno == EINTR );
+		}
+
+		value.resize( offset + (rd > 0 ? rd : 0) );
+	}
+	else{
+		/*
+		 * Binaries are vectors of objects, receive into a scratch
+		 * buffer kept by the thread and copy the bytes in place.
+		 */
+		static __thread string *scratch = NULL;
+
+		if( scratch == NULL ){
+			scratch = new string;
+		}
+		scratch->resize( max );
+
+		if( sock_wait( sobj, POLLIN ) ){
+			while( (rd = recv( sobj->sd, &(*scratch)[0], max, 0 )) < 0 && errno == EINTR );
+		}
+
+		binary_set_bytes( buffer, offset, scratch->data(), rd > 0 ? rd : 0 );
+	}
+
+	rd = ( rd > 0 ? rd : 0 );
+
+	if( ob_is_string(buffer) ){
+		ob_string_ucast(buffer)->items = ob_string_val(buffer).size();
+		ob_update_footprint(buffer);
+	}
+
+	return (Object *)gc_new_integer(rd);
+}
+/*
+ * Store the numeric address of 'addr' into 'ipstr' and return its port.
+ */
+static int sock_addr_format( struct sockaddr_storage *addr, char *ipstr ){
+	if( addr->ss_family == AF_INET ){
+		struct sockaddr_in *s = (struct sockaddr_in *)addr;
+		inet_ntop( AF_INET, &s->sin_addr, ipstr, INET6_ADDRSTRLEN );
+		return ntohs(s->sin_port);
+	}
+	else {
+		struct sockaddr_in6 *s = (struct sockaddr_in6 *)addr;
+		inet_ntop( AF_INET6, &s->sin6_addr, ipstr, INET6_ADDRSTRLEN );
+		return ntohs(s->sin6_port);
+	}
+}
+/*
+ * Create an [ address, port ] vector from a socket address.
+ */
+static Object *sock_addr_pack( struct sockaddr_storage *addr ){
+	Vector *pair = gc_new_vector();
+	char	ipstr[INET6_ADDRSTRLEN] = {0};
+	int		port = sock_addr_format( addr, ipstr );
+
+	ob_cl_push_reference( (Object *)pair, (Object *)gc_new_string(ipstr) );
+	ob_cl_push_reference( (Object *)pair, (Object *)gc_new_integer(port) );
+
+	return (Object *)pair;
+}
+/*
+ * Store a socket address into an existing [ address, port ] vector,
+ * return false if 'pair' does not have that shape.
+ */
+static bool sock_addr_repack( Object *pair, struct sockaddr_storage *addr ){
+	if( !ob_is_vector(pair) || ob_vector_ucast(pair)->value.size() < 2 ){
+		return false;
+	}
+
+	Object *address = ob_vector_ucast(pair)->value[0],
+		   *port	= ob_vector_ucast(pair)->value[1];
+	char	ipstr[INET6_ADDRSTRLEN] = {0};
+
+	if( !ob_is_string(address) || !ob_is_int(port) ){
+		return false;
+	}
+
+	ob_int_val(port) = sock_addr_format( addr, ipstr );
+
+	ob_string_val(address).assign( ipstr );
+	ob_string_ucast(address)->items = ob_string_val(address).size();
+	ob_update_footprint(address);
+
+	return true;
+}
+/*
+ * Fill 'addr' from an [ address, port ] vector with a numeric IPv4 or
+ * IPv6 address, no name resolution is done for every datagram.
+ * Return the length of the address or 0 if the vector is not valid.
+ */
+static socklen_t sock_addr_unpack( Object *pair, struct sockaddr_storage *addr ){
+	if( !ob_is_vector(pair) || ob_vector_ucast(pair)->value.size() < 2 ){
+		return 0;
+	}
+
+	Object *address = ob_vector_ucast(pair)->value[0],
+		   *port	= ob_vector_ucast(pair)->value[1];
+
+	if( !ob_is_string(address) || !ob_is_int(port) || ob_int_val(port) < 0 || ob_int_val(port) > 0xffff ){
+		return 0;
+	}
+
+	memset( addr, 0x00, sizeof(struct sockaddr_storage) );
+
+	struct sockaddr_in  *s4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *s6 = (struct sockaddr_in6 *)addr;
+
+	if( inet_pton( AF_INET, ob_string_val(address).c_str(), &s4->sin_addr ) == 1 ){
+		s4->sin_family = AF_INET;
+		s4->sin_port   = htons( ob_int_val(port) );
+
+		return sizeof(struct sockaddr_in);
+	}
+	else if( inet_pton( AF_INET6, ob_string_val(address).c_str(), &s6->sin6_addr ) == 1 ){
+		s6->sin6_family = AF_INET6;
+		s6->sin6_port   = htons( ob_int_val(port) );
+
+		return sizeof(struct sockaddr_in6);
+	}
+
+	return 0;
+}
+/*
+ * Receive up to 'count' datagrams (the size of 'packets' if 0) with a single
+ * recvmmsg call, each one is stored in the string at the same index of the
+ * 'packets' vector, whose strings are reused and only created when the
+ * vector is too short.
+ * Datagrams longer than 'size' bytes are truncated.
+ * If 'senders' is given, the [ address, port ] of who sent each datagram
+ * is stored at the same index, reusing the vectors already there.
+ * The datagrams are received into a scratch buffer kept by the thread and
+ * only their actual bytes are copied, so the strings are neither zero
+ * filled up to 'size' nor reallocated once they are big enough.
+ * Return the number of datagrams received.
+ */
+HYBRIS_DEFINE_FUNCTION(hrecvmmsg){
+	Handle *handle;
+	Vector *packets,
+		   *senders = NULL;
+	long	count = 0,
+			size  = SOCK_DGRAM_SIZE;
+
+	vm_parse_argv( "HVllV", &handle, &packets, &count, &size, &senders );
+
+	SocketObject  *sobj = (SocketObject *)handle->value;
+	struct mmsghdr msgs[SOCK_MMSG_MAX];
+	struct iovec   iov[SOCK_MMSG_MAX];
+	struct sockaddr_storage addrs[SOCK_MMSG_MAX];
+	Object		  *packet;
+	int			   i, rd = -1;
+
+	static __thread string *scratch = NULL;
+
+	if( count <= 0 ){
+		count = packets->value.size();
+	}
+	if( count > SOCK_MMSG_MAX ){
+		count = SOCK_MMSG_MAX;
+	}
+	if( count == 0 || size <= 0 ){
+		return (Object *)gc_new_integer(0);
+	}
+
+	for( i = 0; i < count; ++i ){
+		if( (size_t)i >= packets->value.size() ){
+			ob_cl_push_reference( (Object *)packets, (Object *)gc_new_string("") );
+		}
+		else if( !ob_is_string( packets->value[i] ) ){
+			ob_cl_set_reference( (Object *)packets, (Object *)gc_new_integer(i), (Object *)gc_new_string("") );
+		}
+	}
+
+	if( sock_wait( sobj, POLLIN ) ){
+		/*
+		 * Nothing between here and the copy below can suspend the
+		 * coroutine, so no other one can use the scratch buffer.
+		 */
+		if( scratch == NULL ){
+			scratch = new string;
+		}
+		if( scratch->size() < (size_t)(count * size) ){
+			scratch->resize( count * size );
+		}
+
+		memset( msgs, 0x00, sizeof(struct mmsghdr) * count );
+
+		for( i = 0; i < count; ++i ){
+			iov[i].iov_base			  = &(*scratch)[i * size];
+			iov[i].iov_len			  = size;
+			msgs[i].msg_hdr.msg_iov	  = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+
+			if( senders != NULL ){
+				msgs[i].msg_hdr.msg_name	= &addrs[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+			}
+		}
+
+		while( (rd = recvmmsg( sobj->sd, msgs, count, 0, NULL )) < 0 && errno == EINTR );
+	}
+
+	for( i = 0; i < count; ++i ){
+		packet = packets->value[i];
+
+		if( i < rd ){
+			ob_string_val(packet).assign( (char *)iov[i].iov_base, msgs[i].msg_len );
+		}
+		else{
+			ob_string_val(packet).clear();
+		}
+		ob_string_ucast(packet)->items = ob_string_val(packet).size();
+		ob_update_footprint(packet);
+	}
+
+	for( i = 0; senders != NULL && i < rd; ++i ){
+		if( (size_t)i >= senders->value.size() ){
+			ob_cl_push_reference( (Object *)senders, sock_addr_pack( &addrs[i] ) );
+		}
+		else if( sock_addr_repack( senders->value[i], &addrs[i] ) == false ){
+			ob_cl_set_reference( (Object *)senders, (Object *)gc_new_integer(i), sock_addr_pack( &addrs[i] ) );
+		}
+	}
+
+	return (Object *)gc_new_integer( rd > 0 ? rd : 0 );
+}
+/*
+ * Send every item of 'packets' as a separate datagram, batching them in
+ * as few sendmmsg calls as possible.
+ * If 'destinations' is given, each datagram is sent to the [ address, port ]
+ * at the same index, otherwise to the connected peer. An invalid destination
+ * raises an exception, the batches before it are sent anyway.
+ * Return the number of datagrams sent.
+ */
+HYBRIS_DEFINE_FUNCTION(hsendmmsg){
+	Handle *handle;
+	Vector *packets,
+		   *destinations = NULL;
+
+	vm_parse_argv( "HVV", &handle, &packets, &destinations );
+
+	SocketObject  *sobj = (SocketObject *)handle->value;
+	struct mmsghdr msgs[SOCK_MMSG_MAX];
+	struct iovec   iov[SOCK_MMSG_MAX];
+	struct sockaddr_storage addrs[SOCK_MMSG_MAX];
+	string		   tmp[SOCK_MMSG_MAX];
+	Object		  *packet;
+	size_t		   n	= packets->value.size(),
+				   sent = 0,
+				   i;
+	int			   batch, wr;
+
+	if( destinations != NULL && destinations->value.size() < n ){
+		return vm_raise_exception( "sendmmsg needs a destination for each of the %d packets", (int)n );
+	}
+
+	while( sent < n ){
+		batch = ( n - sent > SOCK_MMSG_MAX ? SOCK_MMSG_MAX : n - sent );
+
+		memset( msgs, 0x00, sizeof(struct mmsghdr) * batch );
+
+		for( i = 0; i < (size_t)batch; ++i ){
+			packet = packets->value[sent + i];
+			/*
+			 * Strings are sent from their own memory, anything else
+			 * is serialized into a temporary.
+			 */
+			if( ob_is_string(packet) ){
+				iov[i].iov_base = (void *)ob_string_val(packet).data();
+				iov[i].iov_len  = ob_string_val(packet).size();
+			}
+			else{
+				size_t size  = ob_get_size(packet);
+				byte  *bytes = ob_serialize( packet, size );
+
+				tmp[i].assign( (const char *)bytes, size );
+				delete[] bytes;
+
+				iov[i].iov_base = (void *)tmp[i].data();
+				iov[i].iov_len  = tmp[i].size();
+			}
+
+			msgs[i].msg_hdr.msg_iov	   = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+
+			if( destinations != NULL ){
+				socklen_t len = sock_addr_unpack( destinations->value[sent + i], &addrs[i] );
+				if( len == 0 ){
+					return vm_raise_exception( "invalid destination for packet %d, expected a [ numeric address, port ] vector", (int)(sent + i) );
+				}
+
+				msgs[i].msg_hdr.msg_name	= &addrs[i];
+				msgs[i].msg_hdr.msg_namelen = len;
+			}
+		}
+
+		if( sock_wait( sobj, POLLOUT ) == false ){
+			break;
+		}
+		while( (wr = sendmmsg( sobj->sd, msgs, batch, MSG_NOSIGNAL )) < 0 && errno == EINTR );
+
+		if( wr <= 0 ){
+			break;
+		}
+		sent += wr;
+	}
+
+	return (Object *)gc_new_integer(sent);
+}
@@ -0,0 +1,406 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <hybris.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+HYBRIS_DEFINE_FUNCTION(hchannel_create);
+HYBRIS_DEFINE_FUNCTION(hchannel_send);
+HYBRIS_DEFINE_FUNCTION(hchannel_try_send);
+HYBRIS_DEFINE_FUNCTION(hchannel_recv);
+HYBRIS_DEFINE_FUNCTION(hchannel_try_recv);
+HYBRIS_DEFINE_FUNCTION(hchannel_close);
+HYBRIS_DEFINE_FUNCTION(hchannel_size);
+
+HYBRIS_EXPORTED_FUNCTIONS() {
+	{ "channel_create",   hchannel_create,   H_REQ_ARGC(0,1), { H_REQ_TYPES(otInteger) } },
+	{ "channel_send",     hchannel_send,     H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_ANY_TYPE } },
+	{ "channel_try_send", hchannel_try_send, H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_ANY_TYPE } },
+	{ "channel_recv",     hchannel_recv,     H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "channel_try_recv", hchannel_try_recv, H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "channel_close",    hchannel_close,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "channel_size",     hchannel_size,     H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "", NULL }
+};
+
+/*
+ * Bounded multi producer / multi consumer channel.
+ *
+ * The queue is a lock-free ring buffer where each cell carries a
+ * sequence number (D. Vyukov's bounded MPMC queue), so producers and
+ * consumers only synchronize through a CAS on their own position.
+ * Blocking operations sleep on two futex words, 'not_empty' and
+ * 'not_full', which are bumped after each transfer; the futex syscall
+ * is issued only when somebody is actually sleeping.
+ *
+ * Objects are queued by pointer, no clone is made. While inside the
+ * channel they're kept alive by a gc root walker, which visits every
+ * non empty cell of the ring regardless of the positions, since a
+ * consumer advances dequeue_pos before reading the value out of its
+ * cell. The consumer pushes the value on its own frame before clearing
+ * the cell, so the value is never unreachable while in transit.
+ *
+ * Closing a channel only wakes up every waiter and rejects further
+ * sends, the channel itself is released by the handle finalizer once
+ * no script object refers to it anymore.
+ */
+#define HCHANNEL_DEFAULT_CAPACITY 1024
+#define HCHANNEL_MAX_CAPACITY     1048576
+#define HCHANNEL_CACHELINE        64
+
+typedef struct {
+	size_t  seq;
+	Object *value;
+}
+channel_cell_t;
+
+typedef struct {
+	channel_cell_t *cells;
+	size_t          mask;
+	/*
+	 * Producers and consumers positions on separated cache lines
+	 * to avoid false sharing.
+	 */
+	char			pad0[HCHANNEL_CACHELINE];
+	size_t          enqueue_pos;
+	char			pad1[HCHANNEL_CACHELINE];
+	size_t          dequeue_pos;
+	char			pad2[HCHANNEL_CACHELINE];
+	/*
+	 * Futex words and sleepers counters.
+	 */
+	int             not_empty;
+	int             not_full;
+	int             recv_waiters;
+	int             send_waiters;
+	int             closed;
+}
+channel_t;
+
+#define channel_ucast(o) ((channel_t *)ob_handle_val(o))
+
+INLINE void futex_wait( int *addr, int value ){
+	syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0 );
+}
+
+INLINE void futex_wake( int *addr, int count ){
+	syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0 );
+}
+/*
+ * Visit queued objects and objects being taken by a consumer.
+ */
+void channel_walker( void *data, gc_visitor_t visitor, void *vdata ){
+	channel_t *ch = (channel_t *)data;
+	Object	  *value;
+	size_t     i;
+
+	for( i = 0; i <= ch->mask; ++i ){
+		if( (value = __atomic_load_n( &ch->cells[i].value, __ATOMIC_ACQUIRE )) != NULL ){
+			visitor( value, vdata );
+		}
+	}
+}
+
+channel_t *channel_create( size_t capacity ){
+	channel_t *ch = (channel_t *)calloc( 1, sizeof(channel_t) );
+	size_t     size, i;
+	/*
+	 * Round capacity to the next power of two.
+	 */
+	for( size = 2; size < capacity; size <<= 1 );
+
+	ch->cells = (channel_cell_t *)calloc( size, sizeof(channel_cell_t) );
+	ch->mask  = size - 1;
+
+	for( i = 0; i < size; ++i ){
+		ch->cells[i].seq = i;
+	}
+
+	gc_add_root_walker( channel_walker, ch );
+
+	return ch;
+}
+/*
+ * Handle finalizer, nobody can be waiting on the channel since every
+ * waiter holds a reference to its handle.
+ */
+static void channel_finalize( void *value ){
+	channel_t *ch = (channel_t *)value;
+
+	gc_remove_root_walker( channel_walker, ch );
+
+	free( ch->cells );
+	free( ch );
+}
+
+bool channel_try_send( channel_t *ch, Object *o ){
+	channel_cell_t *cell;
+	size_t 			pos = __atomic_load_n( &ch->enqueue_pos, __ATOMIC_RELAXED ),
+					seq;
+	long			diff;
+
+	while(true){
+		cell = &ch->cells[ pos & ch->mask ];
+		seq  = __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE );
+		diff = (long)seq - (long)pos;
+
+		if( diff == 0 ){
+			if( __atomic_compare_exchange_n( &ch->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ){
+				break;
+			}
+		}
+		/*
+		 * Full.
+		 */
+		else if( diff < 0 ){
+			return false;
+		}
+		else{
+			pos = __atomic_load_n( &ch->enqueue_pos, __ATOMIC_RELAXED );
+		}
+	}
+
+	__atomic_store_n( &cell->value, o, __ATOMIC_RELEASE );
+	__atomic_store_n( &cell->seq, pos + 1, __ATOMIC_RELEASE );
+	/*
+	 * Wake up a sleeping consumer, if any.
+	 */
+	__atomic_add_fetch( &ch->not_empty, 1, __ATOMIC_SEQ_CST );
+	if( __atomic_load_n( &ch->recv_waiters, __ATOMIC_SEQ_CST ) ){
+		futex_wake( &ch->not_empty, 1 );
+	}
+
+	return true;
+}
+
+/*
+ * The received object is pushed on 'owner' before leaving its cell.
+ */
+Object *channel_try_recv( channel_t *ch, vmem_t *owner ){
+	channel_cell_t *cell;
+	Object 		   *o;
+	size_t 			pos = __atomic_load_n( &ch->dequeue_pos, __ATOMIC_RELAXED ),
+					seq;
+	long			diff;
+
+	while(true){
+		cell = &ch->cells[ pos & ch->mask ];
+		seq  = __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE );
+		diff = (long)seq - (long)(pos + 1);
+
+		if( diff == 0 ){
+			if( __atomic_compare_exchange_n( &ch->dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ){
+				break;
+			}
+		}
+		/*
+		 * Empty.
+		 */
+		else if( diff < 0 ){
+			return H_UNDEFINED;
+		}
+		else{
+			pos = __atomic_load_n( &ch->dequeue_pos, __ATOMIC_RELAXED );
+		}
+	}
+
+	o = cell->value;
+	if( o ){
+		owner->push_tmp(o);
+	}
+	__atomic_store_n( &cell->value, (Object *)H_UNDEFINED, __ATOMIC_RELEASE );
+	__atomic_store_n( &cell->seq, pos + ch->mask + 1, __ATOMIC_RELEASE );
+	/*
+	 * Wake up a sleeping producer, if any.
+	 */
+	__atomic_add_fetch( &ch->not_full, 1, __ATOMIC_SEQ_CST );
+	if( __atomic_load_n( &ch->send_waiters, __ATOMIC_SEQ_CST ) ){
+		futex_wake( &ch->not_full, 1 );
+	}
+
+	return o;
+}
+
+bool channel_send( channel_t *ch, Object *o ){
+	int value;
+
+	while( __atomic_load_n( &ch->closed, __ATOMIC_ACQUIRE ) == 0 ){
+		if( channel_try_send( ch, o ) ){
+			return true;
+		}
+		/*
+		 * Register as a sleeper, then read the futex word and check
+		 * again, a consumer either sees us or changes the word.
+		 */
+		__atomic_add_fetch( &ch->send_waiters, 1, __ATOMIC_SEQ_CST );
+		value = __atomic_load_n( &ch->not_full, __ATOMIC_SEQ_CST );
+		if( channel_try_send( ch, o ) ){
+			__atomic_sub_fetch( &ch->send_waiters, 1, __ATOMIC_SEQ_CST );
+			return true;
+		}
+		if( __atomic_load_n( &ch->closed, __ATOMIC_ACQUIRE ) == 0 ){
+			futex_wait( &ch->not_full, value );
+		}
+		__atomic_sub_fetch( &ch->send_waiters, 1, __ATOMIC_SEQ_CST );
+	}
+
+	return false;
+}
+
+Object *channel_recv( channel_t *ch, vmem_t *owner ){
+	Object *o;
+	int     value;
+
+	while(true){
+		if( (o = channel_try_recv( ch, owner )) != H_UNDEFINED ){
+			return o;
+		}
+		/*
+		 * Closed and drained.
+		 */
+		else if( __atomic_load_n( &ch->closed, __ATOMIC_ACQUIRE ) ){
+			return channel_try_recv( ch, owner );
+		}
+
+		__atomic_add_fetch( &ch->recv_waiters, 1, __ATOMIC_SEQ_CST );
+		value = __atomic_load_n( &ch->not_empty, __ATOMIC_SEQ_CST );
+		if( (o = channel_try_recv( ch, owner )) != H_UNDEFINED ){
+			__atomic_sub_fetch( &ch->recv_waiters, 1, __ATOMIC_SEQ_CST );
+			return o;
+		}
+		if( __atomic_load_n( &ch->closed, __ATOMIC_ACQUIRE ) == 0 ){
+			futex_wait( &ch->not_empty, value );
+		}
+		__atomic_sub_fetch( &ch->recv_waiters, 1, __ATOMIC_SEQ_CST );
+	}
+}
+
+void channel_close( channel_t *ch ){
+	__atomic_store_n( &ch->closed, 1, __ATOMIC_RELEASE );
+	/*
+	 * Change both futex words and wake everybody up.
+	 */
+	__atomic_add_fetch( &ch->not_empty, 1, __ATOMIC_SEQ_CST );
+	__atomic_add_fetch( &ch->not_full,  1, __ATOMIC_SEQ_CST );
+
+	futex_wake( &ch->not_empty, INT_MAX );
+	futex_wake( &ch->not_full,  INT_MAX );
+}
+/*
+ * Return the 'null' constant, used when there's nothing to receive.
+ */
+INLINE Object *channel_null( vm_t *vm ){
+	return vm->vconst.get( (char *)"null" );
+}
+
+HYBRIS_DEFINE_FUNCTION(hchannel_create){
+	long capacity = HCHANNEL_DEFAULT_CAPACITY;
+
+	vm_parse_argv( "l", &capacity );
+
+	if( capacity <= 0 || capacity > HCHANNEL_MAX_CAPACITY ){
+		return vm_raise_exception( "Invalid channel capacity %d, valid range is 1-%d", capacity, HCHANNEL_MAX_CAPACITY );
+	}
+	/*
+	 * Objects will be shared among threads.
+	 */
+	hyb_set_threaded();
+
+	Handle *handle = gc_new_handle( channel_create(capacity) );
+
+	handle_set_finalizer( handle, channel_finalize );
+
+	return ob_dcast( handle );
+}
+
+HYBRIS_DEFINE_FUNCTION(hchannel_send){
+	Handle *handle;
+	Object *o;
+
+	vm_parse_argv( "HO", &handle, &o );
+
+	if( channel_send( channel_ucast(handle), o ) == false ){
+		return vm_raise_exception( "Send on a closed channel" );
+	}
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hchannel_try_send){
+	Handle *handle;
+	Object *o;
+	channel_t *ch;
+
+	vm_parse_argv( "HO", &handle, &o );
+
+	ch = channel_ucast(handle);
+	if( __atomic_load_n( &ch->closed, __ATOMIC_ACQUIRE ) ){
+		return vm_raise_exception( "Send on a closed channel" );
+	}
+
+	return ob_dcast( gc_new_boolean( channel_try_send( ch, o ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hchannel_recv){
+	Handle *handle;
+	Object *o;
+
+	vm_parse_argv( "H", &handle );
+
+	o = channel_recv( channel_ucast(handle), data );
+
+	return ( o ? o : channel_null(vm) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hchannel_try_recv){
+	Handle *handle;
+	Object *o;
+
+	vm_parse_argv( "H", &handle );
+
+	o = channel_try_recv( channel_ucast(handle), data );
+
+	return ( o ? o : channel_null(vm) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hchannel_close){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	channel_close( channel_ucast(handle) );
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hchannel_size){
+	Handle    *handle;
+	channel_t *ch;
+	long	   size;
+
+	vm_parse_argv( "H", &handle );
+
+	ch   = channel_ucast(handle);
+	size = (long)( __atomic_load_n( &ch->enqueue_pos, __ATOMIC_ACQUIRE ) - __atomic_load_n( &ch->dequeue_pos, __ATOMIC_ACQUIRE ) );
+
+	return ob_dcast( gc_new_integer( size < 0 ? 0 : size ) );
+}
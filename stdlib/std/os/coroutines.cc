@@ -0,0 +1,1015 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <hybris.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <deque>
+#include <queue>
+
+using std::deque;
+
+HYBRIS_DEFINE_FUNCTION(hco_spawn);
+HYBRIS_DEFINE_FUNCTION(hco_detach);
+HYBRIS_DEFINE_FUNCTION(hco_yield);
+HYBRIS_DEFINE_FUNCTION(hco_wait);
+HYBRIS_DEFINE_FUNCTION(hco_sleep);
+HYBRIS_DEFINE_FUNCTION(hco_join);
+HYBRIS_DEFINE_FUNCTION(hco_done);
+HYBRIS_DEFINE_FUNCTION(hco_run);
+HYBRIS_DEFINE_FUNCTION(hco_self);
+HYBRIS_DEFINE_FUNCTION(hco_count);
+HYBRIS_DEFINE_FUNCTION(hgen_create);
+HYBRIS_DEFINE_FUNCTION(hgen_next);
+HYBRIS_DEFINE_FUNCTION(hgen_yield);
+
+HYBRIS_EXPORTED_FUNCTIONS() {
+	{ "co_spawn",  hco_spawn,  H_REQ_ARGC(1,2), { H_REQ_TYPES(otString), H_REQ_TYPES(otVector) } },
+	{ "co_detach", hco_detach, H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "co_yield",  hco_yield,  H_NO_ARGS },
+	{ "co_wait",   hco_wait,   H_REQ_ARGC(2,3), { H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
+	{ "co_sleep",  hco_sleep,  H_REQ_ARGC(1),   { H_REQ_TYPES(otInteger) } },
+	{ "co_join",   hco_join,   H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "co_done",   hco_done,   H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "co_run",    hco_run,    H_NO_ARGS },
+	{ "co_self",   hco_self,   H_NO_ARGS },
+	{ "co_count",  hco_count,  H_NO_ARGS },
+	{ "gen_create", hgen_create, H_REQ_ARGC(1,2), { H_REQ_TYPES(otString), H_REQ_TYPES(otVector) } },
+	{ "gen_next",   hgen_next,   H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "gen_yield",  hgen_yield,  H_REQ_ARGC(1),   { H_ANY_TYPE } },
+	{ "", NULL }
+};
+
+/*
+ * Coroutines (green threads).
+ *
+ * Every coroutine has its own C stack, where the interpreter recursion
+ * takes place, and its own vm scope (list of memory frames), so that
+ * switching from a coroutine to another is just a swapcontext plus the
+ * swap of the thread scope pointer.
+ * Stacks are mmap'ed without reserving them, so an idle coroutine only
+ * costs the few pages its interpreter frames actually touched, even if
+ * their virtual size allows the same recursion depth of the main thread.
+ *
+ * Each OS thread calling co_run or co_join has its own scheduler with a
+ * ready queue, an epoll instance for coroutines waiting on descriptors
+ * and a timers heap for sleeps and timeouts. Several threads running a
+ * scheduler give an M:N model, but a coroutine never migrates from the
+ * thread which spawned it, since the frames on its stack could cache
+ * thread local addresses.
+ *
+ * Once the module is loaded, blocking std.io.network calls made from
+ * inside a coroutine suspend the coroutine (see vm_io_wait) instead of
+ * the whole thread.
+ *
+ * The parser turns the spawn, await and yield keywords into calls to
+ * this module, so "h = spawn f(a,b);" is co_spawn( "f", [a,b] ),
+ * "await h" is co_join(h), "yield;" is co_yield() and "yield v;" is
+ * gen_yield(v).
+ *
+ * Generators are coroutines which are not scheduled, gen_next switches
+ * straight to them until they call gen_yield or return, so they can be
+ * consumed lazily by foreach (see std.lang.Generator). A generator runs
+ * on behalf of whoever resumed it, so it can not suspend on I/O, sleep
+ * or join (those calls block the thread instead).
+ *
+ * The stack and the scope of a coroutine are released as soon as it
+ * returns, the structure itself once it returned, no handle refers to it
+ * anymore and no timer of the scheduler points to it. A generator which
+ * is abandoned before returning is released by the finalizer of its last
+ * handle (stack, scope, frame and registry entry), the interpreter frames
+ * still living on its stack are not unwound.
+ */
+/*
+ * C stack reserved for each nested script call, stacks are sized so that
+ * a coroutine can recurse up to VM_MAX_RECURSION calls like the main
+ * thread, and hit "Reached max number of nested calls" instead of the
+ * guard page. Being MAP_NORESERVE, only the touched pages cost memory.
+ */
+#define CO_STACK_FRAME_SIZE (8 * 1024)
+#define CO_STACK_SIZE 		(VM_MAX_RECURSION * CO_STACK_FRAME_SIZE)
+#define CO_MAX_EVENTS 256
+
+enum co_state_t {
+	coReady = 0,
+	coRunning,
+	coWaiting,
+	coDone
+};
+
+struct _co_sched_t;
+
+typedef struct _co_t {
+	ucontext_t 			ctx;
+	/*
+	 * Context to switch back to when suspending, the scheduler one
+	 * or the one of who resumed a generator.
+	 */
+	ucontext_t		   *caller;
+	char 	   		   *stack;
+	co_state_t 			state;
+	vm_t			   *vm;
+	struct _co_sched_t *sched;
+	/*
+	 * Function to call, its arguments frame (which also receives its
+	 * unhandled exception) and the scope the frames are pushed to.
+	 */
+	string	   			function;
+	vmem_t	   		   *frame;
+	vm_scope_t 		   *scope;
+	Object	   		   *result;
+	Object	   		   *exception;
+	/*
+	 * Descriptor the coroutine is waiting for, if any, the events it
+	 * got and a counter used to invalidate pending timeouts.
+	 */
+	int					fd;
+	int					revents;
+	ulong				wait_id;
+	/*
+	 * Coroutines suspended in co_join waiting for this one.
+	 */
+	vector<struct _co_t *> joiners;
+	/*
+	 * Position in the registry, -1 once unregistered, and true if
+	 * the result is not going to be joined.
+	 */
+	long				reg_index;
+	bool				detached;
+	/*
+	 * Generators only, the last value passed to gen_yield.
+	 */
+	bool				generator;
+	Object			   *yielded;
+	/*
+	 * Number of handle groups referring to the coroutine, timers of
+	 * the scheduler heap pointing to it and true once its stack and
+	 * scope were released, 'handles' and 'released' are protected by
+	 * the registry mutex.
+	 */
+	size_t				handles;
+	size_t				timers;
+	bool				released;
+}
+co_t;
+
+typedef struct {
+	ulong  deadline;
+	ulong  wait_id;
+	co_t  *co;
+}
+co_timer_t;
+
+struct co_timer_cmp {
+	bool operator()( const co_timer_t& a, const co_timer_t& b ) const {
+		return a.deadline > b.deadline;
+	}
+};
+
+typedef std::priority_queue< co_timer_t, vector<co_timer_t>, co_timer_cmp > co_timers_t;
+
+typedef struct _co_sched_t {
+	/*
+	 * Context of the thread native stack, where the scheduler runs.
+	 */
+	ucontext_t  main;
+	co_t	   *current;
+	deque<co_t *> ready;
+	co_timers_t timers;
+	int			epfd;
+	/*
+	 * Number of coroutines waiting on a descriptor and of the
+	 * ones which did not return yet.
+	 */
+	size_t		n_io;
+	size_t		alive;
+}
+co_sched_t;
+
+static __thread co_sched_t *__co_sched = NULL;
+/*
+ * Every coroutine whose scope or result has to be marked by the gc.
+ */
+static vector<co_t *>  __co_registry;
+static pthread_mutex_t __co_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define co_ucast(o) ((co_t *)ob_handle_val(o))
+
+static int co_io_wait( int fd, int events, int timeout );
+
+extern "C" void hybris_module_init( vm_t * vm ){
+	HYBRIS_DEFINE_CONSTANT( vm, "CO_READ",  gc_new_integer(POLLIN) );
+	HYBRIS_DEFINE_CONSTANT( vm, "CO_WRITE", gc_new_integer(POLLOUT) );
+
+	vm_set_io_waiter( co_io_wait );
+}
+
+static INLINE ulong co_now(){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+/*
+ * Visit the frames of every coroutine and the results not joined yet.
+ * Walkers are called with the vm memory lock held, so scopes can not
+ * change under our feet.
+ */
+void co_walker( void *data, gc_visitor_t visitor, void *vdata ){
+	size_t 	   i;
+	co_t	  *co;
+	ll_item_t *item;
+	vframe_t  *frame;
+
+	pthread_mutex_lock( &__co_registry_mutex );
+
+	for( i = 0; i < __co_registry.size(); ++i ){
+		co = __co_registry[i];
+		if( co->scope ){
+			for( item = co->scope->head; item; item = item->next ){
+				frame = ll_data( vframe_t *, item );
+				for( size_t j = 0; j < frame->size(); ++j ){
+					if( frame->at(j) ){
+						visitor( frame->at(j), vdata );
+					}
+				}
+			}
+		}
+		if( co->result ){
+			visitor( co->result, vdata );
+		}
+		if( co->exception ){
+			visitor( co->exception, vdata );
+		}
+		if( co->yielded ){
+			visitor( co->yielded, vdata );
+		}
+	}
+
+	pthread_mutex_unlock( &__co_registry_mutex );
+}
+
+static void co_register( co_t *co ){
+	static bool walker = false;
+
+	pthread_mutex_lock( &__co_registry_mutex );
+
+	if( walker == false ){
+		gc_add_root_walker( co_walker, NULL );
+		walker = true;
+	}
+
+	co->reg_index = __co_registry.size();
+	__co_registry.push_back(co);
+
+	pthread_mutex_unlock( &__co_registry_mutex );
+}
+
+/*
+ * Must be called with the registry mutex locked.
+ */
+static void co_unregister_locked( co_t *co ){
+	if( co->reg_index >= 0 ){
+		co_t *last = __co_registry.back();
+
+		__co_registry[co->reg_index] = last;
+		last->reg_index = co->reg_index;
+		__co_registry.pop_back();
+
+		co->reg_index = -1;
+	}
+}
+
+static void co_unregister( co_t *co ){
+	pthread_mutex_lock( &__co_registry_mutex );
+		co_unregister_locked(co);
+	pthread_mutex_unlock( &__co_registry_mutex );
+}
+/*
+ * Delete the structure if nothing refers to it anymore, must be called
+ * with the registry mutex locked, return true if it was deleted.
+ */
+static bool co_collect_locked( co_t *co ){
+	if( co->handles == 0 && co->released && co->timers == 0 ){
+		co_unregister_locked(co);
+		delete co;
+		return true;
+	}
+	return false;
+}
+
+static co_sched_t *co_get_sched(){
+	if( __co_sched == NULL ){
+		__co_sched = new co_sched_t;
+
+		__co_sched->current = NULL;
+		__co_sched->epfd	= epoll_create1( EPOLL_CLOEXEC );
+		__co_sched->n_io	= 0;
+		__co_sched->alive   = 0;
+	}
+	return __co_sched;
+}
+/*
+ * Free the stack and the scope of a coroutine which returned, this
+ * is done from the scheduler context since a coroutine can not
+ * unmap the stack it's running on.
+ */
+static void co_release( co_t *co ){
+	munmap( co->stack, CO_STACK_SIZE );
+	co->stack = NULL;
+
+	vm_mm_lock( co->vm );
+		ll_clear( co->scope );
+		free( co->scope );
+		co->scope = NULL;
+	vm_mm_unlock( co->vm );
+
+	delete co->frame;
+	co->frame = NULL;
+
+	pthread_mutex_lock( &__co_registry_mutex );
+
+	co->released = true;
+	/*
+	 * Nothing left to keep alive, generators results are handed
+	 * to gen_next right after this.
+	 */
+	if( co->detached || co->generator ){
+		co_unregister_locked(co);
+	}
+	/*
+	 * Every handle is gone already.
+	 */
+	co_collect_locked(co);
+
+	pthread_mutex_unlock( &__co_registry_mutex );
+}
+/*
+ * A timer of the scheduler heap pointing to 'co' was popped, the
+ * structure might be deleted now if the coroutine already returned.
+ * 'released' is only set by this thread, so it can be read unlocked.
+ */
+static void co_timer_done( co_t *co ){
+	if( co->released == false ){
+		co->timers--;
+	}
+	else{
+		pthread_mutex_lock( &__co_registry_mutex );
+			co->timers--;
+			co_collect_locked(co);
+		pthread_mutex_unlock( &__co_registry_mutex );
+	}
+}
+/*
+ * Handle finalizer.
+ * A generator nobody refers to anymore will never be resumed, so its
+ * stack and scope are released right away. The gc is holding the vm
+ * memory lock, and the scope is not reachable from the vm anymore.
+ */
+static void co_finalize( void *value ){
+	co_t *co = (co_t *)value;
+
+	pthread_mutex_lock( &__co_registry_mutex );
+
+	if( --co->handles == 0 ){
+		if( co->generator && co->released == false && co->state != coRunning ){
+			munmap( co->stack, CO_STACK_SIZE );
+			co->stack = NULL;
+
+			ll_clear( co->scope );
+			free( co->scope );
+			co->scope = NULL;
+
+			delete co->frame;
+			co->frame = NULL;
+
+			co->released = true;
+		}
+		/*
+		 * Nobody can join it anymore.
+		 */
+		co->detached = true;
+		if( co->released ){
+			co_unregister_locked(co);
+		}
+
+		co_collect_locked(co);
+	}
+
+	pthread_mutex_unlock( &__co_registry_mutex );
+}
+/*
+ * Create a new handle to a coroutine.
+ */
+static Object *co_new_handle( co_t *co ){
+	Handle *handle = gc_new_handle(co);
+
+	pthread_mutex_lock( &__co_registry_mutex );
+		co->handles++;
+	pthread_mutex_unlock( &__co_registry_mutex );
+
+	handle_set_finalizer( handle, co_finalize );
+
+	return (Object *)handle;
+}
+/*
+ * Switch to a coroutine saving the current context into 'from', until
+ * it suspends or returns.
+ */
+static void co_switch( co_sched_t *sched, co_t *co, ucontext_t *from ){
+	vm_scope_t *saved = vm_find_scope(co->vm);
+	co_t	   *prev  = sched->current;
+
+	co->state 	   = coRunning;
+	co->caller	   = from;
+	sched->current = co;
+	__vm_scope	   = co->scope;
+
+	swapcontext( from, &co->ctx );
+
+	__vm_scope	   = saved;
+	sched->current = prev;
+
+	if( co->state == coDone ){
+		co_release(co);
+	}
+}
+/*
+ * Switch from the scheduler to a coroutine.
+ */
+static INLINE void co_resume( co_sched_t *sched, co_t *co ){
+	co_switch( sched, co, &sched->main );
+}
+/*
+ * Switch from the running coroutine back to its caller, the scheduler
+ * one must have been queued somewhere to be woken up again.
+ */
+static INLINE void co_suspend( co_sched_t *sched ){
+	co_t *co = sched->current;
+
+	swapcontext( &co->ctx, co->caller );
+}
+/*
+ * The running coroutine if it can be suspended by the scheduler, NULL
+ * if we're on the thread native stack or inside a generator.
+ */
+static INLINE co_t *co_running( co_sched_t *sched ){
+	if( sched == NULL || sched->current == NULL || sched->current->generator ){
+		return NULL;
+	}
+	return sched->current;
+}
+
+static INLINE void co_wake( co_sched_t *sched, co_t *co, int revents ){
+	co->wait_id++;
+	co->revents = revents;
+	co->state	= coReady;
+
+	sched->ready.push_back(co);
+}
+
+static void co_trampoline(){
+	co_sched_t *sched = __co_sched;
+	co_t 	   *co	  = sched->current;
+	Node	   *function;
+	size_t		i;
+
+	if( (function = co->vm->vcode.get( (char *)co->function.c_str() )) == H_UNDEFINED ){
+		hyb_error( H_ET_SYNTAX, "'%s' undeclared user function identifier", co->function.c_str() );
+	}
+
+	co->result = vm_exec_threaded_call( co->vm, function, co->frame, co->frame, co->frame );
+
+	if( co->frame->state.is(Exception) ){
+		co->exception = co->frame->state.e_value;
+		co->result	  = NULL;
+	}
+	else if( co->result == H_UNDEFINED ){
+		co->result = H_DEFAULT_RETURN;
+	}
+
+	co->state = coDone;
+
+	if( co->generator == false ){
+		for( i = 0; i < co->joiners.size(); ++i ){
+			co_wake( sched, co->joiners[i], 0 );
+		}
+		co->joiners.clear();
+
+		sched->alive--;
+	}
+	/*
+	 * Never resumed, the caller will release the stack we're on.
+	 */
+	setcontext( co->caller );
+}
+/*
+ * Wait for a descriptor to be ready and/or for a timeout, timeout < 0
+ * means forever and fd < 0 is just a sleep.
+ */
+static int co_wait_for( co_sched_t *sched, int fd, int events, long timeout ){
+	co_t *co = sched->current;
+
+	if( fd >= 0 ){
+		struct epoll_event ev;
+
+		memset( &ev, 0x00, sizeof(ev) );
+		ev.events	= events | EPOLLONESHOT;
+		ev.data.ptr = co;
+		/*
+		 * One shot registrations stay in the set once fired, so rearm
+		 * them if the descriptor was already waited for.
+		 */
+		if( epoll_ctl( sched->epfd, EPOLL_CTL_ADD, fd, &ev ) != 0 ){
+			if( errno != EEXIST || epoll_ctl( sched->epfd, EPOLL_CTL_MOD, fd, &ev ) != 0 ){
+				/*
+				 * Not pollable (i.e. regular files), which is the same
+				 * as always ready.
+				 */
+				return events;
+			}
+		}
+
+		sched->n_io++;
+	}
+
+	co->fd 	  = fd;
+	co->state = coWaiting;
+
+	if( timeout >= 0 ){
+		co_timer_t timer = { co_now() + timeout, co->wait_id, co };
+
+		sched->timers.push( timer );
+		co->timers++;
+	}
+
+	co_suspend( sched );
+
+	return co->revents;
+}
+/*
+ * Dispatch expired timers and descriptors events, waiting for them
+ * at most 'timeout' milliseconds.
+ */
+static void co_poll( co_sched_t *sched, int timeout ){
+	struct epoll_event events[CO_MAX_EVENTS];
+	int 			   n, i;
+	ulong			   now;
+	co_t			  *co;
+
+	n = epoll_wait( sched->epfd, events, CO_MAX_EVENTS, timeout );
+	for( i = 0; i < n; ++i ){
+		co = (co_t *)events[i].data.ptr;
+		if( co->state == coWaiting && co->fd >= 0 ){
+			sched->n_io--;
+			co->fd = -1;
+			co_wake( sched, co, events[i].events );
+		}
+	}
+
+	now = co_now();
+	while( !sched->timers.empty() && sched->timers.top().deadline <= now ){
+		co_timer_t timer = sched->timers.top();
+		bool	   stale;
+
+		sched->timers.pop();
+
+		co	  = timer.co;
+		stale = ( timer.wait_id != co->wait_id || co->state != coWaiting );
+
+		co_timer_done(co);
+		/*
+		 * Stale timer, the coroutine was woken up by its descriptor.
+		 */
+		if( stale ){
+			continue;
+		}
+
+		if( co->fd >= 0 ){
+			epoll_ctl( sched->epfd, EPOLL_CTL_DEL, co->fd, NULL );
+			sched->n_io--;
+			co->fd = -1;
+		}
+		co_wake( sched, co, 0 );
+	}
+}
+/*
+ * Milliseconds until the next valid timer expires, -1 if none.
+ */
+static int co_next_timeout( co_sched_t *sched ){
+	ulong now;
+
+	while( !sched->timers.empty() ){
+		const co_timer_t& timer = sched->timers.top();
+		co_t			 *co	= timer.co;
+
+		if( timer.wait_id == co->wait_id && co->state == coWaiting ){
+			now = co_now();
+			return ( timer.deadline > now ? timer.deadline - now : 0 );
+		}
+		sched->timers.pop();
+		co_timer_done(co);
+	}
+	return -1;
+}
+/*
+ * Run every ready coroutine once, then wait for events. Return false
+ * if there's nothing that could make progress anymore (either no
+ * coroutines at all, or all of them blocked on joins).
+ */
+static bool co_schedule( co_sched_t *sched ){
+	size_t n = sched->ready.size();
+	int	   timeout;
+
+	while( n-- ){
+		co_t *co = sched->ready.front();
+
+		sched->ready.pop_front();
+
+		co_resume( sched, co );
+	}
+
+	if( sched->alive == 0 ){
+		return false;
+	}
+
+	timeout = co_next_timeout(sched);
+
+	if( sched->ready.empty() ){
+		if( timeout < 0 && sched->n_io == 0 ){
+			return false;
+		}
+	}
+	else{
+		timeout = 0;
+	}
+
+	co_poll( sched, timeout );
+
+	return true;
+}
+
+static int co_io_wait( int fd, int events, int timeout ){
+	co_sched_t   *sched = __co_sched;
+	struct pollfd pfd	= { fd, (short)events, 0 };
+
+	if( co_running(sched) == NULL ){
+		return -1;
+	}
+	/*
+	 * Do not suspend if it's already ready.
+	 */
+	if( poll( &pfd, 1, 0 ) > 0 ){
+		return pfd.revents;
+	}
+
+	return co_wait_for( sched, fd, events, timeout );
+}
+
+/*
+ * Create a coroutine calling 'function' with the items of 'argv' as
+ * arguments, return NULL (with the exception set) on error.
+ */
+static co_t *co_create( vm_t *vm, string& function, Vector *argv, bool generator ){
+	Integer index(0);
+	size_t  argc;
+
+	if( vm->vcode.get( (char *)function.c_str() ) == H_UNDEFINED ){
+		vm_raise_exception( "'%s' undeclared user function identifier", function.c_str() );
+		return NULL;
+	}
+
+	co_sched_t *sched = co_get_sched();
+	co_t	   *co	  = new co_t;
+
+	co->stack = (char *)mmap( NULL, CO_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0 );
+	if( co->stack == MAP_FAILED ){
+		delete co;
+		vm_raise_exception( "could not allocate the coroutine stack : %s", strerror(errno) );
+		return NULL;
+	}
+	/*
+	 * Guard page, an overflow crashes instead of corrupting memory.
+	 */
+	mprotect( co->stack, getpagesize(), PROT_NONE );
+
+	co->state	  = coReady;
+	co->caller	  = NULL;
+	co->vm		  = vm;
+	co->sched	  = sched;
+	co->function  = function;
+	co->frame	  = new vmem_t;
+	co->scope	  = (vm_scope_t *)calloc( 1, sizeof(vm_scope_t) );
+	co->result	  = NULL;
+	co->exception = NULL;
+	co->fd		  = -1;
+	co->revents	  = 0;
+	co->wait_id	  = 0;
+	co->reg_index = -1;
+	co->detached  = false;
+	co->generator = generator;
+	co->yielded	  = NULL;
+	co->handles	  = 0;
+	co->timers	  = 0;
+	co->released  = false;
+
+	argc = ( argv ? ob_get_size( (Object *)argv ) : 0 );
+	for( ; (size_t)index.value < argc; ++index.value ){
+		co->frame->push( ob_cl_at( (Object *)argv, (Object *)&index ) );
+	}
+
+	co->frame->owner = function;
+
+	ll_append( co->scope, co->frame );
+
+	getcontext( &co->ctx );
+
+	co->ctx.uc_stack.ss_sp	 = co->stack;
+	co->ctx.uc_stack.ss_size = CO_STACK_SIZE;
+	co->ctx.uc_link			 = NULL;
+
+	makecontext( &co->ctx, co_trampoline, 0 );
+
+	co_register(co);
+
+	return co;
+}
+/*
+ * Propagate the unhandled exception of a coroutine to the caller.
+ */
+static Object *co_rethrow( vm_t *vm, Object *exception ){
+	vm_mm_lock( vm );
+		vm_frame(vm)->state.set( Exception, exception );
+	vm_mm_unlock( vm );
+
+	return H_DEFAULT_ERROR;
+}
+
+HYBRIS_DEFINE_FUNCTION(hco_spawn){
+	string  function;
+	Vector *argv = NULL;
+	co_t   *co;
+
+	vm_parse_argv( "sV", &function, &argv );
+
+	if( (co = co_create( vm, function, argv, false )) == NULL ){
+		return H_DEFAULT_ERROR;
+	}
+
+	co->sched->alive++;
+	co->sched->ready.push_back(co);
+
+	return co_new_handle(co);
+}
+/*
+ * The coroutine result is not going to be joined, so it does not
+ * need to be kept alive once it returns.
+ */
+HYBRIS_DEFINE_FUNCTION(hco_detach){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	co_t *co = co_ucast(handle);
+
+	co->detached = true;
+	/*
+	 * Otherwise co_release will do it.
+	 */
+	if( co->state == coDone ){
+		co_unregister(co);
+	}
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hco_yield){
+	co_sched_t *sched = __co_sched;
+
+	if( co_running(sched) == NULL ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	co_wake( sched, sched->current, 0 );
+	co_suspend( sched );
+
+	return (Object *)gc_new_boolean(true);
+}
+
+HYBRIS_DEFINE_FUNCTION(hco_wait){
+	int fd,
+		events,
+		timeout = -1;
+
+	vm_parse_argv( "iii", &fd, &events, &timeout );
+
+	int revents = co_io_wait( fd, events, timeout );
+	/*
+	 * Not inside a coroutine, just block the thread.
+	 */
+	if( revents < 0 ){
+		struct pollfd pfd = { fd, (short)events, 0 };
+
+		while( (revents = poll( &pfd, 1, timeout )) < 0 && errno == EINTR );
+
+		revents = ( revents > 0 ? pfd.revents : 0 );
+	}
+
+	return (Object *)gc_new_integer(revents);
+}
+
+HYBRIS_DEFINE_FUNCTION(hco_sleep){
+	long ms;
+
+	vm_parse_argv( "l", &ms );
+
+	co_sched_t *sched = __co_sched;
+
+	if( co_running(sched) == NULL ){
+		usleep( ms * 1000 );
+	}
+	else{
+		co_wait_for( sched, -1, 0, ms );
+	}
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hco_join){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	co_t 	   *co    = co_ucast(handle);
+	co_sched_t *sched = co_get_sched();
+
+	if( co->state != coDone ){
+		if( co->sched != sched ){
+			return vm_raise_exception( "can not join a coroutine of another thread" );
+		}
+		else if( co == sched->current ){
+			return vm_raise_exception( "a coroutine can not join itself" );
+		}
+		else if( co->generator || (sched->current && sched->current->generator) ){
+			return vm_raise_exception( "generators can not be joined nor join coroutines" );
+		}
+		/*
+		 * Suspend the calling coroutine until the other one returns,
+		 * or run the scheduler if we're on the thread native stack.
+		 */
+		if( sched->current ){
+			co->joiners.push_back( sched->current );
+			co_wait_for( sched, -1, 0, -1 );
+		}
+		else{
+			while( co->state != coDone && co_schedule(sched) );
+
+			if( co->state != coDone ){
+				return vm_raise_exception( "deadlock, every coroutine is waiting for another one" );
+			}
+		}
+	}
+
+	Object *result	  = co->result,
+		   *exception = co->exception;
+
+	co_unregister(co);
+
+	if( exception ){
+		return co_rethrow( vm, exception );
+	}
+
+	return ( result ? result : H_DEFAULT_RETURN );
+}
+
+HYBRIS_DEFINE_FUNCTION(hco_done){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	return (Object *)gc_new_boolean( co_ucast(handle)->state == coDone );
+}
+/*
+ * Run the scheduler of this thread until every coroutine returned.
+ */
+HYBRIS_DEFINE_FUNCTION(hco_run){
+	co_sched_t *sched = co_get_sched();
+
+	if( sched->current ){
+		return vm_raise_exception( "co_run can not be called from a coroutine" );
+	}
+
+	while( co_schedule(sched) );
+
+	return (Object *)gc_new_integer( sched->alive );
+}
+
+HYBRIS_DEFINE_FUNCTION(hco_self){
+	co_sched_t *sched = __co_sched;
+
+	if( sched == NULL || sched->current == NULL ){
+		return (Object *)gc_new_boolean(false);
+	}
+
+	return co_new_handle( sched->current );
+}
+
+HYBRIS_DEFINE_FUNCTION(hco_count){
+	co_sched_t *sched = __co_sched;
+
+	return (Object *)gc_new_integer( sched ? sched->alive : 0 );
+}
+
+HYBRIS_DEFINE_FUNCTION(hgen_create){
+	string  function;
+	Vector *argv = NULL;
+	co_t   *co;
+
+	vm_parse_argv( "sV", &function, &argv );
+
+	if( (co = co_create( vm, function, argv, true )) == NULL ){
+		return H_DEFAULT_ERROR;
+	}
+
+	return co_new_handle(co);
+}
+/*
+ * Run the generator until its next gen_yield and return the value,
+ * once the function returns (co_done is true) its result is returned.
+ */
+HYBRIS_DEFINE_FUNCTION(hgen_next){
+	Handle *handle;
+
+	vm_parse_argv( "H", &handle );
+
+	co_t 	   *co    = co_ucast(handle);
+	co_sched_t *sched = co_get_sched();
+	Object	   *value;
+
+	if( co->generator == false ){
+		return vm_raise_exception( "gen_next called on a coroutine" );
+	}
+	else if( co->state == coDone ){
+		return vm_raise_exception( "generator '%s' already returned", co->function.c_str() );
+	}
+	else if( co->state == coRunning ){
+		return vm_raise_exception( "generator '%s' is already running", co->function.c_str() );
+	}
+	else if( co->sched != sched ){
+		return vm_raise_exception( "can not resume a generator of another thread" );
+	}
+
+	co_switch( sched, co, sched->current ? &sched->current->ctx : &sched->main );
+
+	if( co->state == coDone ){
+		if( co->exception ){
+			return co_rethrow( vm, co->exception );
+		}
+		return co->result;
+	}
+
+	value 		= co->yielded;
+	co->yielded = NULL;
+
+	return ( value ? value : H_DEFAULT_RETURN );
+}
+
+HYBRIS_DEFINE_FUNCTION(hgen_yield){
+	Object *value;
+
+	vm_parse_argv( "O", &value );
+
+	co_sched_t *sched = __co_sched;
+
+	if( sched == NULL || sched->current == NULL || sched->current->generator == false ){
+		return vm_raise_exception( "gen_yield called outside of a generator" );
+	}
+
+	sched->current->yielded = value;
+	sched->current->state	= coReady;
+
+	co_suspend( sched );
+
+	return H_DEFAULT_RETURN;
+}
@@ -18,17 +18,82 @@
 */
 #include <hybris.h>
 #include <errno.h>
+#include <deque>
+#include <map>
+
+using std::deque;
+using std::map;
 
 HYBRIS_DEFINE_FUNCTION(hpthread_create);
 HYBRIS_DEFINE_FUNCTION(hpthread_exit);
 HYBRIS_DEFINE_FUNCTION(hpthread_join);
 HYBRIS_DEFINE_FUNCTION(hpthread_kill);
+HYBRIS_DEFINE_FUNCTION(hpool_create);
+HYBRIS_DEFINE_FUNCTION(hpool_size);
+HYBRIS_DEFINE_FUNCTION(hpool_submit);
+HYBRIS_DEFINE_FUNCTION(hpool_wait);
+HYBRIS_DEFINE_FUNCTION(hpool_wait_all);
+HYBRIS_DEFINE_FUNCTION(hpool_destroy);
+HYBRIS_DEFINE_FUNCTION(hparallel_map);
+HYBRIS_DEFINE_FUNCTION(hparallel_foreach);
+HYBRIS_DEFINE_FUNCTION(hparallel_reduce);
+HYBRIS_DEFINE_FUNCTION(hmutex_create);
+HYBRIS_DEFINE_FUNCTION(hmutex_lock);
+HYBRIS_DEFINE_FUNCTION(hmutex_trylock);
+HYBRIS_DEFINE_FUNCTION(hmutex_unlock);
+HYBRIS_DEFINE_FUNCTION(hrwlock_create);
+HYBRIS_DEFINE_FUNCTION(hrwlock_rdlock);
+HYBRIS_DEFINE_FUNCTION(hrwlock_wrlock);
+HYBRIS_DEFINE_FUNCTION(hrwlock_unlock);
+HYBRIS_DEFINE_FUNCTION(hcond_create);
+HYBRIS_DEFINE_FUNCTION(hcond_wait);
+HYBRIS_DEFINE_FUNCTION(hcond_timedwait);
+HYBRIS_DEFINE_FUNCTION(hcond_signal);
+HYBRIS_DEFINE_FUNCTION(hcond_broadcast);
+HYBRIS_DEFINE_FUNCTION(hbarrier_create);
+HYBRIS_DEFINE_FUNCTION(hbarrier_wait);
+HYBRIS_DEFINE_FUNCTION(hatomic_create);
+HYBRIS_DEFINE_FUNCTION(hatomic_get);
+HYBRIS_DEFINE_FUNCTION(hatomic_set);
+HYBRIS_DEFINE_FUNCTION(hatomic_fetch_add);
+HYBRIS_DEFINE_FUNCTION(hatomic_add);
+HYBRIS_DEFINE_FUNCTION(hatomic_cas);
 
 HYBRIS_EXPORTED_FUNCTIONS() {
 	{ "pthread_create",      hpthread_create, H_REQ_ARGC(1,2), { H_REQ_TYPES(otString), H_REQ_TYPES(otVector) } },
 	{ "pthread_exit", 		 hpthread_exit,   H_NO_ARGS },
 	{ "pthread_join", 		 hpthread_join,   H_REQ_ARGC(1),   { H_REQ_TYPES(otInteger) } },
 	{ "pthread_kill", 		 hpthread_kill,   H_REQ_ARGC(2),   { H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
+	{ "pool_create",         hpool_create,    H_REQ_ARGC(0,1), { H_REQ_TYPES(otInteger) } },
+	{ "pool_size",           hpool_size,      H_NO_ARGS },
+	{ "pool_submit",         hpool_submit,    H_REQ_ARGC(1,2), { H_REQ_TYPES(otString), H_REQ_TYPES(otVector) } },
+	{ "pool_wait",           hpool_wait,      H_REQ_ARGC(1),   { H_REQ_TYPES(otInteger) } },
+	{ "pool_wait_all",       hpool_wait_all,  H_NO_ARGS },
+	{ "pool_destroy",        hpool_destroy,   H_NO_ARGS },
+	{ "parallel_map",        hparallel_map,     H_REQ_ARGC(2), { H_REQ_TYPES(otVector), H_REQ_TYPES(otString) } },
+	{ "parallel_foreach",    hparallel_foreach, H_REQ_ARGC(2), { H_REQ_TYPES(otVector), H_REQ_TYPES(otString) } },
+	{ "parallel_reduce",     hparallel_reduce,  H_REQ_ARGC(3), { H_REQ_TYPES(otVector), H_REQ_TYPES(otString), H_ANY_TYPE } },
+	{ "mutex_create",        hmutex_create,     H_NO_ARGS },
+	{ "mutex_lock",          hmutex_lock,       H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "mutex_trylock",       hmutex_trylock,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "mutex_unlock",        hmutex_unlock,     H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "rwlock_create",       hrwlock_create,    H_NO_ARGS },
+	{ "rwlock_rdlock",       hrwlock_rdlock,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "rwlock_wrlock",       hrwlock_wrlock,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "rwlock_unlock",       hrwlock_unlock,    H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "cond_create",         hcond_create,      H_NO_ARGS },
+	{ "cond_wait",           hcond_wait,        H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otHandle) } },
+	{ "cond_timedwait",      hcond_timedwait,   H_REQ_ARGC(3),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "cond_signal",         hcond_signal,      H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "cond_broadcast",      hcond_broadcast,   H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "barrier_create",      hbarrier_create,   H_REQ_ARGC(1),   { H_REQ_TYPES(otInteger) } },
+	{ "barrier_wait",        hbarrier_wait,     H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "atomic_create",       hatomic_create,    H_REQ_ARGC(0,1), { H_REQ_TYPES(otInteger) } },
+	{ "atomic_get",          hatomic_get,       H_REQ_ARGC(1),   { H_REQ_TYPES(otHandle) } },
+	{ "atomic_set",          hatomic_set,       H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "atomic_fetch_add",    hatomic_fetch_add, H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "atomic_add",          hatomic_add,       H_REQ_ARGC(2),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger) } },
+	{ "atomic_cas",          hatomic_cas,       H_REQ_ARGC(3),   { H_REQ_TYPES(otHandle), H_REQ_TYPES(otInteger), H_REQ_TYPES(otInteger) } },
 	{ "", NULL }
 };
 
@@ -82,6 +147,10 @@ HYBRIS_DEFINE_FUNCTION(hpthread_create){
 						 );
 	}
 
+	/*
+	 * From now on the vm and gc mutexes have to be real ones.
+	 */
+	hyb_set_threaded();
 	/*
 	 * Make sure the thread is not goin to start until we want
 	 * it to start.
@@ -165,3 +234,1041 @@ HYBRIS_DEFINE_FUNCTION(hpthread_kill){
 	}
 }
 
+
+/*
+ * Native thread pool.
+ *
+ * Every worker owns a deque of tasks, it pops new tasks from the back
+ * of its own deque and, when it's empty, steals the oldest task from the
+ * front of the other workers deques.
+ * Tasks submitted from outside the pool are distributed round robin,
+ * tasks submitted by a worker go to its own deque.
+ * Each worker registers its vm scope once and reuses it for every task,
+ * instead of paying a pthread_create + vm_pool for each function call.
+ */
+#define HPOOL_MAX_WORKERS 256
+
+typedef struct _pool	  pool_t;
+typedef struct _pool_task pool_task_t;
+/*
+ * Native task routine, used instead of a script function call
+ * when not NULL.
+ */
+typedef Object *(*pool_routine_t)( pool_t *, pool_task_t * );
+
+typedef struct _pool_task {
+	/*
+	 * Unique task identifier, returned to the script by pool_submit.
+	 */
+	long    id;
+	/*
+	 * Name of the function to call.
+	 */
+	string  function;
+	/*
+	 * Arguments frame, registered as a gc root until the task is
+	 * waited, the return value is pushed here too.
+	 */
+	vmem_t *frame;
+	Object *result;
+	/*
+	 * Unhandled exception of the task, rethrown to whoever waits it.
+	 */
+	Object *exception;
+	bool    done;
+	/*
+	 * Optional native routine and its private data.
+	 */
+	pool_routine_t routine;
+	void		  *data;
+}
+pool_task_t;
+
+typedef struct _pool_deque {
+	pthread_mutex_t      mutex;
+	deque<pool_task_t *> tasks;
+}
+pool_deque_t;
+
+typedef map< long, pool_task_t * > pool_tasks_t;
+
+typedef struct _pool {
+	vm_t		   *vm;
+	size_t          size;
+	pthread_t      *workers;
+	pool_deque_t   *queues;
+	/*
+	 * Round robin index for tasks submitted outside the pool.
+	 */
+	size_t          next;
+	/*
+	 * Number of tasks queued and not yet started.
+	 */
+	long            queued;
+	/*
+	 * Last assigned task identifier.
+	 */
+	long            last_id;
+	bool            running;
+	/*
+	 * Protects 'tasks', 'running', the 'done' flag of each task and
+	 * the two conditions below.
+	 */
+	pthread_mutex_t mutex;
+	/*
+	 * Signaled when a new task is queued.
+	 */
+	pthread_cond_t  work;
+	/*
+	 * Broadcasted when a task is completed, or when a task is queued
+	 * while some worker is blocked in pool_wait_task.
+	 */
+	pthread_cond_t  done;
+	/*
+	 * Number of workers blocked in pool_wait_task.
+	 */
+	long			waiting;
+	/*
+	 * Submitted tasks not waited yet.
+	 */
+	pool_tasks_t    tasks;
+}
+pool_t;
+
+static pool_t 		  *__pool 		= NULL;
+static pthread_mutex_t __pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Index of the pool worker running on the current thread,
+ * -1 if this thread does not belong to the pool.
+ */
+static __thread long   __pool_worker_id = -1;
+
+/*
+ * Pop a task from the worker own deque or steal one from
+ * the other deques, return NULL if every deque is empty.
+ */
+pool_task_t *pool_take( pool_t *pool, long self ){
+	pool_task_t  *task = NULL;
+	pool_deque_t *queue;
+	size_t 		  i, victim;
+
+	if( self >= 0 ){
+		queue = &pool->queues[self];
+
+		pthread_mutex_lock( &queue->mutex );
+		if( queue->tasks.empty() == false ){
+			task = queue->tasks.back();
+			queue->tasks.pop_back();
+		}
+		pthread_mutex_unlock( &queue->mutex );
+	}
+
+	for( i = 1; task == NULL && i <= pool->size; ++i ){
+		victim = (self + i) % pool->size;
+		if( (long)victim == self ){
+			continue;
+		}
+		queue = &pool->queues[victim];
+
+		pthread_mutex_lock( &queue->mutex );
+		if( queue->tasks.empty() == false ){
+			task = queue->tasks.front();
+			queue->tasks.pop_front();
+		}
+		pthread_mutex_unlock( &queue->mutex );
+	}
+
+	if( task ){
+		__sync_fetch_and_sub( &pool->queued, 1 );
+	}
+
+	return task;
+}
+/*
+ * Execute a task on the current thread and signal its completion.
+ */
+void pool_run( pool_t *pool, pool_task_t *task ){
+	Object *result,
+		   *exception = NULL;
+
+	/*
+	 * Keep the return value or the exception alive until someone
+	 * waits for the task, a script result is pushed on the task frame
+	 * before its stack is dismissed.
+	 */
+	if( task->routine ){
+		result = task->routine( pool, task );
+		if( result && task->frame->state.is(Exception) == false ){
+			task->frame->push_tmp( result );
+		}
+	}
+	else{
+		result = vm_exec_threaded_call( pool->vm, task->function, task->frame, task->frame, task->frame );
+	}
+
+	if( task->frame->state.is(Exception) ){
+		exception = task->frame->push_tmp( task->frame->state.e_value );
+		result	  = NULL;
+
+		task->frame->state.unset(Exception);
+	}
+
+	pthread_mutex_lock( &pool->mutex );
+		task->result	= result;
+		task->exception = exception;
+		task->done		= true;
+		pthread_cond_broadcast( &pool->done );
+	pthread_mutex_unlock( &pool->mutex );
+}
+
+void * hyb_pool_worker( void *arg ){
+	pool_t 		*pool = (pool_t *)arg;
+	pool_task_t *task;
+	long 		 self;
+	bool 		 running = true;
+	/*
+	 * Wait for the creator to register every worker scope.
+	 */
+	pthread_mutex_lock(&__vm_sync_mutex);
+	pthread_mutex_unlock(&__vm_sync_mutex);
+
+	for( self = 0; pthread_equal( pool->workers[self], pthread_self() ) == 0; ++self );
+
+	__pool_worker_id = self;
+
+	while( running ){
+		if( (task = pool_take( pool, self )) != NULL ){
+			pool_run( pool, task );
+		}
+		else{
+			pthread_mutex_lock( &pool->mutex );
+			while( pool->running && pool->queued == 0 ){
+				pthread_cond_wait( &pool->work, &pool->mutex );
+			}
+			/*
+			 * Drain the queues before leaving.
+			 */
+			running = ( pool->running || pool->queued > 0 );
+			pthread_mutex_unlock( &pool->mutex );
+		}
+	}
+
+	vm_depool( pool->vm );
+
+	return NULL;
+}
+/*
+ * Create the global pool with 'size' workers, must be called
+ * with __pool_mutex locked.
+ */
+pool_t *pool_create( vm_t *vm, long size ){
+	pool_t *pool = new pool_t;
+	size_t  i;
+
+	pool->vm	  = vm;
+	pool->size    = size;
+	pool->workers = new pthread_t[size];
+	pool->queues  = new pool_deque_t[size];
+	pool->next    = 0;
+	pool->queued  = 0;
+	pool->last_id = 0;
+	pool->running = true;
+	pool->waiting = 0;
+
+	pthread_mutex_init( &pool->mutex, NULL );
+	pthread_cond_init( &pool->work, NULL );
+	pthread_cond_init( &pool->done, NULL );
+
+	for( i = 0; i < pool->size; ++i ){
+		pthread_mutex_init( &pool->queues[i].mutex, NULL );
+	}
+
+	hyb_set_threaded();
+	/*
+	 * Workers will not start until every scope is registered.
+	 */
+	pthread_mutex_lock(&__vm_sync_mutex);
+
+	for( i = 0; i < pool->size; ++i ){
+		if( pthread_create( &pool->workers[i], NULL, hyb_pool_worker, (void *)pool ) != 0 ){
+			hyb_error( H_ET_GENERIC, "Could not create thread pool worker %d", i );
+		}
+		vm_pool( vm, pool->workers[i] );
+	}
+
+	pthread_mutex_unlock(&__vm_sync_mutex);
+
+	return pool;
+}
+/*
+ * Return the global pool, creating it with one worker per
+ * online cpu if it does not exist yet.
+ */
+pool_t *pool_get( vm_t *vm ){
+	pthread_mutex_lock( &__pool_mutex );
+	if( __pool == NULL ){
+		__pool = pool_create( vm, sysconf(_SC_NPROCESSORS_ONLN) );
+	}
+	pthread_mutex_unlock( &__pool_mutex );
+
+	return __pool;
+}
+/*
+ * Queue a new task, 'frame' will be owned by the pool.
+ */
+pool_task_t *pool_submit( pool_t *pool, string& function, vmem_t *frame, pool_routine_t routine = NULL, void *data = NULL ){
+	pool_task_t  *task = new pool_task_t;
+	pool_deque_t *queue;
+
+	task->function  = function;
+	task->frame     = frame;
+	task->result    = H_UNDEFINED;
+	task->exception = NULL;
+	task->done      = false;
+	task->routine  = routine;
+	task->data     = data;
+
+	gc_add_root( frame );
+
+	pthread_mutex_lock( &pool->mutex );
+		task->id = ++pool->last_id;
+		pool->tasks[task->id] = task;
+	pthread_mutex_unlock( &pool->mutex );
+
+	if( __pool_worker_id >= 0 ){
+		queue = &pool->queues[__pool_worker_id];
+	}
+	else{
+		queue = &pool->queues[ __sync_fetch_and_add( &pool->next, 1 ) % pool->size ];
+	}
+
+	pthread_mutex_lock( &queue->mutex );
+		queue->tasks.push_back(task);
+	pthread_mutex_unlock( &queue->mutex );
+
+	pthread_mutex_lock( &pool->mutex );
+		++pool->queued;
+		pthread_cond_signal( &pool->work );
+		if( pool->waiting > 0 ){
+			pthread_cond_broadcast( &pool->done );
+		}
+	pthread_mutex_unlock( &pool->mutex );
+
+	return task;
+}
+/*
+ * Wait for the task to complete, must be called with pool->mutex locked.
+ * When called from a worker, other tasks are executed meanwhile so that
+ * nested submit/wait calls can not starve the pool, with nothing to run
+ * the worker sleeps until a task completes or a new one is queued.
+ */
+void pool_wait_task( pool_t *pool, pool_task_t *task ){
+	pool_task_t *other;
+
+	while( task->done == false ){
+		if( __pool_worker_id >= 0 ){
+			pthread_mutex_unlock( &pool->mutex );
+			if( (other = pool_take( pool, __pool_worker_id )) != NULL ){
+				pool_run( pool, other );
+			}
+			pthread_mutex_lock( &pool->mutex );
+
+			if( other == NULL && task->done == false && pool->queued == 0 ){
+				++pool->waiting;
+				pthread_cond_wait( &pool->done, &pool->mutex );
+				--pool->waiting;
+			}
+		}
+		else{
+			pthread_cond_wait( &pool->done, &pool->mutex );
+		}
+	}
+}
+/*
+ * Release a completed task and return its result, must be called
+ * with pool->mutex locked.
+ * The result is moved on the 'owner' frame before the task frame,
+ * which was keeping it alive, is deleted.
+ * If the task raised an exception, it's stored in 'exception' (when
+ * not already set) and kept alive on 'owner' as well.
+ */
+Object *pool_release_task( pool_t *pool, pool_task_t *task, vmem_t *owner = NULL, Object **exception = NULL ){
+	Object *result = task->result;
+
+	if( exception && *exception == NULL && task->exception ){
+		*exception = owner->push_tmp( task->exception );
+	}
+
+	if( owner && result ){
+		owner->push_tmp( result );
+	}
+
+	pool->tasks.erase( task->id );
+
+	gc_remove_root( task->frame );
+
+	delete task->frame;
+	delete task;
+
+	return result;
+}
+
+void pool_destroy( pool_t *pool ){
+	size_t i;
+
+	pthread_mutex_lock( &pool->mutex );
+		pool->running = false;
+		pthread_cond_broadcast( &pool->work );
+	pthread_mutex_unlock( &pool->mutex );
+
+	for( i = 0; i < pool->size; ++i ){
+		pthread_join( pool->workers[i], NULL );
+	}
+
+	pthread_mutex_lock( &pool->mutex );
+	while( pool->tasks.empty() == false ){
+		pool_release_task( pool, pool->tasks.begin()->second );
+	}
+	pthread_mutex_unlock( &pool->mutex );
+
+	delete[] pool->workers;
+	delete[] pool->queues;
+	delete pool;
+}
+
+extern "C" void hybris_module_fini( vm_t * vm ){
+	pthread_mutex_lock( &__pool_mutex );
+	if( __pool ){
+		pool_destroy( __pool );
+		__pool = NULL;
+	}
+	pthread_mutex_unlock( &__pool_mutex );
+}
+
+/*
+ * Rethrow the exception of a task on the calling frame.
+ */
+static Object *pool_rethrow( vm_t *vm, Object *exception ){
+	vm_mm_lock( vm );
+		vm_frame(vm)->state.set( Exception, exception );
+	vm_mm_unlock( vm );
+
+	return H_DEFAULT_ERROR;
+}
+/*
+ * Unknown functions would make vm_exec_threaded_call abort the
+ * interpreter inside a worker, so they are checked before submitting.
+ */
+static bool pool_has_function( vm_t *vm, string& name ){
+	return ( vm->vcode.get( (char *)name.c_str() ) != H_UNDEFINED );
+}
+
+HYBRIS_DEFINE_FUNCTION(hpool_create){
+	long size = sysconf(_SC_NPROCESSORS_ONLN);
+
+	vm_parse_argv( "l", &size );
+
+	if( size <= 0 || size > HPOOL_MAX_WORKERS ){
+		return vm_raise_exception( "Invalid number of pool workers %d, valid range is 1-%d", size, HPOOL_MAX_WORKERS );
+	}
+
+	pthread_mutex_lock( &__pool_mutex );
+	/*
+	 * An explicit size different from the current one recreates the
+	 * pool, as long as it's idle.
+	 */
+	if( __pool && vm_argc() > 0 && __pool->size != (size_t)size ){
+		if( __pool_worker_id >= 0 ){
+			pthread_mutex_unlock( &__pool_mutex );
+			return vm_raise_exception( "A pool worker can not resize its own pool" );
+		}
+
+		pthread_mutex_lock( &__pool->mutex );
+		bool busy = ( __pool->tasks.empty() == false );
+		pthread_mutex_unlock( &__pool->mutex );
+
+		if( busy ){
+			pthread_mutex_unlock( &__pool_mutex );
+			return vm_raise_exception( "Can not resize the thread pool to %d workers while it has pending tasks", size );
+		}
+
+		pool_destroy( __pool );
+		__pool = NULL;
+	}
+	if( __pool == NULL ){
+		__pool = pool_create( vm, size );
+	}
+	size = __pool->size;
+	pthread_mutex_unlock( &__pool_mutex );
+
+	return ob_dcast( gc_new_integer(size) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hpool_size){
+	return ob_dcast( gc_new_integer( __pool ? __pool->size : 0 ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hpool_submit){
+	Vector *task_argv = NULL;
+	vmem_t *frame     = new vmem_t;
+	string  function;
+	int     argc;
+	Integer index(0);
+
+	vm_parse_argv( "sV", &function, &task_argv );
+
+	if( pool_has_function( vm, function ) == false ){
+		delete frame;
+		return vm_raise_exception( "'%s' undeclared user function identifier", function.c_str() );
+	}
+
+	argc = (task_argv ? ob_get_size( (Object *)task_argv ) : 0);
+
+	for( ; index.value < argc; ++index.value ){
+		frame->push( ob_cl_at( (Object *)task_argv, (Object *)&index ) );
+	}
+
+	pool_task_t *task = pool_submit( pool_get(vm), function, frame );
+
+	return ob_dcast( gc_new_integer(task->id) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hpool_wait){
+	long 	     id;
+	pool_task_t *task;
+	Object		*result,
+				*exception = NULL;
+
+	vm_parse_argv( "l", &id );
+
+	if( __pool == NULL ){
+		return vm_raise_exception( "Thread pool not created" );
+	}
+
+	pthread_mutex_lock( &__pool->mutex );
+
+	pool_tasks_t::iterator i_task = __pool->tasks.find(id);
+	if( i_task == __pool->tasks.end() ){
+		pthread_mutex_unlock( &__pool->mutex );
+		return vm_raise_exception( "Unknown or already waited task %d", id );
+	}
+
+	task = i_task->second;
+
+	pool_wait_task( __pool, task );
+
+	result = pool_release_task( __pool, task, data, &exception );
+
+	pthread_mutex_unlock( &__pool->mutex );
+
+	if( exception ){
+		return pool_rethrow( vm, exception );
+	}
+
+	return ( result ? result : H_DEFAULT_RETURN );
+}
+
+HYBRIS_DEFINE_FUNCTION(hpool_wait_all){
+	Vector *results   = gc_new_vector();
+	Object *exception = NULL;
+
+	if( __pool == NULL ){
+		return ob_dcast(results);
+	}
+
+	/*
+	 * Keep the results vector alive while waiting.
+	 */
+	data->push_tmp( (Object *)results );
+
+	pthread_mutex_lock( &__pool->mutex );
+	/*
+	 * Tasks are ordered by id, hence by submission order.
+	 */
+	while( __pool->tasks.empty() == false ){
+		pool_task_t *task = __pool->tasks.begin()->second;
+
+		pool_wait_task( __pool, task );
+
+		Object *result = pool_release_task( __pool, task, data, &exception );
+
+		ob_cl_push( (Object *)results, result ? result : H_DEFAULT_RETURN );
+	}
+
+	pthread_mutex_unlock( &__pool->mutex );
+
+	data->remove_tmp( (Object *)results );
+	/*
+	 * Every task is released anyway, then the first exception raised
+	 * is rethrown.
+	 */
+	if( exception ){
+		return pool_rethrow( vm, exception );
+	}
+
+	return ob_dcast(results);
+}
+
+HYBRIS_DEFINE_FUNCTION(hpool_destroy){
+	if( __pool_worker_id >= 0 ){
+		return vm_raise_exception( "A pool worker can not destroy its own pool" );
+	}
+
+	hybris_module_fini(vm);
+
+	return H_DEFAULT_RETURN;
+}
+
+/*
+ * Parallel collection primitives.
+ *
+ * The vector is split into chunks (a few for each worker, so that
+ * stealing can balance uneven workloads), each chunk is processed by a
+ * native pool task calling the user function on every item, then the
+ * chunk results are merged in order on the calling thread.
+ */
+#define HPARALLEL_CHUNKS_PER_WORKER 4
+
+enum parallel_mode_t {
+	pmMap = 0,
+	pmForeach,
+	pmReduce
+};
+
+typedef struct {
+	parallel_mode_t mode;
+	Vector		   *input;
+	size_t			begin;
+	size_t 			end;
+}
+parallel_chunk_t;
+
+Object *parallel_chunk_routine( pool_t *pool, pool_task_t *task ){
+	parallel_chunk_t *chunk   = (parallel_chunk_t *)task->data;
+	Object 			 *results = H_UNDEFINED,
+					 *acc	  = H_UNDEFINED,
+					 *item,
+					 *result;
+	size_t 			  i;
+
+	if( chunk->mode == pmMap ){
+		/*
+		 * The task frame is a gc root, so partial results are safe.
+		 */
+		results = task->frame->push_tmp( (Object *)gc_new_vector() );
+	}
+
+	for( i = chunk->begin; i < chunk->end; ++i ){
+		vmem_t argv;
+
+		item = chunk->input->value[i];
+		/*
+		 * The first item of a chunk is the reduction seed, the
+		 * 'init' value is applied only once while merging.
+		 */
+		if( chunk->mode == pmReduce ){
+			if( acc == H_UNDEFINED ){
+				acc = item;
+				continue;
+			}
+			argv.push( acc );
+		}
+
+		argv.push( item );
+
+		result = vm_exec_threaded_call( pool->vm, task->function, &argv, task->frame, task->frame );
+		/*
+		 * Stop at the first exception, pool_run will hand it to
+		 * parallel_run.
+		 */
+		if( task->frame->state.is(Exception) ){
+			return H_UNDEFINED;
+		}
+
+		if( chunk->mode == pmMap ){
+			ob_cl_push( results, result ? result : H_DEFAULT_RETURN );
+			if( result ){
+				task->frame->remove_tmp( result );
+			}
+		}
+		else if( chunk->mode == pmReduce ){
+			acc = ( result ? result : H_DEFAULT_RETURN );
+		}
+	}
+
+	return ( chunk->mode == pmMap ? results : acc );
+}
+
+Object *parallel_run( vm_t *vm, vmem_t *data, parallel_mode_t mode, Vector *input, string& function, Object *init = H_UNDEFINED ){
+	pool_t 			   	*pool = pool_get(vm);
+	size_t 			   	 size( input->items ),
+						 n_chunks( pool->size * HPARALLEL_CHUNKS_PER_WORKER ),
+						 chunk_size,
+						 i;
+	Object			   	*output = H_UNDEFINED,
+						*exception = NULL,
+						*result;
+	vector<pool_task_t *> tasks;
+	parallel_chunk_t   	*chunks;
+
+	if( pool_has_function( vm, function ) == false ){
+		return vm_raise_exception( "'%s' undeclared user function identifier", function.c_str() );
+	}
+
+	if( size == 0 ){
+		return ( mode == pmMap ? (Object *)gc_new_vector() : init );
+	}
+
+	n_chunks   = ( n_chunks > size ? size : n_chunks );
+	chunk_size = ( size + n_chunks - 1 ) / n_chunks;
+	n_chunks   = ( size + chunk_size - 1 ) / chunk_size;
+	chunks	   = new parallel_chunk_t[n_chunks];
+
+	for( i = 0; i < n_chunks; ++i ){
+		chunks[i].mode  = mode;
+		chunks[i].input = input;
+		chunks[i].begin = i * chunk_size;
+		chunks[i].end   = ( chunks[i].begin + chunk_size > size ? size : chunks[i].begin + chunk_size );
+
+		tasks.push_back( pool_submit( pool, function, new vmem_t, parallel_chunk_routine, &chunks[i] ) );
+	}
+
+	if( mode == pmMap ){
+		output = data->push_tmp( (Object *)gc_new_vector() );
+	}
+	else if( mode == pmReduce ){
+		output = init;
+	}
+	/*
+	 * Merge chunk results following the chunks order.
+	 */
+	pthread_mutex_lock( &pool->mutex );
+
+	for( i = 0; i < n_chunks; ++i ){
+		pool_wait_task( pool, tasks[i] );
+
+		result = pool_release_task( pool, tasks[i], data, &exception );
+		/*
+		 * Once an exception is raised the remaining chunks are only
+		 * waited and released.
+		 */
+		if( exception ){
+			continue;
+		}
+
+		if( mode == pmMap ){
+			VectorIterator ri;
+			vv_foreach( vector<Object *>, ri, ob_vector_ucast(result)->value ){
+				ob_cl_push_reference( output, *ri );
+			}
+			/*
+			 * Items are now referenced by the output vector.
+			 */
+			data->remove_tmp( result );
+		}
+		else if( mode == pmReduce ){
+			vmem_t argv;
+
+			argv.push( output );
+			argv.push( result );
+
+			pthread_mutex_unlock( &pool->mutex );
+			output = vm_exec_threaded_call( vm, function, &argv, data, data );
+			if( data->state.is(Exception) ){
+				exception = data->push_tmp( data->state.e_value );
+				data->state.unset(Exception);
+			}
+			pthread_mutex_lock( &pool->mutex );
+		}
+	}
+
+	pthread_mutex_unlock( &pool->mutex );
+
+	delete[] chunks;
+
+	if( exception ){
+		return pool_rethrow( vm, exception );
+	}
+
+	return ( output ? output : H_DEFAULT_RETURN );
+}
+
+HYBRIS_DEFINE_FUNCTION(hparallel_map){
+	Vector *input;
+	string  function;
+
+	vm_parse_argv( "Vs", &input, &function );
+
+	return parallel_run( vm, data, pmMap, input, function );
+}
+
+HYBRIS_DEFINE_FUNCTION(hparallel_foreach){
+	Vector *input;
+	string  function;
+
+	vm_parse_argv( "Vs", &input, &function );
+
+	parallel_run( vm, data, pmForeach, input, function );
+
+	return H_DEFAULT_RETURN;
+}
+
+HYBRIS_DEFINE_FUNCTION(hparallel_reduce){
+	Vector *input;
+	string  function;
+	Object *init;
+
+	vm_parse_argv( "VsO", &input, &function, &init );
+
+	return parallel_run( vm, data, pmReduce, input, function, init );
+}
+
+/*
+ * Synchronization primitives, each one is a Handle to the native
+ * pthread (or plain long for atomics) structure, destroyed by the
+ * handle finalizer once unreferenced.
+ */
+#define sync_handle( type, o ) ((type *)ob_handle_val(o))
+
+static void mutex_finalize( void *value ){
+	pthread_mutex_destroy( (pthread_mutex_t *)value );
+	delete (pthread_mutex_t *)value;
+}
+
+static void rwlock_finalize( void *value ){
+	pthread_rwlock_destroy( (pthread_rwlock_t *)value );
+	delete (pthread_rwlock_t *)value;
+}
+
+static void cond_finalize( void *value ){
+	pthread_cond_destroy( (pthread_cond_t *)value );
+	delete (pthread_cond_t *)value;
+}
+
+static void barrier_finalize( void *value ){
+	pthread_barrier_destroy( (pthread_barrier_t *)value );
+	delete (pthread_barrier_t *)value;
+}
+
+static void atomic_finalize( void *value ){
+	delete (long *)value;
+}
+/*
+ * Wrap a synchronization structure into a handle owning it.
+ */
+static Object *sync_new_handle( void *value, handle_finalizer_t finalizer ){
+	Handle *handle = gc_new_handle(value);
+
+	handle_set_finalizer( handle, finalizer );
+
+	return ob_dcast( handle );
+}
+
+HYBRIS_DEFINE_FUNCTION(hmutex_create){
+	pthread_mutex_t *mutex = new pthread_mutex_t;
+
+	pthread_mutex_init( mutex, NULL );
+
+	return sync_new_handle( mutex, mutex_finalize );
+}
+
+HYBRIS_DEFINE_FUNCTION(hmutex_lock){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_integer( pthread_mutex_lock( sync_handle( pthread_mutex_t, h ) ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hmutex_trylock){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_boolean( pthread_mutex_trylock( sync_handle( pthread_mutex_t, h ) ) == 0 ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hmutex_unlock){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_integer( pthread_mutex_unlock( sync_handle( pthread_mutex_t, h ) ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hrwlock_create){
+	pthread_rwlock_t *rwlock = new pthread_rwlock_t;
+
+	pthread_rwlock_init( rwlock, NULL );
+
+	return sync_new_handle( rwlock, rwlock_finalize );
+}
+
+HYBRIS_DEFINE_FUNCTION(hrwlock_rdlock){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_integer( pthread_rwlock_rdlock( sync_handle( pthread_rwlock_t, h ) ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hrwlock_wrlock){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_integer( pthread_rwlock_wrlock( sync_handle( pthread_rwlock_t, h ) ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hrwlock_unlock){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_integer( pthread_rwlock_unlock( sync_handle( pthread_rwlock_t, h ) ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hcond_create){
+	pthread_cond_t *cond = new pthread_cond_t;
+
+	pthread_cond_init( cond, NULL );
+
+	return sync_new_handle( cond, cond_finalize );
+}
+
+HYBRIS_DEFINE_FUNCTION(hcond_wait){
+	Handle *c, *m;
+
+	vm_parse_argv( "HH", &c, &m );
+
+	return ob_dcast( gc_new_integer( pthread_cond_wait( sync_handle( pthread_cond_t, c ), sync_handle( pthread_mutex_t, m ) ) ) );
+}
+/*
+ * Wait at most 'ms' milliseconds, return false on timeout.
+ */
+HYBRIS_DEFINE_FUNCTION(hcond_timedwait){
+	Handle *c, *m;
+	long    ms;
+	struct timespec ts;
+
+	vm_parse_argv( "HHl", &c, &m, &ms );
+
+	clock_gettime( CLOCK_REALTIME, &ts );
+
+	ts.tv_sec  += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if( ts.tv_nsec >= 1000000000 ){
+		ts.tv_sec  += 1;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	return ob_dcast( gc_new_boolean( pthread_cond_timedwait( sync_handle( pthread_cond_t, c ), sync_handle( pthread_mutex_t, m ), &ts ) != ETIMEDOUT ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hcond_signal){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_integer( pthread_cond_signal( sync_handle( pthread_cond_t, h ) ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hcond_broadcast){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_integer( pthread_cond_broadcast( sync_handle( pthread_cond_t, h ) ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hbarrier_create){
+	long count;
+	pthread_barrier_t *barrier;
+
+	vm_parse_argv( "l", &count );
+
+	if( count <= 0 ){
+		return vm_raise_exception( "Invalid barrier count %d", count );
+	}
+
+	barrier = new pthread_barrier_t;
+
+	pthread_barrier_init( barrier, NULL, count );
+
+	return sync_new_handle( barrier, barrier_finalize );
+}
+/*
+ * Return true on one (arbitrary) thread once the barrier opens,
+ * false on the others.
+ */
+HYBRIS_DEFINE_FUNCTION(hbarrier_wait){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_boolean( pthread_barrier_wait( sync_handle( pthread_barrier_t, h ) ) == PTHREAD_BARRIER_SERIAL_THREAD ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hatomic_create){
+	long *value = new long;
+
+	*value = 0;
+
+	vm_parse_argv( "l", value );
+
+	return sync_new_handle( value, atomic_finalize );
+}
+
+HYBRIS_DEFINE_FUNCTION(hatomic_get){
+	Handle *h;
+
+	vm_parse_argv( "H", &h );
+
+	return ob_dcast( gc_new_integer( __atomic_load_n( sync_handle( long, h ), __ATOMIC_SEQ_CST ) ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hatomic_set){
+	Handle *h;
+	long    value;
+
+	vm_parse_argv( "Hl", &h, &value );
+
+	__atomic_store_n( sync_handle( long, h ), value, __ATOMIC_SEQ_CST );
+
+	return H_DEFAULT_RETURN;
+}
+/*
+ * Add 'delta' and return the previous value.
+ */
+HYBRIS_DEFINE_FUNCTION(hatomic_fetch_add){
+	Handle *h;
+	long    delta;
+
+	vm_parse_argv( "Hl", &h, &delta );
+
+	return ob_dcast( gc_new_integer( __atomic_fetch_add( sync_handle( long, h ), delta, __ATOMIC_SEQ_CST ) ) );
+}
+/*
+ * Add 'delta' and return the new value.
+ */
+HYBRIS_DEFINE_FUNCTION(hatomic_add){
+	Handle *h;
+	long    delta;
+
+	vm_parse_argv( "Hl", &h, &delta );
+
+	return ob_dcast( gc_new_integer( __atomic_add_fetch( sync_handle( long, h ), delta, __ATOMIC_SEQ_CST ) ) );
+}
+/*
+ * Set the value to 'desired' if it's equal to 'expected',
+ * return true on success.
+ */
+HYBRIS_DEFINE_FUNCTION(hatomic_cas){
+	Handle *h;
+	long    expected,
+			desired;
+
+	vm_parse_argv( "Hll", &h, &expected, &desired );
+
+	return ob_dcast( gc_new_boolean( __atomic_compare_exchange_n( sync_handle( long, h ), &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ) ) );
+}
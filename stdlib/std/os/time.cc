@@ -24,6 +24,8 @@
 
 HYBRIS_DEFINE_FUNCTION(hticks);
 HYBRIS_DEFINE_FUNCTION(hfticks);
+HYBRIS_DEFINE_FUNCTION(hmonotonic);
+HYBRIS_DEFINE_FUNCTION(hmonotonic_ns);
 HYBRIS_DEFINE_FUNCTION(husleep);
 HYBRIS_DEFINE_FUNCTION(hsleep);
 HYBRIS_DEFINE_FUNCTION(htime);
@@ -31,13 +33,15 @@ HYBRIS_DEFINE_FUNCTION(hstrtime);
 HYBRIS_DEFINE_FUNCTION(hstrdate);
 
 HYBRIS_EXPORTED_FUNCTIONS() {
-	{ "ticks",   hticks,   H_NO_ARGS },
-	{ "fticks",  hfticks,  H_NO_ARGS },
-	{ "usleep",  husleep,  H_REQ_ARGC(1), { H_REQ_TYPES(otInteger) } },
-	{ "sleep",   hsleep,   H_REQ_ARGC(1), { H_REQ_TYPES(otInteger) } },
-	{ "time",    htime,    H_NO_ARGS },
-	{ "strtime", hstrtime, H_NO_ARGS },
-	{ "strdate", hstrdate, H_NO_ARGS },
+	{ "ticks",        hticks,        H_NO_ARGS },
+	{ "fticks",       hfticks,       H_NO_ARGS },
+	{ "monotonic",    hmonotonic,    H_NO_ARGS },
+	{ "monotonic_ns", hmonotonic_ns, H_NO_ARGS },
+	{ "usleep",       husleep,       H_REQ_ARGC(1), { H_REQ_TYPES(otInteger) } },
+	{ "sleep",        hsleep,        H_REQ_ARGC(1), { H_REQ_TYPES(otInteger) } },
+	{ "time",         htime,         H_NO_ARGS },
+	{ "strtime",      hstrtime,      H_NO_ARGS },
+	{ "strdate",      hstrdate,      H_NO_ARGS },
 	{ "", NULL }
 };
 
@@ -63,6 +67,24 @@ HYBRIS_DEFINE_FUNCTION(hfticks){
     return ob_dcast( gc_new_float( ts.tv_sec + ts.tv_usec * 0.000001 ) );
 }
 
+/*
+ * Monotonic clocks, not affected by system time changes, to be
+ * used to measure elapsed time.
+ */
+HYBRIS_DEFINE_FUNCTION(hmonotonic){
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ob_dcast( gc_new_float( ts.tv_sec + ts.tv_nsec * 0.000000001 ) );
+}
+
+HYBRIS_DEFINE_FUNCTION(hmonotonic_ns){
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ob_dcast( gc_new_integer( ts.tv_sec * 1000000000L + ts.tv_nsec ) );
+}
+
 HYBRIS_DEFINE_FUNCTION(husleep){
 	int us;
 	struct timespec ts;
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# This file is part of the Hybris programming language.
+#
+# Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+#
+# Hybris is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Hybris is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Script tests runner.
+#
+# Every tests/*.hy script is executed and its TestSuite report parsed, a
+# script fails if it exits with a non zero status, if its report has a
+# <failure .../> entry or if it has no <success .../> entry at all.
+# The exit status is the number of failed scripts.
+#
+# Usage : tests/run.sh [hybris binary] [script.hy ...]
+#
+HYBRIS=${1:-hybris}
+[ $# -gt 0 ] && shift
+
+TESTS_DIR=$(dirname "$0")
+
+if [ $# -eq 0 ]; then
+	set -- "$TESTS_DIR"/*.hy
+fi
+
+failed=0
+for script in "$@"; do
+	name=$(basename "$script" .hy)
+
+	if ! report=$("$HYBRIS" "$script" 2>&1); then
+		status="exited with a non zero status"
+	elif echo "$report" | grep -q '<failure '; then
+		status="failed"
+	elif ! echo "$report" | grep -q '<success '; then
+		status="no test was run"
+	else
+		echo "$name : ok"
+		continue
+	fi
+
+	echo "$name : $status" >&2
+	echo "$report" >&2
+	failed=$((failed + 1))
+done
+
+exit $failed
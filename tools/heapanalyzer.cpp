@@ -0,0 +1,507 @@
+/*
+ * This file is part of the Hybris programming language interpreter.
+ *
+ * Copyleft of Simone Margaritelli aka evilsocket <evilsocket@gmail.com>
+ *
+ * Hybris is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Hybris is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Hybris.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Offline analyzer for the heap snapshots written by std.gc gc_dump.
+ *
+ * Builds the object graph (plus a virtual root referencing every root
+ * set object), computes its dominator tree with the Lengauer-Tarjan
+ * algorithm and prints :
+ *
+ * 	- Objects count and bytes per type.
+ * 	- The objects with the biggest retained size (the memory that would
+ * 	  be released if the object itself was released), with the chain of
+ * 	  their dominators.
+ *
+ * The snapshot is read three times instead of being kept in memory, and
+ * the graph is stored in compressed arrays of 32 bit indexes, so heaps of
+ * tens of millions of objects can be analyzed.
+ *
+ * Usage: heapanalyzer <snapshot> [top objects, default 30]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+using std::vector;
+using std::string;
+using std::map;
+
+#define NONE ((uint32_t)-1)
+
+typedef struct {
+	unsigned long address;
+	uint32_t	  size;
+	uint32_t	  type;
+}
+object_t;
+
+static bool object_cmp( const object_t& a, const object_t& b ){
+	return a.address < b.address;
+}
+
+typedef struct {
+	vector<object_t>  objects;
+	vector<string>	  types;
+	/*
+	 * Successors and predecessors in compressed form, node 'objects.size()'
+	 * is the virtual root.
+	 */
+	vector<uint32_t>  succ_index;
+	vector<uint32_t>  succ;
+	vector<uint32_t>  pred_index;
+	vector<uint32_t>  pred;
+	vector<uint32_t>  roots;
+}
+graph_t;
+
+/*
+ * Find the index of an object given its address.
+ */
+static uint32_t graph_find( graph_t& g, unsigned long address ){
+	object_t key;
+	vector<object_t>::iterator i;
+
+	key.address = address;
+	i = std::lower_bound( g.objects.begin(), g.objects.end(), key, object_cmp );
+	if( i == g.objects.end() || i->address != address ){
+		return NONE;
+	}
+
+	return (uint32_t)( i - g.objects.begin() );
+}
+
+/*
+ * First pass, load objects and intern type names.
+ */
+static void load_objects( FILE *fp, graph_t& g ){
+	char 					 line[1024], *p, *end;
+	map<string,uint32_t> 	 types;
+	map<string,uint32_t>::iterator ti;
+	object_t 				 o;
+
+	while( fgets( line, sizeof(line), fp ) ){
+		if( line[0] != 'O' ){
+			continue;
+		}
+		o.address = strtoul( line + 2, &p, 16 );
+		o.size    = (uint32_t)strtoul( p, &p, 10 );
+		while( *p == ' ' ){
+			++p;
+		}
+		if( (end = strchr( p, '\n' )) ){
+			*end = 0x00;
+		}
+		if( (ti = types.find(p)) == types.end() ){
+			o.type = g.types.size();
+			types[p] = o.type;
+			g.types.push_back(p);
+		}
+		else{
+			o.type = ti->second;
+		}
+		g.objects.push_back(o);
+	}
+
+	std::sort( g.objects.begin(), g.objects.end(), object_cmp );
+}
+
+/*
+ * Second and third pass, count and then store the edges.
+ */
+static void load_edges( FILE *fp, graph_t& g ){
+	char 			 line[1024], *p;
+	uint32_t 		 n = g.objects.size(),
+					 from,
+					 to,
+					 i;
+	vector<uint32_t> fill;
+	int				 pass;
+
+	g.succ_index.assign( n + 2, 0 );
+
+	for( pass = 0; pass < 2; ++pass ){
+		rewind(fp);
+		while( fgets( line, sizeof(line), fp ) ){
+			if( line[0] == 'E' ){
+				from = graph_find( g, strtoul( line + 2, &p, 16 ) );
+				to	 = graph_find( g, strtoul( p, &p, 16 ) );
+			}
+			else if( line[0] == 'R' ){
+				from = n;
+				to	 = graph_find( g, strtoul( line + 2, &p, 16 ) );
+			}
+			else{
+				continue;
+			}
+			if( from == NONE || to == NONE ){
+				continue;
+			}
+			if( pass == 0 ){
+				g.succ_index[from + 1]++;
+			}
+			else{
+				g.succ[ fill[from]++ ] = to;
+			}
+		}
+
+		if( pass == 0 ){
+			for( i = 1; i < n + 2; ++i ){
+				g.succ_index[i] += g.succ_index[i - 1];
+			}
+			g.succ.resize( g.succ_index[n + 1] );
+			fill.assign( g.succ_index.begin(), g.succ_index.end() - 1 );
+		}
+	}
+	/*
+	 * Build predecessors from successors.
+	 */
+	g.pred_index.assign( n + 2, 0 );
+	for( i = 0; i < g.succ.size(); ++i ){
+		g.pred_index[ g.succ[i] + 1 ]++;
+	}
+	for( i = 1; i < n + 2; ++i ){
+		g.pred_index[i] += g.pred_index[i - 1];
+	}
+	g.pred.resize( g.succ.size() );
+	fill.assign( g.pred_index.begin(), g.pred_index.end() - 1 );
+	for( from = 0; from < n + 1; ++from ){
+		for( i = g.succ_index[from]; i < g.succ_index[from + 1]; ++i ){
+			g.pred[ fill[ g.succ[i] ]++ ] = from;
+		}
+	}
+}
+
+typedef struct {
+	/*
+	 * Node to dfs number and back.
+	 */
+	vector<uint32_t> dfnum;
+	vector<uint32_t> vertex;
+	/*
+	 * All the following are indexed by dfs number.
+	 */
+	vector<uint32_t> parent;
+	vector<uint32_t> semi;
+	vector<uint32_t> idom;
+	vector<uint32_t> ancestor;
+	vector<uint32_t> label;
+	vector<uint32_t> bucket;
+	vector<uint32_t> next;
+	vector<uint32_t> path;
+	uint32_t		 reached;
+}
+dominators_t;
+
+/*
+ * Iterative depth first visit from the virtual root.
+ */
+static void dom_dfs( graph_t& g, dominators_t& d ){
+	uint32_t root = g.objects.size(),
+			 node,
+			 child;
+	vector< std::pair<uint32_t,uint32_t> > stack;
+
+	d.dfnum.assign( root + 1, NONE );
+	d.vertex.clear();
+	d.parent.clear();
+
+	d.dfnum[root] = 0;
+	d.vertex.push_back(root);
+	d.parent.push_back(NONE);
+	stack.push_back( std::make_pair( root, g.succ_index[root] ) );
+
+	while( stack.empty() == false ){
+		node = stack.back().first;
+		if( stack.back().second == g.succ_index[node + 1] ){
+			stack.pop_back();
+			continue;
+		}
+		child = g.succ[ stack.back().second++ ];
+		if( d.dfnum[child] == NONE ){
+			d.dfnum[child] = d.vertex.size();
+			d.vertex.push_back(child);
+			d.parent.push_back( d.dfnum[node] );
+			stack.push_back( std::make_pair( child, g.succ_index[child] ) );
+		}
+	}
+
+	d.reached = d.vertex.size();
+}
+
+static void dom_compress( dominators_t& d, uint32_t v ){
+	uint32_t x = v, y, a;
+
+	d.path.clear();
+	while( d.ancestor[ d.ancestor[x] ] != NONE ){
+		d.path.push_back(x);
+		x = d.ancestor[x];
+	}
+	while( d.path.empty() == false ){
+		y = d.path.back();
+		d.path.pop_back();
+		a = d.ancestor[y];
+		if( d.semi[ d.label[a] ] < d.semi[ d.label[y] ] ){
+			d.label[y] = d.label[a];
+		}
+		d.ancestor[y] = d.ancestor[a];
+	}
+}
+
+static uint32_t dom_eval( dominators_t& d, uint32_t v ){
+	if( d.ancestor[v] == NONE ){
+		return v;
+	}
+	dom_compress( d, v );
+	return d.label[v];
+}
+
+static void dominators( graph_t& g, dominators_t& d ){
+	uint32_t n, w, v, u, p, i, node;
+
+	dom_dfs( g, d );
+
+	n = d.reached;
+	d.semi.resize(n);
+	d.label.resize(n);
+	d.idom.assign( n, NONE );
+	d.ancestor.assign( n, NONE );
+	d.bucket.assign( n, NONE );
+	d.next.assign( n, NONE );
+	for( i = 0; i < n; ++i ){
+		d.semi[i]  = i;
+		d.label[i] = i;
+	}
+
+	for( w = n - 1; w > 0; --w ){
+		node = d.vertex[w];
+		for( i = g.pred_index[node]; i < g.pred_index[node + 1]; ++i ){
+			if( (v = d.dfnum[ g.pred[i] ]) == NONE ){
+				continue;
+			}
+			u = dom_eval( d, v );
+			if( d.semi[u] < d.semi[w] ){
+				d.semi[w] = d.semi[u];
+			}
+		}
+		d.next[w] = d.bucket[ d.semi[w] ];
+		d.bucket[ d.semi[w] ] = w;
+
+		p = d.parent[w];
+		d.ancestor[w] = p;
+
+		for( v = d.bucket[p]; v != NONE; v = d.next[v] ){
+			u = dom_eval( d, v );
+			d.idom[v] = ( d.semi[u] < d.semi[v] ? u : p );
+		}
+		d.bucket[p] = NONE;
+	}
+
+	for( w = 1; w < n; ++w ){
+		if( d.idom[w] != d.semi[w] ){
+			d.idom[w] = d.idom[ d.idom[w] ];
+		}
+	}
+}
+
+static const char *dom_name( graph_t& g, dominators_t& d, uint32_t w ){
+	static char name[0xFF];
+
+	if( w == 0 ){
+		return "<roots>";
+	}
+	object_t& o = g.objects[ d.vertex[w] ];
+	snprintf( name, sizeof(name), "%s@%lx", g.types[o.type].c_str(), o.address );
+
+	return name;
+}
+
+typedef struct {
+	size_t objects;
+	size_t bytes;
+	size_t retained;
+}
+type_stat_t;
+
+struct RetainedGreater {
+	vector<uint64_t>& retained;
+
+	RetainedGreater( vector<uint64_t>& r ) : retained(r) {}
+
+	bool operator()( uint32_t a, uint32_t b ) const {
+		return retained[a] > retained[b];
+	}
+};
+
+struct TypeGreater {
+	vector<type_stat_t>& types;
+
+	TypeGreater( vector<type_stat_t>& t ) : types(t) {}
+
+	bool operator()( uint32_t a, uint32_t b ) const {
+		return types[a].retained > types[b].retained;
+	}
+};
+
+/*
+ * Account the retained size of each object on its type, unless the object
+ * is dominated by another object of the same type (otherwise nested
+ * structures would be counted more times).
+ * The dominator tree is visited depth first keeping, for each type, the
+ * number of objects of that type on the current path.
+ */
+static void type_retained( graph_t& g, dominators_t& d, vector<uint64_t>& retained, vector<type_stat_t>& types ){
+	vector<uint32_t> index( d.reached + 1, 0 ),
+					 children,
+					 fill,
+					 active( types.size(), 0 );
+	vector< std::pair<uint32_t,uint32_t> > stack;
+	uint32_t		 w, type;
+
+	for( w = 1; w < d.reached; ++w ){
+		index[ d.idom[w] + 1 ]++;
+	}
+	for( w = 1; w <= d.reached; ++w ){
+		index[w] += index[w - 1];
+	}
+	children.resize( index[d.reached] );
+	fill.assign( index.begin(), index.end() - 1 );
+	for( w = 1; w < d.reached; ++w ){
+		children[ fill[ d.idom[w] ]++ ] = w;
+	}
+
+	stack.push_back( std::make_pair( 0, index[0] ) );
+	while( stack.empty() == false ){
+		w = stack.back().first;
+		if( stack.back().second == index[w + 1] ){
+			if( w != 0 ){
+				active[ g.objects[ d.vertex[w] ].type ]--;
+			}
+			stack.pop_back();
+			continue;
+		}
+		w	 = children[ stack.back().second++ ];
+		type = g.objects[ d.vertex[w] ].type;
+		if( active[type]++ == 0 ){
+			types[type].retained += retained[w];
+		}
+		stack.push_back( std::make_pair( w, index[w] ) );
+	}
+}
+
+int main( int argc, char **argv ){
+	FILE 			   *fp;
+	graph_t 			g;
+	dominators_t 		d;
+	vector<uint64_t>	retained;
+	vector<uint32_t>	top;
+	vector<type_stat_t> types;
+	vector<uint32_t>	order;
+	size_t 				ntop = 30,
+						total_bytes = 0,
+						reached_bytes = 0,
+						i, depth;
+	uint32_t			w, x;
+
+	if( argc < 2 ){
+		fprintf( stderr, "Usage: %s <snapshot> [top objects]\n", argv[0] );
+		return 1;
+	}
+	if( argc > 2 ){
+		ntop = strtoul( argv[2], NULL, 10 );
+	}
+	if( (fp = fopen( argv[1], "r" )) == NULL ){
+		perror( argv[1] );
+		return 1;
+	}
+
+	load_objects( fp, g );
+	load_edges( fp, g );
+	fclose(fp);
+
+	dominators( g, d );
+	/*
+	 * Retained sizes, each node is accounted on its immediate dominator,
+	 * which always has a lower dfs number.
+	 */
+	retained.assign( d.reached, 0 );
+	for( w = 1; w < d.reached; ++w ){
+		retained[w] = g.objects[ d.vertex[w] ].size;
+		reached_bytes += retained[w];
+	}
+	for( w = d.reached - 1; w > 0; --w ){
+		retained[ d.idom[w] ] += retained[w];
+	}
+	/*
+	 * Per type statistics.
+	 */
+	type_stat_t empty = { 0, 0, 0 };
+	types.assign( g.types.size(), empty );
+	for( i = 0; i < g.objects.size(); ++i ){
+		types[ g.objects[i].type ].objects++;
+		types[ g.objects[i].type ].bytes += g.objects[i].size;
+		total_bytes += g.objects[i].size;
+	}
+	type_retained( g, d, retained, types );
+
+	printf( "Objects     : %lu (%lu bytes)\n", g.objects.size(), total_bytes );
+	printf( "Reachable   : %u (%lu bytes)\n", d.reached - 1, reached_bytes );
+	printf( "Unreachable : %lu (%lu bytes)\n\n", g.objects.size() - (d.reached - 1), total_bytes - reached_bytes );
+
+	for( i = 0; i < types.size(); ++i ){
+		order.push_back(i);
+	}
+	std::sort( order.begin(), order.end(), TypeGreater(types) );
+
+	printf( "%-32s %12s %14s %14s\n", "type", "objects", "bytes", "retained" );
+	for( i = 0; i < order.size(); ++i ){
+		printf( "%-32s %12lu %14lu %14lu\n",
+				g.types[ order[i] ].c_str(),
+				types[ order[i] ].objects,
+				types[ order[i] ].bytes,
+				types[ order[i] ].retained );
+	}
+	/*
+	 * Biggest retainers.
+	 */
+	for( w = 1; w < d.reached; ++w ){
+		top.push_back(w);
+	}
+	ntop = std::min( ntop, top.size() );
+	std::partial_sort( top.begin(), top.begin() + ntop, top.end(), RetainedGreater(retained) );
+
+	printf( "\n%-40s %10s %14s  %s\n", "object", "size", "retained", "dominators" );
+	for( i = 0; i < ntop; ++i ){
+		w = top[i];
+		printf( "%-40s %10u %14lu  ", dom_name( g, d, w ), g.objects[ d.vertex[w] ].size, retained[w] );
+		for( x = d.idom[w], depth = 0; depth < 8; x = d.idom[x], ++depth ){
+			printf( "%s%s", depth ? " < " : "", dom_name( g, d, x ) );
+			if( x == 0 ){
+				break;
+			}
+		}
+		printf( "\n" );
+	}
+
+	return 0;
+}